@@ -0,0 +1,75 @@
+#ifndef AABB_H_
+#define AABB_H_
+#include <algorithm>
+#include <limits>
+
+#include "vec3.h"
+#include "ray.h"
+
+// Axis-aligned bounding box
+struct AABB {
+  point3 lo = {std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+               std::numeric_limits<double>::infinity()};
+  point3 hi = {-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+               -std::numeric_limits<double>::infinity()};
+
+  AABB() {}
+  AABB(const point3 &lo, const point3 &hi) : lo(lo), hi(hi) {}
+
+  void grow(const point3 &p) {
+    for (int k = 0; k < 3; ++k) {
+      lo.e[k] = std::min(lo.e[k], p.e[k]);
+      hi.e[k] = std::max(hi.e[k], p.e[k]);
+    }
+  }
+
+  void grow(const AABB &b) {
+    for (int k = 0; k < 3; ++k) {
+      lo.e[k] = std::min(lo.e[k], b.lo.e[k]);
+      hi.e[k] = std::max(hi.e[k], b.hi.e[k]);
+    }
+  }
+
+  bool empty() const {
+    return lo.e[0] > hi.e[0];
+  }
+
+  point3 center() const {
+    return 0.5 * (lo + hi);
+  }
+
+  vec3 extent() const {
+    return hi - lo;
+  }
+
+  // Axis with the largest extent
+  int longest_axis() const {
+    vec3 e = extent();
+    return e.e[0] > e.e[1] ? (e.e[0] > e.e[2] ? 0 : 2) : (e.e[1] > e.e[2] ? 1 : 2);
+  }
+
+  double surface_area() const {
+    if (empty()) {
+      return 0;
+    }
+    vec3 e = extent();
+    return 2 * (e.e[0] * e.e[1] + e.e[1] * e.e[2] + e.e[2] * e.e[0]);
+  }
+};
+
+// Slab test of a ray against a box, using the ray's precomputed reciprocal
+// direction and signs so each axis is two multiplies and no swap
+// t_near/t_far - in: the interval of interest, out: the part of it inside the box
+// returns true if the interval overlaps the box
+inline bool hit_aabb(const AABB &box, const Ray &r, double &t_near, double &t_far) {
+  const point3 *corners[2] = {&box.lo, &box.hi};
+  for (int k = 0; k < 3; ++k) {
+    double t0 = (corners[r.sign[k]]->e[k] - r.origin.e[k]) * r.inv_direction.e[k];
+    double t1 = (corners[1 - r.sign[k]]->e[k] - r.origin.e[k]) * r.inv_direction.e[k];
+    t_near = t0 > t_near ? t0 : t_near;
+    t_far = t1 < t_far ? t1 : t_far;
+  }
+  return t_near <= t_far;
+}
+
+#endif
@@ -0,0 +1,496 @@
+#ifndef ACCEL_SCENE_H_
+#define ACCEL_SCENE_H_
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vec3.h"
+#include "ray.h"
+#include "hit.h"
+#include "aabb.h"
+#include "scene.h"
+#include "light.h"
+#include "occluder_cache.h"
+#include "grid.h"
+#include "bvh.h"
+#include "rng.h"
+
+// Scenes too large to list at compile time. Spheres and mesh triangles sit
+// behind an acceleration structure; planes are unbounded so they are tested
+// directly. It answers the same closest/any/describe queries as StaticScene,
+// so every render path that takes a scene can render it.
+
+// Indexed triangle mesh sharing one material, lit with its geometric normals
+struct TriangleMesh {
+  std::vector<point3> vertices;
+  // Three vertex indices per triangle
+  std::vector<uint32_t> indices;
+  Material material = Material({0.8, 0.8, 0.8}, true);
+
+  size_t size() const {
+    return indices.size() / 3;
+  }
+
+  Triangle triangle(size_t i) const {
+    const point3 &v0 = vertices[indices[3 * i]];
+    const point3 &v1 = vertices[indices[3 * i + 1]];
+    const point3 &v2 = vertices[indices[3 * i + 2]];
+    return Triangle(v0, v1, v2, unit_vector(cross(v1 - v0, v2 - v0)), material);
+  }
+
+  double intersect(size_t i, const Ray &r) const {
+    return hit_triangle(r, vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]]);
+  }
+
+  AABB bounds(size_t i) const {
+    AABB box;
+    for (int k = 0; k < 3; ++k) {
+      box.grow(vertices[indices[3 * i + k]]);
+    }
+    return box;
+  }
+};
+
+// Acceleration structures an AccelScene can be built with
+enum class AccelType {
+  // Chosen by choose_accel() from the primitives' distribution
+  Auto,
+  Grid,
+  Bvh,
+  // Chosen by building both and timing a probe set of rays
+  Calibrate
+};
+
+inline const char *accel_name(AccelType type) {
+  switch (type) {
+    case AccelType::Auto: return "auto";
+    case AccelType::Grid: return "grid";
+    case AccelType::Bvh: return "bvh";
+    case AccelType::Calibrate: return "calibrate";
+  }
+  return "";
+}
+
+// Picks grid or BVH from primitive count and spatial distribution.
+// A grid pays off when primitives fill the scene bounds evenly and are small
+// next to a cell: most cells are then occupied and each primitive lands in
+// few cells. Surfaces such as meshes leave most cells of a volume grid empty
+// and clustered scenes overfill a few cells, both of which a BVH adapts to.
+// why - output, the measurements the choice was based on
+inline AccelType choose_accel(const std::vector<AABB> &bounds, std::string *why = nullptr) {
+  const size_t min_grid_prims = 64;
+  const double min_occupancy = 0.3;
+  const double max_duplication = 4;
+
+  AABB scene;
+  for (const AABB &b : bounds) {
+    scene.grow(b);
+  }
+  if (bounds.size() < min_grid_prims || scene.empty()) {
+    if (why != nullptr) {
+      *why = "few primitives";
+    }
+    return AccelType::Bvh;
+  }
+
+  // Cells of a grid with one cell per primitive, as grid.h sizes them
+  vec3 extent = scene.extent();
+  double pad = 1e-6 * std::max({extent.e[0], extent.e[1], extent.e[2]}) + 1e-9;
+  for (int k = 0; k < 3; ++k) {
+    extent.e[k] += 2 * pad;
+  }
+  double per_unit = std::cbrt(bounds.size() / (extent.e[0] * extent.e[1] * extent.e[2]));
+  int res[3];
+  for (int k = 0; k < 3; ++k) {
+    res[k] = std::max(1, std::min(grid_max_resolution, static_cast<int>(extent.e[k] * per_unit)));
+  }
+
+  // Fraction of cells holding a primitive centre, and cells each primitive overlaps
+  std::vector<char> occupied(static_cast<size_t>(res[0]) * res[1] * res[2], 0);
+  double overlapped = 0;
+  for (const AABB &b : bounds) {
+    size_t cell = 0;
+    double cells = 1;
+    point3 c = b.center();
+    for (int k = 2; k >= 0; --k) {
+      double scale = res[k] / extent.e[k];
+      int i = std::min(res[k] - 1, static_cast<int>((c.e[k] - scene.lo.e[k] + pad) * scale));
+      cell = cell * res[k] + i;
+      cells *= std::floor((b.hi.e[k] - b.lo.e[k]) * scale) + 1;
+    }
+    occupied[cell] = 1;
+    overlapped += cells;
+  }
+  double occupancy = std::count(occupied.begin(), occupied.end(), 1) / static_cast<double>(occupied.size());
+  double duplication = overlapped / bounds.size();
+
+  if (why != nullptr) {
+    std::ostringstream out;
+    out << "occupancy " << occupancy << ", cells per primitive " << duplication;
+    *why = out.str();
+  }
+  return occupancy >= min_occupancy && duplication <= max_duplication ? AccelType::Grid : AccelType::Bvh;
+}
+
+class AccelScene {
+  public:
+    std::vector<Sphere> spheres;
+    TriangleMesh mesh;
+    std::vector<Plane> planes;
+    LightSet lights;
+
+    // Builds the acceleration structure over the spheres and mesh and the light
+    // sampling table, call after filling them in
+    // type - structure to build, Auto and Calibrate choose one
+    // probes - camera rays Calibrate times both structures with
+    // rays_per_probe - rays the full render traces per probe, to weigh trace time against build time
+    void build(AccelType type, const std::vector<Ray> &probes = std::vector<Ray>(), double rays_per_probe = 1) {
+      lights.build();
+      std::vector<AABB> bounds;
+      bounds.reserve(bounded());
+      for (const Sphere &s : spheres) {
+        vec3 r = {s.radius, s.radius, s.radius};
+        bounds.push_back(AABB(s.center - r, s.center + r));
+      }
+      for (size_t i = 0; i < mesh.size(); ++i) {
+        bounds.push_back(mesh.bounds(i));
+      }
+
+      std::ostringstream info;
+      const bool calibrated = type == AccelType::Calibrate;
+      if (type == AccelType::Auto) {
+        std::string why;
+        type = choose_accel(bounds, &why);
+        info << accel_name(type) << " (auto: " << why << ")";
+      } else if (calibrated) {
+        // Each trace times the structure built just before it, so they're separate statements.
+        // Both structures are kept until the choice, which then needs no rebuild.
+        const double grid_build = build_timed(AccelType::Grid, bounds);
+        const double grid_ms = grid_build + trace_ms(probes) * rays_per_probe;
+        const double bvh_build = build_timed(AccelType::Bvh, bounds);
+        const double bvh_ms = bvh_build + trace_ms(probes) * rays_per_probe;
+        type = grid_ms < bvh_ms ? AccelType::Grid : AccelType::Bvh;
+        build_ms_ = type == AccelType::Grid ? grid_build : bvh_build;
+        info << accel_name(type) << " (calibrated: grid " << grid_ms << " ms, bvh " << bvh_ms
+             << " ms estimated build + render)";
+      } else {
+        info << accel_name(type);
+      }
+
+      if (!calibrated) {
+        build_ms_ = build_timed(type, bounds);
+      }
+      // Frees the structure not chosen
+      type_ = type;
+      if (type == AccelType::Grid) {
+        bvh_ = Bvh();
+      } else {
+        grid_ = UniformGrid();
+      }
+      info << ", " << bounded() << " primitives, built in " << build_ms_ << " ms";
+      if (type == AccelType::Grid) {
+        const int *res = grid_.resolution();
+        info << ", " << res[0] << "x" << res[1] << "x" << res[2] << " cells, " << grid_.references() << " references";
+      } else {
+        info << ", " << bvh_.nodes().size() << " nodes, SAH cost " << bvh_.sah_cost();
+      }
+      info_ = info.str();
+    }
+
+    bool closest(const Ray &r, Hit &hit) const {
+      NoTraversalStats none;
+      return find_closest(r, hit, none);
+    }
+
+    bool any(const Ray &r) const {
+      NoTraversalStats none;
+      return find_any(r, none);
+    }
+
+    // Shadow ray towards a light, tried first against the primitive that last blocked
+    // the light on this thread
+    bool any(const Ray &r, uint32_t light) const {
+      NoTraversalStats none;
+      return find_any(r, light, none);
+    }
+
+    // The same queries, counting the walk into stats (traversal_stats.h); planes and
+    // the cached occluder count as primitives tested
+    bool closest(const Ray &r, Hit &hit, TraversalStats &stats) const {
+      return find_closest(r, hit, stats);
+    }
+
+    bool any(const Ray &r, TraversalStats &stats) const {
+      return find_any(r, stats);
+    }
+
+    bool any(const Ray &r, uint32_t light, TraversalStats &stats) const {
+      return find_any(r, light, stats);
+    }
+
+    // Fills in the shading details of a hit whose t and prim are already known
+    void describe(const Ray &r, Hit &hit) const {
+      size_t id = hit.prim;
+      if (id < spheres.size()) {
+        describe_prim(spheres[id], r, hit);
+      } else if (id < bounded()) {
+        describe_prim(mesh.triangle(id - spheres.size()), r, hit);
+      } else {
+        describe_prim(planes[id - bounded()], r, hit);
+      }
+    }
+
+    // Calls f(primitive, id) for every primitive in id order, mesh triangles as Triangles
+    template <typename F>
+    void visit(F &f) const {
+      int id = 0;
+      for (const Sphere &s : spheres) {
+        f(s, id++);
+      }
+      for (size_t i = 0; i < mesh.size(); ++i) {
+        f(mesh.triangle(i), id++);
+      }
+      for (const Plane &p : planes) {
+        f(p, id++);
+      }
+    }
+
+    // Shadow rays per shading point
+    int light_samples() const {
+      return lights.samples_per_point;
+    }
+
+    // Picks a light in proportion to its power
+    LightSample sample_light(double u) const {
+      return lights.sample(u);
+    }
+
+    // Structure in use and how long it took to build
+    const std::string &info() const {
+      return info_;
+    }
+
+    double build_ms() const {
+      return build_ms_;
+    }
+
+  private:
+    template <typename Stats>
+    bool find_closest(const Ray &r, Hit &hit, Stats &stats) const {
+      for (size_t i = 0; i < planes.size(); ++i) {
+        stats.prim();
+        double t = planes[i].intersect(r);
+        if (t > r.t_min && t < hit.t && t < r.t_max) {
+          hit.t = t;
+          hit.prim = static_cast<int>(bounded() + i);
+        }
+      }
+
+      BoundedTest test = {*this};
+      uint32_t prim;
+      bool found = type_ == AccelType::Grid ? grid_.closest(r, test, hit.t, prim, stats)
+                                            : bvh_.closest(r, test, hit.t, prim, stats);
+      if (found) {
+        hit.prim = static_cast<int>(prim);
+      }
+      if (hit.prim < 0) {
+        return false;
+      }
+      describe(r, hit);
+      return true;
+    }
+
+    template <typename Stats>
+    bool find_any(const Ray &r, Stats &stats) const {
+      for (const Plane &p : planes) {
+        stats.prim();
+        if (in_range(r, p.intersect(r))) {
+          return true;
+        }
+      }
+      BoundedTest test = {*this};
+      return type_ == AccelType::Grid ? grid_.any(r, test, stats) : bvh_.any(r, test, stats);
+    }
+
+    template <typename Stats>
+    bool find_any(const Ray &r, uint32_t light, Stats &stats) const {
+      OccluderCache &cache = occluder_cache();
+      uint32_t cached = cache.get(light);
+      if (cached < bounded() + planes.size()) {
+        stats.prim();
+        if (in_range(r, intersect(cached, r))) {
+          cache.hit();
+          return true;
+        }
+      }
+
+      for (size_t i = 0; i < planes.size(); ++i) {
+        stats.prim();
+        if (in_range(r, planes[i].intersect(r))) {
+          cache.record(light, static_cast<uint32_t>(bounded() + i));
+          return true;
+        }
+      }
+      // The traversal stops at the first primitive the test reports a hit with
+      uint32_t occluder = no_occluder;
+      auto test = [&](uint32_t id, const Ray &ray) {
+        double t = intersect(id, ray);
+        if (in_range(ray, t)) {
+          occluder = id;
+        }
+        return t;
+      };
+      bool found = type_ == AccelType::Grid ? grid_.any(r, test, stats) : bvh_.any(r, test, stats);
+      if (found) {
+        cache.record(light, occluder);
+      }
+      return found;
+    }
+
+    // Intersects bounded primitive id: spheres first, then mesh triangles
+    struct BoundedTest {
+      const AccelScene &scene;
+
+      double operator()(uint32_t id, const Ray &r) const {
+        if (id < scene.spheres.size()) {
+          return scene.spheres[id].intersect(r);
+        }
+        return scene.mesh.intersect(id - scene.spheres.size(), r);
+      }
+    };
+
+    size_t bounded() const {
+      return spheres.size() + mesh.size();
+    }
+
+    static bool in_range(const Ray &r, double t) {
+      return t > r.t_min && t < r.t_max;
+    }
+
+    // Intersects any primitive id, planes after the bounded ones
+    double intersect(uint32_t id, const Ray &r) const {
+      if (id < bounded()) {
+        return BoundedTest{*this}(id, r);
+      }
+      return planes[id - bounded()].intersect(r);
+    }
+
+    template <typename P>
+    static void describe_prim(const P &prim, const Ray &r, Hit &hit) {
+      hit.p = r.at(hit.t);
+      hit.normal = prim.normal_at(hit.p);
+      hit.albedo = prim.material.albedo;
+      hit.shadowed = prim.material.shadowed;
+      if (prim.material.texture >= 0) {
+        hit.albedo = hit.albedo * sample_material(prim.material, prim.uv_at(hit.p), r, hit);
+      }
+    }
+
+    double build_timed(AccelType type, const std::vector<AABB> &bounds) {
+      auto start = std::chrono::steady_clock::now();
+      type_ = type;
+      if (type == AccelType::Grid) {
+        grid_.build(bounds);
+      } else {
+        bvh_.build(bounds);
+      }
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+      return elapsed.count();
+    }
+
+    // Time to trace each probe and a shadow ray from its hit, with the current structure
+    double trace_ms(const std::vector<Ray> &probes) const {
+      auto start = std::chrono::steady_clock::now();
+      for (const Ray &r : probes) {
+        Hit hit;
+        if (closest(r, hit)) {
+          any(segment_ray(hit.p, sample_light(hash_point(hit.p)).position));
+        }
+      }
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+      return elapsed.count();
+    }
+
+    AccelType type_ = AccelType::Bvh;
+    UniformGrid grid_;
+    Bvh bvh_;
+    double build_ms_ = 0;
+    std::string info_;
+};
+
+// The product shot's ground plane and light, which every generated scene shares
+inline void add_ground(AccelScene &scene) {
+  scene.planes.push_back(Plane({0, 0, 0}, {0, 1, 0}, Material({0.8, 0.1, 0.1}, true)));
+  scene.lights.clear();
+  scene.lights.add({{10, 10, 10}, {1, 1, 1}});
+}
+
+// Field of randomly placed spheres in front of the camera
+// count - number of spheres
+// seed - placement and colour sequence
+inline void make_particle_scene(AccelScene &scene, size_t count, uint64_t seed = 1) {
+  const AABB region({-1.5, 0.05, -3.5}, {1.5, 1.5, -0.8});
+  const color palette[] = {{0, 0.8, 0.8}, {0.8, 0.8, 0.8}, {0.9, 0.6, 0.1}, {0.3, 0.5, 0.9}};
+  vec3 extent = region.extent();
+  // Spheres fill about 3% of the region whatever the count
+  double radius = std::cbrt(0.03 * extent.x() * extent.y() * extent.z() / count * 3 / (4 * M_PI));
+
+  Rng rng(seed);
+  scene.spheres.clear();
+  scene.spheres.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    point3 center = {region.lo.x() + rng.uniform() * extent.x(), region.lo.y() + rng.uniform() * extent.y(),
+                     region.lo.z() + rng.uniform() * extent.z()};
+    scene.spheres.push_back(Sphere(center, radius * (0.5 + rng.uniform()), Material(palette[i % 4], true)));
+  }
+  add_ground(scene);
+}
+
+// Bumpy tessellated sphere standing where the product shot's sphere is
+// triangles - approximate triangle count
+inline void make_mesh_scene(AccelScene &scene, size_t triangles) {
+  const point3 center = {0, 0.6, -2};
+  const double radius = 0.55;
+  // Latitude bands, each split into twice as many segments around
+  const size_t bands = std::max<size_t>(2, static_cast<size_t>(std::sqrt(triangles / 4.0)));
+  const size_t segments = 2 * bands;
+
+  TriangleMesh &mesh = scene.mesh;
+  mesh.vertices.clear();
+  mesh.indices.clear();
+  mesh.material = Material({0, 0.8, 0.8}, true);
+  mesh.vertices.reserve((bands + 1) * (segments + 1));
+  mesh.indices.reserve(6 * bands * segments);
+  for (size_t b = 0; b <= bands; ++b) {
+    double theta = M_PI * b / bands;
+    for (size_t s = 0; s <= segments; ++s) {
+      double phi = 2 * M_PI * s / segments;
+      double bump = 1 + 0.06 * std::sin(7 * theta) * std::sin(9 * phi);
+      vec3 n = {std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi)};
+      mesh.vertices.push_back(center + radius * bump * n);
+    }
+  }
+  for (size_t b = 0; b < bands; ++b) {
+    for (size_t s = 0; s < segments; ++s) {
+      uint32_t i0 = static_cast<uint32_t>(b * (segments + 1) + s);
+      uint32_t i1 = i0 + 1;
+      uint32_t i2 = static_cast<uint32_t>(i0 + segments + 1);
+      uint32_t i3 = i2 + 1;
+      // The pole bands' degenerate triangles are skipped
+      if (b > 0) {
+        mesh.indices.insert(mesh.indices.end(), {i0, i1, i2});
+      }
+      if (b + 1 < bands) {
+        mesh.indices.insert(mesh.indices.end(), {i1, i3, i2});
+      }
+    }
+  }
+  add_ground(scene);
+}
+
+#endif
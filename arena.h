@@ -0,0 +1,186 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Render-time memory that the heap only sees while a loop warms up. Scratch
+// such as jitter samples and per-row counters comes from a per-thread bump
+// arena, rewound by an ArenaScope when the row, tile or frame ends; blocks are
+// kept, so once a thread has seen its largest frame it allocates nothing.
+// Larger, longer lived buffers (framebuffers, ray batches) come from a Pool
+// that hands released objects out again. heap_allocations() counts every
+// operator new, so a caller can check a loop makes none once warm.
+
+// Bytes per arena block, requests larger than this get a block of their own
+const size_t arena_block_size = 64 * 1024;
+
+class Arena {
+  public:
+    // Position to rewind to, see ArenaScope
+    struct Mark {
+      size_t block, offset;
+    };
+
+    Arena() = default;
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // Uninitialised room for count Ts, aligned for T, valid until rewound past
+    template <typename T>
+    T *allocate(size_t count) {
+      static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destroyed");
+      const size_t align = alignof(T), size = count * sizeof(T);
+      for (;;) {
+        if (block_ < blocks_.size()) {
+          size_t start = (offset_ + align - 1) / align * align;
+          if (start + size <= blocks_[block_].size) {
+            offset_ = start + size;
+            return reinterpret_cast<T *>(blocks_[block_].data.get() + start);
+          }
+          // Doesn't fit, move on to the next block
+          ++block_;
+          offset_ = 0;
+          continue;
+        }
+        blocks_.push_back({std::unique_ptr<char[]>(new char[std::max(size + align, arena_block_size)]),
+                           std::max(size + align, arena_block_size)});
+      }
+    }
+
+    // count Ts, value initialised
+    template <typename T>
+    T *make(size_t count) {
+      T *items = allocate<T>(count);
+      for (size_t i = 0; i < count; ++i) {
+        new (&items[i]) T();
+      }
+      return items;
+    }
+
+    Mark mark() const {
+      return {block_, offset_};
+    }
+
+    // Frees everything allocated since mark, keeping the blocks
+    void rewind(Mark mark) {
+      block_ = mark.block;
+      offset_ = mark.offset;
+    }
+
+    // Bytes held in blocks
+    size_t capacity() const {
+      size_t bytes = 0;
+      for (const Block &b : blocks_) {
+        bytes += b.size;
+      }
+      return bytes;
+    }
+
+  private:
+    struct Block {
+      std::unique_ptr<char[]> data;
+      size_t size;
+    };
+
+    std::vector<Block> blocks_;
+    // Block being filled and the first free byte in it
+    size_t block_ = 0, offset_ = 0;
+};
+
+// This thread's arena
+inline Arena &thread_arena() {
+  thread_local Arena arena;
+  return arena;
+}
+
+// Rewinds an arena to where it was on construction when it goes out of scope
+class ArenaScope {
+  public:
+    explicit ArenaScope(Arena &arena = thread_arena()) : arena_(arena), mark_(arena.mark()) {}
+
+    ~ArenaScope() {
+      arena_.rewind(mark_);
+    }
+
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope &operator=(const ArenaScope &) = delete;
+
+  private:
+    Arena &arena_;
+    Arena::Mark mark_;
+};
+
+// Free list of objects reused across frames, e.g. framebuffers and ray batches.
+// Objects keep whatever memory they grew, so resizing one that has held a
+// frame as large allocates nothing.
+template <typename T>
+class Pool {
+  public:
+    // Returns its object to the pool when destroyed
+    class Lease {
+      public:
+        Lease(Pool &pool, std::unique_ptr<T> object) : pool_(&pool), object_(std::move(object)) {}
+        Lease(Lease &&other) = default;
+
+        ~Lease() {
+          if (object_) {
+            pool_->release(std::move(object_));
+          }
+        }
+
+        T &operator*() const {
+          return *object_;
+        }
+
+        T *operator->() const {
+          return object_.get();
+        }
+
+      private:
+        Pool *pool_;
+        std::unique_ptr<T> object_;
+    };
+
+    // A released object if there is one, otherwise a new default constructed one
+    Lease acquire() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (free_.empty()) {
+        return Lease(*this, std::unique_ptr<T>(new T()));
+      }
+      std::unique_ptr<T> object = std::move(free_.back());
+      free_.pop_back();
+      return Lease(*this, std::move(object));
+    }
+
+  private:
+    void release(std::unique_ptr<T> object) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_.push_back(std::move(object));
+    }
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<T>> free_;
+};
+
+// Process-wide pool of Ts
+template <typename T>
+Pool<T> &pool() {
+  static Pool<T> objects;
+  return objects;
+}
+
+// Calls to operator new so far, counted by the replacement in main.cpp
+inline std::atomic<uint64_t> &heap_allocations() {
+  static std::atomic<uint64_t> count(0);
+  return count;
+}
+
+#endif
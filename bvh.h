@@ -0,0 +1,468 @@
+#ifndef BVH_H_
+#define BVH_H_
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "traversal_stats.h"
+#include "parallel.h"
+
+// Bounding volume hierarchy over primitive bounds. Nodes are stored depth
+// first, so an interior node's first child directly follows it, and are
+// traversed near child first with a small explicit stack.
+//
+// Splits are chosen with the surface area heuristic over binned centroids
+// (Wald 2007): each axis is cut into bvh_bins slabs, and the cut between
+// slabs with the lowest expected intersection cost wins, which costs one
+// pass over a node's primitives instead of a sort. Large nodes bin in
+// parallel, and their subtrees are built as separate tasks.
+
+// Centroid slabs per axis a split is chosen from
+const int bvh_bins = 16;
+// Nodes with at most this many primitives become leaves without trying a split
+const size_t bvh_leaf_size = 4;
+// Most primitives a leaf holds unless they can't be told apart
+const size_t bvh_max_leaf_size = 16;
+// Deepest tree the traversal stack can hold
+const int bvh_max_depth = 64;
+// SAH cost of visiting a node, relative to intersecting one primitive
+const double bvh_traversal_cost = 1.0;
+// Nodes with fewer primitives are built by a single thread
+const size_t bvh_parallel_size = 1 << 15;
+
+struct BvhNode {
+  AABB box;
+  // Leaves: first entry in the primitive order, interior nodes: index of the second child
+  uint32_t index;
+  // Primitives in a leaf, 0 for interior nodes
+  uint32_t count;
+  // Axis the children were split along
+  uint32_t axis;
+};
+
+class Bvh {
+  public:
+    // Builds the tree, replacing any previous one
+    // bounds - box of each primitive, its index is the id passed to test()
+    // threads - worker count, 0 for default_threads()
+    void build(const std::vector<AABB> &bounds, unsigned threads = 0) {
+      nodes_.clear();
+      order_.resize(bounds.size());
+      if (bounds.empty()) {
+        return;
+      }
+      if (threads == 0) {
+        threads = default_threads();
+      }
+
+      refs_.resize(bounds.size());
+      RangeBounds root;
+      over_range(0, bounds.size(), threads, root, [&](size_t begin, size_t end, RangeBounds &result) {
+        for (size_t i = begin; i < end; ++i) {
+          refs_[i].box = BuildBox(bounds[i]);
+          refs_[i].id = static_cast<uint32_t>(i);
+          result.box.grow(refs_[i].box);
+          result.centroids.grow(refs_[i].box.center().e);
+        }
+      });
+
+      nodes_.reserve(2 * bounds.size() + 1);
+      std::unique_ptr<Binning> binning(new Binning());
+      build_subtree(nodes_, 0, bounds.size(), root, 0, threads, *binning);
+      for (size_t i = 0; i < refs_.size(); ++i) {
+        order_[i] = refs_[i].id;
+      }
+      refs_.clear();
+      refs_.shrink_to_fit();
+    }
+
+    // Expected cost of tracing a random ray that hits the root, in primitive
+    // intersections: each node weighted by the chance of entering it, its area over the root's
+    double sah_cost() const {
+      if (nodes_.empty()) {
+        return 0;
+      }
+      double cost = 0;
+      for (const BvhNode &node : nodes_) {
+        cost += node.box.surface_area() * (node.count > 0 ? node.count : bvh_traversal_cost);
+      }
+      return cost / nodes_[0].box.surface_area();
+    }
+
+    // Finds the closest primitive within the ray's range
+    // test - called as test(id, r), returns t of the hit or <= 0 for a miss
+    // t - in: only hits closer than this and r.t_max count, out: t of the closest hit
+    // prim - output, id of the closest primitive
+    // stats - counts the walk, see traversal_stats.h
+    // returns true if a hit closer than t was found
+    template <typename Test, typename Stats = NoTraversalStats>
+    bool closest(const Ray &r, const Test &test, double &t, uint32_t &prim, Stats &&stats = Stats()) const {
+      bool found = false;
+      t = std::min(t, r.t_max);
+      traverse(r, t, [&](uint32_t id) {
+        double t_hit = test(id, r);
+        if (t_hit > r.t_min && t_hit < t) {
+          t = t_hit;
+          prim = id;
+          found = true;
+        }
+        return false;
+      }, stats);
+      return found;
+    }
+
+    // Returns true if any primitive is hit within the ray's range
+    template <typename Test, typename Stats = NoTraversalStats>
+    bool any(const Ray &r, const Test &test, Stats &&stats = Stats()) const {
+      bool found = false;
+      traverse(r, r.t_max, [&](uint32_t id) {
+        double t_hit = test(id, r);
+        found = t_hit > r.t_min && t_hit < r.t_max;
+        return found;
+      }, stats);
+      return found;
+    }
+
+    const std::vector<BvhNode> &nodes() const {
+      return nodes_;
+    }
+
+  private:
+    // Single precision box the builder works with, halving the memory it streams
+    // through. Rounded outwards from the AABB, so it still encloses the primitive.
+    struct BuildBox {
+      float lo[3] = {std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(),
+                     std::numeric_limits<float>::infinity()};
+      float hi[3] = {-std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(),
+                     -std::numeric_limits<float>::infinity()};
+
+      BuildBox() {}
+
+      explicit BuildBox(const AABB &b) {
+        for (int k = 0; k < 3; ++k) {
+          lo[k] = static_cast<float>(b.lo.e[k]);
+          hi[k] = static_cast<float>(b.hi.e[k]);
+          if (lo[k] > b.lo.e[k]) {
+            lo[k] = std::nextafter(lo[k], -std::numeric_limits<float>::infinity());
+          }
+          if (hi[k] < b.hi.e[k]) {
+            hi[k] = std::nextafter(hi[k], std::numeric_limits<float>::infinity());
+          }
+        }
+      }
+
+      void grow(const BuildBox &b) {
+        for (int k = 0; k < 3; ++k) {
+          lo[k] = std::min(lo[k], b.lo[k]);
+          hi[k] = std::max(hi[k], b.hi[k]);
+        }
+      }
+
+      // Grows to include a point, given as a degenerate box
+      void grow(const float *p) {
+        for (int k = 0; k < 3; ++k) {
+          lo[k] = std::min(lo[k], p[k]);
+          hi[k] = std::max(hi[k], p[k]);
+        }
+      }
+
+      struct Point {
+        float e[3];
+      };
+
+      Point center() const {
+        return {{0.5f * (lo[0] + hi[0]), 0.5f * (lo[1] + hi[1]), 0.5f * (lo[2] + hi[2])}};
+      }
+
+      float surface_area() const {
+        if (lo[0] > hi[0]) {
+          return 0;
+        }
+        float x = hi[0] - lo[0], y = hi[1] - lo[1], z = hi[2] - lo[2];
+        return 2 * (x * y + y * z + z * x);
+      }
+
+      AABB aabb() const {
+        return AABB({lo[0], lo[1], lo[2]}, {hi[0], hi[1], hi[2]});
+      }
+    };
+
+    // Primitive as the builder moves it around, kept small so passes over a range stream through memory
+    struct PrimRef {
+      BuildBox box;
+      uint32_t id;
+    };
+
+    // Bounds of a range's primitives and of their centroids
+    struct RangeBounds {
+      BuildBox box;
+      BuildBox centroids;
+
+      void merge(const RangeBounds &other) {
+        box.grow(other.box);
+        centroids.grow(other.centroids);
+      }
+    };
+
+    struct Bin {
+      BuildBox box;
+      size_t count;
+    };
+
+    // Bins of each axis over a range of primitives. One is reused for every
+    // node a thread builds, and reset() only clears the bins a node uses.
+    struct Binning {
+      int count = 0;
+      Bin bins[3][bvh_bins];
+
+      void reset(int bins_used) {
+        count = bins_used;
+        for (int k = 0; k < 3; ++k) {
+          for (int b = 0; b < count; ++b) {
+            bins[k][b].box = BuildBox();
+            bins[k][b].count = 0;
+          }
+        }
+      }
+
+      Bin &at(int axis, int bin) {
+        return bins[axis][bin];
+      }
+
+      void merge(const Binning &other) {
+        for (int k = 0; k < 3; ++k) {
+          for (int b = 0; b < count; ++b) {
+            bins[k][b].box.grow(other.bins[k][b].box);
+            bins[k][b].count += other.bins[k][b].count;
+          }
+        }
+      }
+    };
+
+    // Maps centroids to bins along each axis of a node's centroid bounds
+    struct BinMap {
+      int bins;
+      float lo[3];
+      float scale[3];
+
+      BinMap(const BuildBox &centroids, int bins) : bins(bins) {
+        for (int k = 0; k < 3; ++k) {
+          float extent = centroids.hi[k] - centroids.lo[k];
+          lo[k] = centroids.lo[k];
+          scale[k] = extent > 0 ? bins / extent : 0;
+        }
+      }
+
+      int operator()(const BuildBox::Point &c, int k) const {
+        return std::max(0, std::min(bins - 1, static_cast<int>((c.e[k] - lo[k]) * scale[k])));
+      }
+    };
+
+    // Runs f(begin, end) over slices of refs_[begin, end), in parallel when there is enough work
+    // result - output, each slice's result merged
+    template <typename Result, typename F>
+    void over_range(size_t begin, size_t end, unsigned threads, Result &result, F f) const {
+      if (threads <= 1 || end - begin < bvh_parallel_size) {
+        f(begin, end, result);
+        return;
+      }
+      // Every slice starts from the empty result, which must be set up before the call
+      std::vector<Result> results(threads, result);
+      parallel_for(threads, threads, [&](size_t t) {
+        f(begin + (end - begin) * t / threads, begin + (end - begin) * (t + 1) / threads, results[t]);
+      });
+      for (const Result &r : results) {
+        result.merge(r);
+      }
+    }
+
+    // Builds the subtree over refs_[begin, end) into nodes, numbering nodes from nodes.size()
+    // range - bounds of the range, found while binning its parent
+    // threads - workers this subtree may use
+    // binning - scratch bins of the calling thread
+    void build_subtree(std::vector<BvhNode> &nodes, size_t begin, size_t end, const RangeBounds &range, int depth,
+                       unsigned threads, Binning &binning) {
+      const size_t index = nodes.size();
+      nodes.push_back(BvhNode());
+      nodes[index].box = range.box.aabb();
+      const size_t count = end - begin;
+
+      // Best binned split over all axes
+      int best_axis = -1, best_bin = 0;
+      double best_cost = std::numeric_limits<double>::infinity();
+      // Small nodes get fewer bins, about one per four primitives, as a fine search barely pays for them
+      const int bins = static_cast<int>(std::min<size_t>(bvh_bins, std::max<size_t>(4, count / 4)));
+      const BinMap bin_of(range.centroids, bins);
+      if (count > bvh_leaf_size && depth + 1 < bvh_max_depth) {
+        binning.reset(bins);
+        over_range(begin, end, threads, binning, [&](size_t b, size_t e, Binning &result) {
+          for (size_t i = b; i < e; ++i) {
+            const BuildBox &box = refs_[i].box;
+            const BuildBox::Point c = box.center();
+            for (int k = 0; k < 3; ++k) {
+              Bin &bin = result.at(k, bin_of(c, k));
+              bin.box.grow(box);
+              ++bin.count;
+            }
+          }
+        });
+
+        for (int k = 0; k < 3; ++k) {
+          if (bin_of.scale[k] == 0) {
+            continue;
+          }
+          // Area times count of everything right of each cut, swept from the right
+          double right_cost[bvh_bins];
+          BuildBox right;
+          size_t right_count = 0;
+          for (int b = bins - 1; b > 0; --b) {
+            right.grow(binning.at(k, b).box);
+            right_count += binning.at(k, b).count;
+            right_cost[b] = static_cast<double>(right.surface_area()) * right_count;
+          }
+          BuildBox left;
+          size_t left_count = 0;
+          for (int b = 1; b < bins; ++b) {
+            left.grow(binning.at(k, b - 1).box);
+            left_count += binning.at(k, b - 1).count;
+            double cost = static_cast<double>(left.surface_area()) * left_count + right_cost[b];
+            if (left_count > 0 && left_count < count && cost < best_cost) {
+              best_cost = cost;
+              best_axis = k;
+              best_bin = b;
+            }
+          }
+        }
+        best_cost = bvh_traversal_cost + best_cost / range.box.surface_area();
+      }
+
+      // Leaf when no split beats intersecting everything, unless the leaf would be too big
+      size_t mid = begin;
+      RangeBounds first, second;
+      if (best_axis >= 0 && (best_cost < count || count > bvh_max_leaf_size)) {
+        const int axis = best_axis, bin = best_bin;
+        for (int b = 0; b < bins; ++b) {
+          (b < bin ? first : second).box.grow(binning.at(axis, b).box);
+        }
+        // Partition, gathering each side's centroid bounds on the way
+        size_t i = begin, j = end;
+        for (;;) {
+          BuildBox::Point c;
+          while (i < j && bin_of(c = refs_[i].box.center(), axis) < bin) {
+            first.centroids.grow(c.e);
+            ++i;
+          }
+          while (i < j && bin_of(c = refs_[j - 1].box.center(), axis) >= bin) {
+            second.centroids.grow(c.e);
+            --j;
+          }
+          if (i >= j) {
+            break;
+          }
+          std::swap(refs_[i], refs_[j - 1]);
+        }
+        mid = i;
+      } else if (best_axis < 0 && count > bvh_max_leaf_size && depth + 1 < bvh_max_depth) {
+        // Centroids all coincide, halve the range anyway
+        mid = begin + count / 2;
+        best_axis = 0;
+        for (size_t i = begin; i < end; ++i) {
+          RangeBounds &half = i < mid ? first : second;
+          half.box.grow(refs_[i].box);
+          half.centroids.grow(refs_[i].box.center().e);
+        }
+      }
+      if (mid == begin) {
+        nodes[index].index = static_cast<uint32_t>(begin);
+        nodes[index].count = static_cast<uint32_t>(count);
+        nodes[index].axis = 0;
+        return;
+      }
+
+      // Big subtrees split the threads, the second child builds into its own
+      // node list on another thread and is appended after the first
+      if (threads > 1 && count >= bvh_parallel_size) {
+        std::vector<BvhNode> second_nodes;
+        second_nodes.reserve(2 * (end - mid) / bvh_leaf_size + 1);
+        unsigned second_threads = threads / 2;
+        std::thread worker([&]() {
+          std::unique_ptr<Binning> worker_binning(new Binning());
+          build_subtree(second_nodes, mid, end, second, depth + 1, second_threads, *worker_binning);
+        });
+        build_subtree(nodes, begin, mid, first, depth + 1, threads - second_threads, binning);
+        worker.join();
+
+        const uint32_t offset = static_cast<uint32_t>(nodes.size());
+        for (BvhNode &node : second_nodes) {
+          if (node.count == 0) {
+            node.index += offset;
+          }
+        }
+        nodes[index].index = offset;
+        nodes.insert(nodes.end(), second_nodes.begin(), second_nodes.end());
+      } else {
+        build_subtree(nodes, begin, mid, first, depth + 1, 1, binning);
+        nodes[index].index = static_cast<uint32_t>(nodes.size());
+        build_subtree(nodes, mid, end, second, depth + 1, 1, binning);
+      }
+      nodes[index].count = 0;
+      nodes[index].axis = static_cast<uint32_t>(best_axis);
+    }
+
+    // Visits the leaves whose boxes the ray passes through, nearer child first
+    // t_limit - boxes starting beyond this t are skipped, may shrink during the walk
+    // visit - called as visit(id) for each primitive of each leaf, returns true to stop
+    template <typename Visit, typename Stats>
+    void traverse(const Ray &r, const double &t_limit, Visit visit, Stats &stats) const {
+      if (nodes_.empty()) {
+        return;
+      }
+      uint32_t stack[bvh_max_depth + 1];
+      int top = 0;
+      stack[top++] = 0;
+
+      while (top > 0) {
+        const BvhNode &node = nodes_[stack[--top]];
+        stats.node();
+        double t_near = r.t_min, t_far = t_limit;
+        if (!hit_aabb(node.box, r, t_near, t_far)) {
+          continue;
+        }
+        if (node.count > 0) {
+          for (uint32_t i = node.index; i < node.index + node.count; ++i) {
+            stats.prim();
+            if (visit(order_[i])) {
+              return;
+            }
+          }
+          continue;
+        }
+
+        // Push the far child first so the near one is popped next
+        uint32_t first = static_cast<uint32_t>(&node - nodes_.data()) + 1;
+        uint32_t second = node.index;
+        if (r.sign[node.axis]) {
+          std::swap(first, second);
+        }
+        stack[top++] = second;
+        stack[top++] = first;
+        stats.stack(top);
+      }
+    }
+
+    std::vector<BvhNode> nodes_;
+    // Primitive ids in leaf order
+    std::vector<uint32_t> order_;
+    // Primitives being sorted into leaf order, only used during build()
+    std::vector<PrimRef> refs_;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef CAMERA_H_
+#define CAMERA_H_
+#include <cmath>
+#include <cstddef>
+
+#include "vec3.h"
+#include "ray.h"
+
+// Camera placement and the viewport it shoots rays through
+struct Camera {
+  bool is_ortho;
+  // Image size the viewport is split into
+  size_t width;
+  size_t height;
+  vec3 pos;
+  vec3 forward;
+  // These are used to get world coords of pixels in viewport
+  vec3 viewport_right;
+  vec3 viewport_down;
+  vec3 viewport_top_left;
+  // Footprint of one pixel: angle it subtends, or its width for ortho
+  double pixel_spread;
+  double pixel_width;
+};
+
+// Camera position on a circle around the y axis, what the viewer's controls move
+struct Orbit {
+  // Angle around the y axis in radians, frame / 20 for main()'s orbit
+  double angle = 0;
+  double height = 1;
+  double radius = 2;
+};
+
+// Builds the camera used by main()
+// is_ortho - orthographic instead of perspective projection, from twice the height and radius
+// orbit - camera position
+// width/height - image size, used for aspect ratio
+inline Camera make_camera(bool is_ortho, const Orbit &orbit, size_t width, size_t height) {
+  Camera cam;
+  cam.is_ortho = is_ortho;
+  cam.width = width;
+  cam.height = height;
+
+  // Change this to any vectors if needed
+  cam.pos = {orbit.radius * std::sin(orbit.angle), orbit.height, orbit.radius * std::cos(orbit.angle)};
+  cam.forward = unit_vector(vec3(0, 0.5, -2) - cam.pos);
+
+  // Slightly different viewpoint for the ortho images
+  if (is_ortho) {
+    cam.pos = {2 * orbit.radius * std::sin(orbit.angle), 2 * orbit.height, 2 * orbit.radius * std::cos(orbit.angle)};
+    cam.forward = unit_vector(vec3(0, 1, -2) - cam.pos);
+  }
+
+  // Calculate camera-local axis
+  vec3 camera_right = cross(cam.forward, {0, 1, 0});
+  vec3 camera_up = cross(camera_right, cam.forward);
+
+  // Calculate viewport vectors
+  double aspect_ratio = static_cast<double>(width) / height;
+  double focal = 1.0;
+
+  double viewport_height = 1;
+  if (is_ortho) {
+    viewport_height *= 3.5;
+  }
+
+  double viewport_width = viewport_height * aspect_ratio;
+  cam.viewport_right = viewport_width * camera_right;
+  cam.viewport_down = -viewport_height * camera_up;
+  cam.viewport_top_left = cam.pos - cam.viewport_right / 2 - cam.viewport_down / 2 + focal * cam.forward;
+
+  cam.pixel_spread = is_ortho ? 0 : viewport_height / height / focal;
+  cam.pixel_width = is_ortho ? viewport_height / height : 0;
+  return cam;
+}
+
+// Camera at a frame of main()'s orbit
+// frame - orbit position
+inline Camera make_camera(bool is_ortho, int frame, size_t width, size_t height) {
+  Orbit orbit;
+  orbit.angle = frame / 20.0;
+  return make_camera(is_ortho, orbit, width, height);
+}
+
+// Projection policies for the specialised render kernel
+// row_ratio/col_ratio - position within viewport in [0, 1]
+
+// Shoots from camera towards viewport
+struct Perspective {
+  static Ray generate(const Camera &cam, double row_ratio, double col_ratio) {
+    return {cam.pos, cam.viewport_top_left + cam.viewport_down * row_ratio + cam.viewport_right * col_ratio - cam.pos,
+            0, cam.pixel_spread};
+  }
+};
+
+// Shoots forwards from viewport
+struct Orthographic {
+  static Ray generate(const Camera &cam, double row_ratio, double col_ratio) {
+    return {cam.viewport_top_left + cam.viewport_down * row_ratio + cam.viewport_right * col_ratio, cam.forward,
+            cam.pixel_width, 0};
+  }
+};
+
+// Runtime-dispatched ray generation for the generic path
+inline Ray camera_ray(const Camera &cam, double row_ratio, double col_ratio) {
+  if (cam.is_ortho) {
+    return Orthographic::generate(cam, row_ratio, col_ratio);
+  }
+  return Perspective::generate(cam, row_ratio, col_ratio);
+}
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef DENOISE_H_
+#define DENOISE_H_
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "vec3.h"
+#include "ray.h"
+#include "scene.h"
+#include "camera.h"
+#include "parallel.h"
+#include "arena.h"
+
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al. 2010).
+// Each pass blurs with a 5x5 B3-spline kernel whose taps are spread 2^pass
+// pixels apart, so five passes cover a 125 pixel footprint at 25 taps per pass.
+// Taps are weighted down where the first surface's albedo, normal or depth
+// differ, so edges survive while noise inside a surface is averaged away.
+// Lighting is filtered with the albedo divided out, so surface colour stays sharp.
+
+// Depth stored for pixels that see no surface
+const float feature_miss_depth = 1e6f;
+
+// Guide features of the first surface seen through each pixel, one plane per channel
+struct FeatureBuffer {
+  size_t width = 0;
+  size_t height = 0;
+  std::vector<float> albedo[3];
+  std::vector<float> normal[3];
+  std::vector<float> depth;
+
+  FeatureBuffer() = default;
+
+  FeatureBuffer(size_t w, size_t h) {
+    resize(w, h);
+  }
+
+  void resize(size_t w, size_t h) {
+    width = w;
+    height = h;
+    for (int k = 0; k < 3; ++k) {
+      albedo[k].resize(w * h);
+      normal[k].resize(w * h);
+    }
+    depth.resize(w * h);
+  }
+};
+
+// Lighting planes with albedo divided out, ping-ponged between denoise passes
+struct DenoisePlanes {
+  std::vector<float> light[3], next[3];
+
+  void resize(size_t pixels) {
+    for (int k = 0; k < 3; ++k) {
+      light[k].resize(pixels);
+      next[k].resize(pixels);
+    }
+  }
+};
+
+// Writes the features averaged over an n x n grid of primary rays per pixel
+// Proj - Perspective or Orthographic
+// threads - worker count, 0 for all cores
+template <typename Proj, typename Scene>
+void render_features(const Scene &scene, const Camera &cam, size_t n, FeatureBuffer &features, unsigned threads) {
+  const size_t width = features.width;
+  const size_t height = features.height;
+
+  parallel_for(height, threads, [&](size_t r) {
+    for (size_t c = 0; c < width; ++c) {
+      vec3 albedo = {}, normal = {};
+      double depth = 0;
+
+      for (size_t rr = 0; rr < n; ++rr) {
+        for (size_t cc = 0; cc < n; ++cc) {
+          double row_ratio = (r + (rr + 0.5) / n) / height;
+          double col_ratio = (c + (cc + 0.5) / n) / width;
+          Hit hit;
+          if (scene.closest(Proj::generate(cam, row_ratio, col_ratio), hit)) {
+            albedo += hit.albedo;
+            normal += hit.normal;
+            depth += hit.t;
+          } else {
+            depth += feature_miss_depth;
+          }
+        }
+      }
+
+      size_t i = r * width + c;
+      double inv = 1.0 / (n * n);
+      for (int k = 0; k < 3; ++k) {
+        features.albedo[k][i] = albedo.e[k] * inv;
+        features.normal[k][i] = normal.e[k] * inv;
+      }
+      features.depth[i] = depth * inv;
+    }
+  });
+}
+
+// Denoiser settings, sigmas are the feature differences at which a tap's weight falls to 1/e
+struct DenoiseSettings {
+  int passes = 5;
+  // Halved every pass, as later passes see already smoothed lighting
+  float sigma_color = 1.0f;
+  float sigma_normal = 0.3f;
+  // Relative to the centre pixel's depth
+  float sigma_depth = 0.05f;
+  float sigma_albedo = 0.1f;
+  // Worker count, 0 for all cores
+  unsigned threads = 0;
+};
+
+// Approximates exp(-x) for x >= 0 as (1 - x/16)^16, branch-free so filter loops vectorise
+inline float fast_exp_neg(float x) {
+  float v = std::max(0.0f, 1.0f - x * (1.0f / 16));
+  v *= v;
+  v *= v;
+  v *= v;
+  v *= v;
+  return v;
+}
+
+// Filters image in place, guided by features of the same size
+inline void denoise(std::vector<color> &image, const FeatureBuffer &features, const DenoiseSettings &settings) {
+  const size_t width = features.width;
+  const size_t height = features.height;
+  const size_t pixels = width * height;
+  const float eps = 1e-3f;
+
+  Pool<DenoisePlanes>::Lease planes = pool<DenoisePlanes>().acquire();
+  planes->resize(pixels);
+  std::vector<float> *light = planes->light, *next = planes->next;
+  for (int k = 0; k < 3; ++k) {
+    for (size_t i = 0; i < pixels; ++i) {
+      light[k][i] = image[i].e[k] / std::max(features.albedo[k][i], eps);
+    }
+  }
+
+  const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+  const float inv_sn = 1 / (settings.sigma_normal * settings.sigma_normal);
+  const float inv_sd = 1 / (settings.sigma_depth * settings.sigma_depth);
+  const float inv_sa = 1 / (settings.sigma_albedo * settings.sigma_albedo);
+
+  for (int pass = 0; pass < settings.passes; ++pass) {
+    const long step = 1L << pass;
+    const float sigma_color = settings.sigma_color / (1 << pass);
+    const float inv_sc = 1 / (sigma_color * sigma_color);
+
+    parallel_for(height, settings.threads, [&](size_t y) {
+      // Row accumulators, the tap loops below run along x so they vectorise
+      ArenaScope scope;
+      float *sum_r = thread_arena().make<float>(width), *sum_g = thread_arena().make<float>(width);
+      float *sum_b = thread_arena().make<float>(width), *sum_w = thread_arena().make<float>(width);
+      const size_t row = y * width;
+      const float *lr = light[0].data(), *lg = light[1].data(), *lb = light[2].data();
+      const float *ar = features.albedo[0].data(), *ag = features.albedo[1].data(), *ab = features.albedo[2].data();
+      const float *nx = features.normal[0].data(), *ny = features.normal[1].data(), *nz = features.normal[2].data();
+      const float *d = features.depth.data();
+
+      for (int ky = -2; ky <= 2; ++ky) {
+        long yy = static_cast<long>(y) + ky * step;
+        if (yy < 0 || yy >= static_cast<long>(height)) {
+          continue;
+        }
+        for (int kx = -2; kx <= 2; ++kx) {
+          const long off = (yy - static_cast<long>(y)) * static_cast<long>(width) + kx * step;
+          const float h = kernel[ky + 2] * kernel[kx + 2];
+          // Only x whose tap stays inside the row
+          const size_t x0 = kx < 0 ? std::min<size_t>(width, -kx * step) : 0;
+          const size_t x1 = kx > 0 ? width - std::min<size_t>(width, kx * step) : width;
+
+          for (size_t x = x0; x < x1; ++x) {
+            const size_t p = row + x;
+            const size_t q = p + off;
+            float dr = lr[p] - lr[q], dg = lg[p] - lg[q], db = lb[p] - lb[q];
+            float dc = dr * dr + dg * dg + db * db;
+            float ex = nx[p] - nx[q], ey = ny[p] - ny[q], ez = nz[p] - nz[q];
+            float dn = ex * ex + ey * ey + ez * ez;
+            float rel = (d[p] - d[q]) / d[p];
+            float dd = rel * rel;
+            float fr = ar[p] - ar[q], fg = ag[p] - ag[q], fb = ab[p] - ab[q];
+            float da = fr * fr + fg * fg + fb * fb;
+
+            float w = h * fast_exp_neg(dc * inv_sc + dn * inv_sn + dd * inv_sd + da * inv_sa);
+            sum_r[x] += w * lr[q];
+            sum_g[x] += w * lg[q];
+            sum_b[x] += w * lb[q];
+            sum_w[x] += w;
+          }
+        }
+      }
+
+      // The centre tap always has weight, so sum_w > 0
+      for (size_t x = 0; x < width; ++x) {
+        next[0][row + x] = sum_r[x] / sum_w[x];
+        next[1][row + x] = sum_g[x] / sum_w[x];
+        next[2][row + x] = sum_b[x] / sum_w[x];
+      }
+    });
+
+    for (int k = 0; k < 3; ++k) {
+      light[k].swap(next[k]);
+    }
+  }
+
+  for (size_t i = 0; i < pixels; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      image[i].e[k] = light[k][i] * std::max(features.albedo[k][i], eps);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef DYNAMIC_RESOLUTION_H_
+#define DYNAMIC_RESOLUTION_H_
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include "vec3.h"
+
+// Dynamic resolution for the realtime viewer: a controller that turns each
+// frame's measured time into the internal render size (and samples per pixel)
+// for the next frame, and a bilinear upscale to the window size. Render cost
+// is roughly proportional to pixels * samples, so the scale moves by the
+// square root of the budget over a smoothed frame time, limited per frame so
+// a single slow frame can't collapse the resolution.
+
+// Weight of the newest frame time in the smoothed one
+const double resolution_smoothing = 0.3;
+// Relative error in frame time left alone, against oscillating around the budget
+const double resolution_deadband = 0.1;
+// Largest change in scale per frame, and the smallest scale
+const double resolution_max_step = 1.25;
+const double resolution_min_scale = 0.2;
+
+class ResolutionController {
+  public:
+    // width/height - output size, the largest internal size
+    // budget_ms - frame time to hold
+    // max_samples - multi jitter samples per side used once full resolution leaves time spare
+    ResolutionController(size_t width, size_t height, double budget_ms, size_t max_samples = 4)
+        : width_(width), height_(height), budget_ms_(budget_ms), max_samples_(max_samples) {}
+
+    // Internal render size for the next frame
+    size_t width() const {
+      return std::max<size_t>(1, static_cast<size_t>(std::lround(width_ * scale_)));
+    }
+
+    size_t height() const {
+      return std::max<size_t>(1, static_cast<size_t>(std::lround(height_ * scale_)));
+    }
+
+    // Multi jitter samples per side for the next frame
+    size_t samples() const {
+      return samples_;
+    }
+
+    double scale() const {
+      return scale_;
+    }
+
+    // Adjusts size and samples from the time the last frame took
+    void update(double frame_ms) {
+      // The first frame starts the average, later ones are smoothed against jitter in the timer
+      smoothed_ms_ = smoothed_ms_ == 0 ? frame_ms : smoothed_ms_ + resolution_smoothing * (frame_ms - smoothed_ms_);
+      double ratio = budget_ms_ / std::max(smoothed_ms_, 0.1);
+      if (std::fabs(ratio - 1) < resolution_deadband) {
+        return;
+      }
+
+      // Over budget, drop samples before resolution
+      if (ratio < 1 && samples_ > 1) {
+        --samples_;
+        smoothed_ms_ *= static_cast<double>(samples_ * samples_) / ((samples_ + 1) * (samples_ + 1));
+        return;
+      }
+      // Under budget at full resolution, spend the spare time on samples
+      if (ratio > 1 && scale_ >= 1) {
+        double next = static_cast<double>((samples_ + 1) * (samples_ + 1)) / (samples_ * samples_);
+        if (samples_ < max_samples_ && ratio > next) {
+          ++samples_;
+          smoothed_ms_ *= next;
+        }
+        return;
+      }
+
+      double step = std::min(std::max(std::sqrt(ratio), 1 / resolution_max_step), resolution_max_step);
+      double scale = std::min(std::max(scale_ * step, resolution_min_scale), 1.0);
+      // Predict the new frame time so the next update doesn't correct twice
+      smoothed_ms_ *= (scale * scale) / (scale_ * scale_);
+      scale_ = scale;
+    }
+
+  private:
+    size_t width_, height_;
+    double budget_ms_;
+    size_t max_samples_;
+    double scale_ = 1;
+    size_t samples_ = 1;
+    double smoothed_ms_ = 0;
+};
+
+// Bilinear upscale of a linear image, sample centres aligned
+// src - src_height rows of src_width colors
+// dst - output, dst_height rows of dst_width colors
+inline void upscale_bilinear(const color *src, size_t src_width, size_t src_height, color *dst, size_t dst_width,
+                             size_t dst_height) {
+  const double sx = static_cast<double>(src_width) / dst_width, sy = static_cast<double>(src_height) / dst_height;
+  for (size_t y = 0; y < dst_height; ++y) {
+    double fy = std::min(std::max((y + 0.5) * sy - 0.5, 0.0), src_height - 1.0);
+    size_t y0 = static_cast<size_t>(fy), y1 = std::min(y0 + 1, src_height - 1);
+    double wy = fy - y0;
+    for (size_t x = 0; x < dst_width; ++x) {
+      double fx = std::min(std::max((x + 0.5) * sx - 0.5, 0.0), src_width - 1.0);
+      size_t x0 = static_cast<size_t>(fx), x1 = std::min(x0 + 1, src_width - 1);
+      double wx = fx - x0;
+      color top = (1 - wx) * src[y0 * src_width + x0] + wx * src[y0 * src_width + x1];
+      color bottom = (1 - wx) * src[y1 * src_width + x0] + wx * src[y1 * src_width + x1];
+      dst[y * dst_width + x] = (1 - wy) * top + wy * bottom;
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef GRID_H_
+#define GRID_H_
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "vec3.h"
+#include "ray.h"
+#include "aabb.h"
+#include "traversal_stats.h"
+
+// Uniform grid over primitive bounds, traversed cell by cell with a 3D-DDA
+// (Amanatides & Woo 1987). Building is two linear passes over the primitives,
+// counting then filling a compact cell -> primitive list (Lagae & Dutre 2008),
+// so it is far cheaper to build than a tree. It traces best when primitives
+// are evenly spread and of similar size, like particle fields.
+
+// Grid cells per primitive
+const double grid_density = 2;
+// Upper limit on cells along any axis
+const int grid_max_resolution = 512;
+
+class UniformGrid {
+  public:
+    // Builds the grid, replacing any previous one
+    // bounds - box of each primitive, its index is the id passed to test()
+    void build(const std::vector<AABB> &bounds) {
+      bounds_ = AABB();
+      for (const AABB &b : bounds) {
+        bounds_.grow(b);
+      }
+      cell_start_.assign(1, 0);
+      items_.clear();
+      if (bounds.empty()) {
+        return;
+      }
+
+      // Pad so flat scenes still have volume and boundary primitives land inside
+      vec3 extent = bounds_.extent();
+      double pad = 1e-6 * std::max({extent.e[0], extent.e[1], extent.e[2]}) + 1e-9;
+      bounds_.lo = bounds_.lo - vec3(pad, pad, pad);
+      bounds_.hi += vec3(pad, pad, pad);
+      extent = bounds_.extent();
+
+      // Cubic cells, grid_density of them per primitive
+      double volume = extent.e[0] * extent.e[1] * extent.e[2];
+      double per_unit = std::cbrt(grid_density * bounds.size() / volume);
+      for (int k = 0; k < 3; ++k) {
+        res_[k] = std::max(1, std::min(grid_max_resolution, static_cast<int>(extent.e[k] * per_unit)));
+        cell_size_.e[k] = extent.e[k] / res_[k];
+        inv_cell_size_.e[k] = 1 / cell_size_.e[k];
+      }
+      const size_t cells = static_cast<size_t>(res_[0]) * res_[1] * res_[2];
+
+      // Count pass, then prefix sum into each cell's start in items_
+      cell_start_.assign(cells + 1, 0);
+      for (const AABB &b : bounds) {
+        int lo[3], hi[3];
+        cell_range(b, lo, hi);
+        for (int z = lo[2]; z <= hi[2]; ++z) {
+          for (int y = lo[1]; y <= hi[1]; ++y) {
+            for (int x = lo[0]; x <= hi[0]; ++x) {
+              ++cell_start_[cell_index(x, y, z) + 1];
+            }
+          }
+        }
+      }
+      for (size_t i = 0; i < cells; ++i) {
+        cell_start_[i + 1] += cell_start_[i];
+      }
+
+      // Fill pass
+      items_.resize(cell_start_[cells]);
+      std::vector<uint32_t> cursor(cell_start_.begin(), cell_start_.end() - 1);
+      for (size_t i = 0; i < bounds.size(); ++i) {
+        int lo[3], hi[3];
+        cell_range(bounds[i], lo, hi);
+        for (int z = lo[2]; z <= hi[2]; ++z) {
+          for (int y = lo[1]; y <= hi[1]; ++y) {
+            for (int x = lo[0]; x <= hi[0]; ++x) {
+              items_[cursor[cell_index(x, y, z)]++] = static_cast<uint32_t>(i);
+            }
+          }
+        }
+      }
+    }
+
+    // Finds the closest primitive within the ray's range
+    // test - called as test(id, r), returns t of the hit or <= 0 for a miss
+    // t - in: only hits closer than this and r.t_max count, out: t of the closest hit
+    // prim - output, id of the closest primitive
+    // stats - counts the walk, see traversal_stats.h
+    // returns true if a hit closer than t was found
+    template <typename Test, typename Stats = NoTraversalStats>
+    bool closest(const Ray &r, const Test &test, double &t, uint32_t &prim, Stats &&stats = Stats()) const {
+      bool found = false;
+      t = std::min(t, r.t_max);
+      // t doubles as the traversal limit, so the walk ends in the cell holding the hit
+      traverse(r, t, [&](uint32_t id) {
+        double t_hit = test(id, r);
+        if (t_hit > r.t_min && t_hit < t) {
+          t = t_hit;
+          prim = id;
+          found = true;
+        }
+        return false;
+      }, stats);
+      return found;
+    }
+
+    // Returns true if any primitive is hit within the ray's range
+    template <typename Test, typename Stats = NoTraversalStats>
+    bool any(const Ray &r, const Test &test, Stats &&stats = Stats()) const {
+      bool found = false;
+      traverse(r, r.t_max, [&](uint32_t id) {
+        double t_hit = test(id, r);
+        found = t_hit > r.t_min && t_hit < r.t_max;
+        return found;
+      }, stats);
+      return found;
+    }
+
+    // Cells along each axis
+    const int *resolution() const {
+      return res_;
+    }
+
+    // Primitive references stored across all cells
+    size_t references() const {
+      return items_.size();
+    }
+
+  private:
+    size_t cell_index(int x, int y, int z) const {
+      return (static_cast<size_t>(z) * res_[1] + y) * res_[0] + x;
+    }
+
+    int cell_of(double p, int k) const {
+      int cell = static_cast<int>((p - bounds_.lo.e[k]) * inv_cell_size_.e[k]);
+      return std::max(0, std::min(res_[k] - 1, cell));
+    }
+
+    // Cells overlapped by a box, inclusive
+    void cell_range(const AABB &b, int *lo, int *hi) const {
+      for (int k = 0; k < 3; ++k) {
+        lo[k] = cell_of(b.lo.e[k], k);
+        hi[k] = cell_of(b.hi.e[k], k);
+      }
+    }
+
+    // Walks the cells the ray passes through in order
+    // t_limit - the walk ends after the cell containing this t, may shrink during the walk
+    // visit - called as visit(id) for each primitive of each cell, returns true to stop
+    template <typename Visit, typename Stats>
+    void traverse(const Ray &r, const double &t_limit, Visit visit, Stats &stats) const {
+      if (items_.empty()) {
+        return;
+      }
+      double t_near = r.t_min, t_far = t_limit;
+      if (!hit_aabb(bounds_, r, t_near, t_far)) {
+        return;
+      }
+
+      // Entry cell, and for each axis the step direction, the t of the next
+      // cell boundary and the t between boundaries
+      point3 entry = r.at(t_near);
+      int cell[3], step[3];
+      double t_next[3], t_delta[3];
+      for (int k = 0; k < 3; ++k) {
+        cell[k] = cell_of(entry.e[k], k);
+        double d = r.direction.e[k];
+        if (d > 0) {
+          step[k] = 1;
+          t_next[k] = (bounds_.lo.e[k] + (cell[k] + 1) * cell_size_.e[k] - r.origin.e[k]) * r.inv_direction.e[k];
+          t_delta[k] = cell_size_.e[k] * r.inv_direction.e[k];
+        } else if (d < 0) {
+          step[k] = -1;
+          t_next[k] = (bounds_.lo.e[k] + cell[k] * cell_size_.e[k] - r.origin.e[k]) * r.inv_direction.e[k];
+          t_delta[k] = -cell_size_.e[k] * r.inv_direction.e[k];
+        } else {
+          step[k] = 0;
+          t_next[k] = std::numeric_limits<double>::infinity();
+          t_delta[k] = std::numeric_limits<double>::infinity();
+        }
+      }
+
+      for (;;) {
+        int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+        double cell_exit = t_next[axis];
+
+        size_t index = cell_index(cell[0], cell[1], cell[2]);
+        stats.node();
+        for (uint32_t i = cell_start_[index]; i < cell_start_[index + 1]; ++i) {
+          stats.prim();
+          if (visit(items_[i])) {
+            return;
+          }
+        }
+
+        // Primitives span cells, so only stop once the limit lies within this one
+        if (cell_exit >= t_limit || cell_exit > t_far) {
+          return;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= res_[axis]) {
+          return;
+        }
+        t_next[axis] += t_delta[axis];
+      }
+    }
+
+    AABB bounds_;
+    int res_[3] = {0, 0, 0};
+    vec3 cell_size_;
+    vec3 inv_cell_size_;
+    // Cell i holds items_[cell_start_[i], cell_start_[i + 1])
+    std::vector<uint32_t> cell_start_ = std::vector<uint32_t>(1, 0);
+    std::vector<uint32_t> items_;
+};
+
+#endif
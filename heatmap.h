@@ -0,0 +1,186 @@
+#ifndef HEATMAP_H_
+#define HEATMAP_H_
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "vec3.h"
+#include "ray.h"
+#include "scene.h"
+#include "light.h"
+#include "traversal_stats.h"
+#include "image_io.h"
+
+// Per-pixel cost profiling. Scene queries go through a CountingScene, and
+// primitives of a StaticScene through Counted, which add to counters of the
+// calling thread; the render reads them and a cycle counter around each
+// pixel. The cost is a thread local increment per query and per primitive
+// test and two counter reads per pixel, so it can stay on for test renders.
+// Each measure is written as a false colour PNG, scaled to its 99th
+// percentile so a few outliers don't flatten the rest.
+
+// Queries made and primitives tested by this thread
+struct RayCounts {
+  uint64_t rays = 0;
+  uint64_t tests = 0;
+};
+
+inline RayCounts &ray_counts() {
+  thread_local RayCounts counts;
+  return counts;
+}
+
+// Cycle counter where the CPU has one, otherwise steady_clock nanoseconds
+inline uint64_t cost_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+inline const char *cost_tick_unit() {
+#if defined(__x86_64__) || defined(__i386__)
+  return "cycles";
+#else
+  return "ns";
+#endif
+}
+
+// Primitive counting its intersection tests
+template <typename P>
+struct Counted : P {
+  constexpr Counted(const P &prim) : P(prim) {}
+
+  double intersect(const Ray &r) const {
+    ++ray_counts().tests;
+    return P::intersect(r);
+  }
+};
+
+// The scene with every primitive counted
+template <typename... Prims>
+StaticScene<Counted<Prims>...> counted_tests(const StaticScene<Prims...> &scene) {
+  return {PrimList<Counted<Prims>...>(scene.prims), scene.light};
+}
+
+// Forwards the queries shading makes to a scene, counting each as a ray
+template <typename Scene>
+class CountingScene {
+  public:
+    explicit CountingScene(const Scene &scene) : scene_(scene) {}
+
+    bool closest(const Ray &r, Hit &hit) const {
+      ++ray_counts().rays;
+      return scene_.closest(r, hit);
+    }
+
+    bool any(const Ray &r) const {
+      ++ray_counts().rays;
+      return scene_.any(r);
+    }
+
+    bool any(const Ray &r, uint32_t light) const {
+      ++ray_counts().rays;
+      return scene_.any(r, light);
+    }
+
+    void describe(const Ray &r, Hit &hit) const {
+      scene_.describe(r, hit);
+    }
+
+    int light_samples() const {
+      return scene_.light_samples();
+    }
+
+    LightSample sample_light(double u) const {
+      return scene_.sample_light(u);
+    }
+
+  private:
+    const Scene &scene_;
+};
+
+// Forwards the queries shading makes to an AccelScene, counting its walks into traversal_counts()
+template <typename Scene>
+class TraversalScene {
+  public:
+    explicit TraversalScene(const Scene &scene) : scene_(scene) {}
+
+    bool closest(const Ray &r, Hit &hit) const {
+      return scene_.closest(r, hit, traversal_counts().closest);
+    }
+
+    bool any(const Ray &r) const {
+      return scene_.any(r, traversal_counts().any);
+    }
+
+    bool any(const Ray &r, uint32_t light) const {
+      return scene_.any(r, light, traversal_counts().any);
+    }
+
+    void describe(const Ray &r, Hit &hit) const {
+      scene_.describe(r, hit);
+    }
+
+    int light_samples() const {
+      return scene_.light_samples();
+    }
+
+    LightSample sample_light(double u) const {
+      return scene_.sample_light(u);
+    }
+
+  private:
+    const Scene &scene_;
+};
+
+// Per-pixel cost of one render, height rows of width values
+struct CostMaps {
+  size_t width = 0, height = 0;
+  std::vector<uint64_t> ticks, rays, tests;
+
+  void resize(size_t w, size_t h) {
+    width = w;
+    height = h;
+    ticks.assign(w * h, 0);
+    rays.assign(w * h, 0);
+    tests.assign(w * h, 0);
+  }
+};
+
+// Maps 0..1 through black, blue, magenta, orange and white
+inline void heat_color(double v, uint8_t *rgb) {
+  static const double stops[5][3] = {{0, 0, 0}, {0.1, 0.1, 0.8}, {0.8, 0.1, 0.6}, {1, 0.6, 0.1}, {1, 1, 1}};
+  v = std::min(std::max(v, 0.0), 1.0) * 4;
+  int i = std::min(static_cast<int>(v), 3);
+  double f = v - i;
+  for (int k = 0; k < 3; ++k) {
+    rgb[k] = static_cast<uint8_t>(255 * ((1 - f) * stops[i][k] + f * stops[i + 1][k]) + 0.5);
+  }
+}
+
+// Writes values as a false colour PNG, white at the 99th percentile and above
+// returns the value mapped to white, 0 if the file can't be written
+inline uint64_t write_heatmap(const std::string &path, const std::vector<uint64_t> &values, size_t width,
+                              size_t height) {
+  std::vector<uint64_t> sorted(values);
+  size_t index = sorted.size() * 99 / 100;
+  std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+  uint64_t top = std::max<uint64_t>(sorted[index], 1);
+
+  std::vector<uint8_t> rgb(values.size() * 3);
+  for (size_t i = 0; i < values.size(); ++i) {
+    heat_color(static_cast<double>(values[i]) / top, &rgb[i * 3]);
+  }
+  return write_png(path, width, height, 8, rgb.data(), 0) ? top : 0;
+}
+
+#endif
@@ -0,0 +1,112 @@
+#ifndef HIT_H_
+#define HIT_H_
+#include <cmath>
+#include <utility>
+
+#include "vec3.h"
+#include "ray.h"
+
+// Checks if a ray hits a sphere
+// center - the sphere center
+// radius - the sphere radius
+// r - ray to test
+// t0 - output for first hit
+// t1 - output for second hit
+// returns true if any hit found. Sets t0 to smaller t of hits, t1 to second t if found.
+inline bool hit_sphere(const point3& center, double radius, const Ray& r, double *t0, double *t1) {
+  // Adapted from lecture
+  const vec3 &d = r.direction;
+  const vec3 &d_unit = r.unit_direction;
+  vec3 f = r.origin - center;
+  double a = d.length_squared();
+  double b = 2 * dot(f, d);
+  double c = f.length_squared() - radius * radius;
+
+  double b2_minus_4ac = 4 * a * (radius * radius - (f - dot(f, d_unit) * d_unit).length_squared());
+
+  // Return early for invaid determinant
+  if (b2_minus_4ac < 0) {
+    return false;
+  }
+
+  double q = -0.5 * (b + (b >= 0 ? 1 : -1) * std::sqrt(b2_minus_4ac));
+
+  // Calculate two solutions
+  *t0 = c / q;
+  *t1 = q / a;
+
+  // Order them
+  if (*t1 < *t0) {
+    std::swap(*t0, *t1);
+  }
+
+  // Try putting t1 first if t0 is negative
+  if (*t0 < 0) {
+    std::swap(*t0, *t1);
+  }
+
+  // If still negative, both are negative, put it back and return
+  if (*t0 < 0) {
+    std::swap(*t0, *t1);
+    return false;
+  }
+
+  // Otherwise, t0 is positive
+  return true;
+}
+
+// Checks if a ray hits a plane
+// anchor - anchor of plane
+// normal - normal of plane
+// r - ray to test
+// returns t of hit
+inline double hit_plane(const vec3 &anchor, const vec3 &normal, const Ray &r) {
+  double denominator = dot(r.direction, normal);
+  if (denominator == 0.0) {
+    denominator = 0.0000001;
+  }
+  return dot(anchor - r.origin, normal) / denominator;
+}
+
+// https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
+// Check if a ray hits a triangle given its precomputed edges
+// r - ray to test
+// vertex0 - first vertex of triangle
+// edge1/edge2 - vertex1 - vertex0 and vertex2 - vertex0
+// returns t of hit, else -1
+inline double hit_triangle_edges(const Ray &r, const vec3 &vertex0, const vec3 &edge1, const vec3 &edge2) {
+    const float EPSILON = 0.0000001;
+    vec3 h, s, q;
+    float a,f,u,v;
+    h = cross(r.direction, edge2);
+    a = dot(edge1, h);
+    if (a > -EPSILON && a < EPSILON)
+        return -1;    // This ray is parallel to this triangle.
+    f = 1.0/a;
+    s = r.origin - vertex0;
+    u = f * dot(s, h);
+    if (u < 0.0 || u > 1.0)
+        return -1;
+    q = cross(s, edge1);
+    v = f * dot(r.direction, q);
+    if (v < 0.0 || u + v > 1.0)
+        return -1;
+    // At this stage we can compute t to find out where the intersection point is on the line.
+    float t = f * dot(edge2, q);
+    if (t > EPSILON) // ray intersection
+    {
+        return t;
+    }
+    else // This means that there is a line intersection but not a ray intersection.
+        return -1;
+}
+
+// Check if a ray hits a triangle
+// r - ray to test
+// vertex0/1/2 - three vertices of triangle
+// returns t of hit, else -1
+inline double hit_triangle(const Ray &r, const vec3 &vertex0, const vec3 &vertex1, const vec3 &vertex2) {
+    return hit_triangle_edges(r, vertex0, vertex1 - vertex0, vertex2 - vertex0);
+}
+
+#endif
@@ -0,0 +1,491 @@
+#ifndef IMAGE_IO_H_
+#define IMAGE_IO_H_
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "parallel.h"
+#include "arena.h"
+
+// Image file writers for encoded pixels (see output.h).
+//
+// write_png splits the image into strips of rows that are filtered and
+// deflated on separate threads, as pigz does. Every strip but the last ends
+// in a sync flush, which byte-aligns its deflate output, so the strips
+// concatenate into one valid deflate stream. Each strip is primed with the
+// previous strip's last 32 KB as its dictionary, so back-references still
+// reach across the cut and compression barely suffers. The strips' Adler-32
+// checksums are combined into the one the zlib trailer needs.
+//
+// QOI and PPM are for intermediate frames where writing speed matters more
+// than size. read_png loads the reference images in out/ for --regress.
+//
+// The writers take their scratch, zlib's state included, from the thread
+// arenas (arena.h), so writing frame after frame allocates nothing once warm.
+
+// Rows per PNG strip, enough that per-strip overhead vanishes
+const size_t png_strip_rows = 32;
+
+// PNG filter and deflate settings
+const int png_compression_level = 6;
+// Bytes of the previous strip a strip may refer back to, deflate's window
+const size_t png_dictionary_size = 32768;
+
+// Output file formats selectable at runtime
+enum class ImageFormat {
+  // Parallel PNG encoder
+  Png,
+  // Single-threaded PNG from stb_image_write
+  StbPng,
+  // Quite OK Image format, lossless and far faster to write than PNG
+  Qoi,
+  // Binary PPM, raw bytes
+  Ppm
+};
+
+inline const char *format_extension(ImageFormat format) {
+  switch (format) {
+    case ImageFormat::Png:
+    case ImageFormat::StbPng: return "png";
+    case ImageFormat::Qoi: return "qoi";
+    case ImageFormat::Ppm: return "ppm";
+  }
+  return "";
+}
+
+inline const char *format_name(ImageFormat format) {
+  switch (format) {
+    case ImageFormat::Png: return "png";
+    case ImageFormat::StbPng: return "stb png";
+    case ImageFormat::Qoi: return "qoi";
+    case ImageFormat::Ppm: return "ppm";
+  }
+  return "";
+}
+
+// Paeth predictor from the PNG specification
+inline uint8_t paeth(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+// Filters one row with whichever of the five PNG filters gives the smallest
+// sum of absolute differences, the usual heuristic
+// row/prev - raw bytes of this row and the one above, prev nullptr for the first row
+// bpp - bytes per pixel
+// out - output, filter type byte then the filtered row
+inline void filter_row(const uint8_t *row, const uint8_t *prev, size_t stride, size_t bpp, uint8_t *out) {
+  ArenaScope scope;
+  uint8_t *candidate = thread_arena().allocate<uint8_t>(stride);
+  unsigned long best_cost = ~0UL;
+  for (int type = 0; type < 5; ++type) {
+    unsigned long cost = 0;
+    for (size_t i = 0; i < stride; ++i) {
+      int a = i >= bpp ? row[i - bpp] : 0;
+      int b = prev != nullptr ? prev[i] : 0;
+      int c = prev != nullptr && i >= bpp ? prev[i - bpp] : 0;
+      int predicted = type == 0 ? 0 : type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) / 2 : paeth(a, b, c);
+      candidate[i] = static_cast<uint8_t>(row[i] - predicted);
+      cost += std::abs(static_cast<int8_t>(candidate[i]));
+    }
+    if (cost < best_cost) {
+      best_cost = cost;
+      out[0] = static_cast<uint8_t>(type);
+      std::copy(candidate, candidate + stride, out + 1);
+    }
+  }
+}
+
+// zlib allocator over the arena passed as opaque, freed by rewinding it
+inline voidpf arena_zalloc(voidpf opaque, uInt items, uInt size) {
+  const size_t bytes = static_cast<size_t>(items) * size;
+  return static_cast<Arena *>(opaque)->allocate<std::max_align_t>((bytes + sizeof(std::max_align_t) - 1) /
+                                                                  sizeof(std::max_align_t));
+}
+
+inline void arena_zfree(voidpf, voidpf) {}
+
+// Writes a PNG chunk, its length, type, data and CRC
+// returns false on a short write
+inline bool write_chunk(FILE *file, const char *type, const uint8_t *data, size_t size) {
+  uint8_t header[8] = {static_cast<uint8_t>(size >> 24), static_cast<uint8_t>(size >> 16),
+                       static_cast<uint8_t>(size >> 8), static_cast<uint8_t>(size),
+                       static_cast<uint8_t>(type[0]), static_cast<uint8_t>(type[1]),
+                       static_cast<uint8_t>(type[2]), static_cast<uint8_t>(type[3])};
+  uLong crc = crc32(0, header + 4, 4);
+  // Empty chunks have no data, and crc32 with a null buffer returns the initial value instead of crc
+  if (size > 0) {
+    crc = crc32(crc, data, static_cast<uInt>(size));
+  }
+  uint8_t trailer[4] = {static_cast<uint8_t>(crc >> 24), static_cast<uint8_t>(crc >> 16),
+                        static_cast<uint8_t>(crc >> 8), static_cast<uint8_t>(crc)};
+  return std::fwrite(header, 1, 8, file) == 8 && (size == 0 || std::fwrite(data, 1, size, file) == size) &&
+         std::fwrite(trailer, 1, 4, file) == 4;
+}
+
+// Writes an RGB PNG, filtering and deflating strips of rows in parallel
+// pixels - rows of width * 3 samples, 16 bit samples big-endian
+// bit_depth - 8 or 16
+// threads - worker count, 0 for default_threads()
+// returns false if the file can't be written
+inline bool write_png(const std::string &path, size_t width, size_t height, int bit_depth, const uint8_t *pixels,
+                      unsigned threads = 0) {
+  const size_t bpp = 3 * bit_depth / 8;
+  const size_t stride = width * bpp;
+  const size_t strips = (height + png_strip_rows - 1) / png_strip_rows;
+  // Strip s holds filtered rows [s * png_strip_rows, ...) at s * strip_size, deflated into its own bound
+  const size_t strip_size = png_strip_rows * (1 + stride);
+  const size_t deflated_size = compressBound(static_cast<uLong>(strip_size)) + 16;
+  ArenaScope scope;
+  uint8_t *filtered = thread_arena().allocate<uint8_t>(height * (1 + stride));
+  uint8_t *deflated = thread_arena().allocate<uint8_t>(strips * deflated_size);
+  size_t *deflated_sizes = thread_arena().allocate<size_t>(strips);
+  uLong *adlers = thread_arena().allocate<uLong>(strips);
+  auto filtered_size = [&](size_t s) {
+    return std::min(png_strip_rows, height - s * png_strip_rows) * (1 + stride);
+  };
+
+  // Filter every strip first, as the deflate of one strip needs the end of the previous one
+  parallel_for(strips, threads, [&](size_t s) {
+    size_t row0 = s * png_strip_rows, rows = std::min(png_strip_rows, height - row0);
+    for (size_t r = 0; r < rows; ++r) {
+      const uint8_t *row = pixels + (row0 + r) * stride;
+      filter_row(row, row0 + r > 0 ? row - stride : nullptr, stride, bpp, &filtered[(row0 + r) * (1 + stride)]);
+    }
+  });
+
+  std::atomic<bool> ok(true);
+  parallel_for(strips, threads, [&](size_t s) {
+    ArenaScope strip_scope;
+    z_stream z = {};
+    z.zalloc = arena_zalloc;
+    z.zfree = arena_zfree;
+    z.opaque = &thread_arena();
+    if (deflateInit2(&z, png_compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      ok = false;
+      return;
+    }
+    uint8_t *in = filtered + s * strip_size;
+    if (s > 0) {
+      size_t size = std::min(png_dictionary_size, strip_size);
+      deflateSetDictionary(&z, in - size, static_cast<uInt>(size));
+    }
+    z.next_in = in;
+    z.avail_in = static_cast<uInt>(filtered_size(s));
+    z.next_out = deflated + s * deflated_size;
+    z.avail_out = static_cast<uInt>(deflated_size);
+    const bool last = s + 1 == strips;
+    const int status = deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+    // All input consumed and flushed with room to spare, otherwise the strip is truncated
+    if (status != (last ? Z_STREAM_END : Z_OK) || z.avail_in != 0 || z.avail_out == 0) {
+      ok = false;
+    }
+    deflated_sizes[s] = z.total_out;
+    deflateEnd(&z);
+    adlers[s] = adler32(1, in, static_cast<uInt>(filtered_size(s)));
+  });
+  if (!ok) {
+    return false;
+  }
+
+  // Stitch: zlib header, the strips' deflate output, combined Adler-32
+  size_t idat_size = 2 + 4;
+  for (size_t s = 0; s < strips; ++s) {
+    idat_size += deflated_sizes[s];
+  }
+  uint8_t *idat = thread_arena().allocate<uint8_t>(idat_size);
+  uint8_t *end = idat;
+  *end++ = 0x78;
+  *end++ = 0x9c;
+  uLong adler = adlers[0];
+  for (size_t s = 0; s < strips; ++s) {
+    end = std::copy(deflated + s * deflated_size, deflated + s * deflated_size + deflated_sizes[s], end);
+    if (s > 0) {
+      adler = adler32_combine(adler, adlers[s], static_cast<z_off_t>(filtered_size(s)));
+    }
+  }
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    *end++ = static_cast<uint8_t>(adler >> shift);
+  }
+
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  bool written = std::fwrite(signature, 1, sizeof(signature), file) == sizeof(signature);
+  // Truecolor, deflate, adaptive filtering, no interlace
+  uint8_t header[13] = {static_cast<uint8_t>(width >> 24), static_cast<uint8_t>(width >> 16),
+                        static_cast<uint8_t>(width >> 8), static_cast<uint8_t>(width),
+                        static_cast<uint8_t>(height >> 24), static_cast<uint8_t>(height >> 16),
+                        static_cast<uint8_t>(height >> 8), static_cast<uint8_t>(height),
+                        static_cast<uint8_t>(bit_depth), 2, 0, 0, 0};
+  written = written && write_chunk(file, "IHDR", header, sizeof(header));
+  written = written && write_chunk(file, "IDAT", idat, idat_size);
+  written = written && write_chunk(file, "IEND", nullptr, 0);
+  return std::fclose(file) == 0 && written;
+}
+
+// Writes a 16 bit RGB PNG
+// pixels - 3 channels per pixel, row-major
+inline bool write_png16(const std::string &path, size_t width, size_t height, const std::vector<uint16_t> &pixels,
+                        unsigned threads = 0) {
+  ArenaScope scope;
+  uint8_t *bytes = thread_arena().allocate<uint8_t>(pixels.size() * 2);
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    bytes[i * 2] = static_cast<uint8_t>(pixels[i] >> 8);
+    bytes[i * 2 + 1] = static_cast<uint8_t>(pixels[i]);
+  }
+  return write_png(path, width, height, 16, bytes, threads);
+}
+
+// Reads an 8 bit RGB or RGBA PNG as RGB, dropping alpha, for comparing against
+// reference images. Interlaced and other formats are rejected.
+// rgb - output, width * height * 3 bytes
+// returns false if the file can't be read or isn't such a PNG
+inline bool read_png(const std::string &path, size_t &width, size_t &height, std::vector<uint8_t> &rgb) {
+  FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  std::vector<uint8_t> data;
+  uint8_t buffer[65536];
+  for (size_t size; (size = std::fread(buffer, 1, sizeof(buffer), file)) > 0;) {
+    data.insert(data.end(), buffer, buffer + size);
+  }
+  std::fclose(file);
+
+  const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  if (data.size() < 8 || !std::equal(signature, signature + 8, data.begin())) {
+    return false;
+  }
+  auto be32 = [&](size_t at) {
+    return static_cast<uint32_t>(data[at]) << 24 | data[at + 1] << 16 | data[at + 2] << 8 | data[at + 3];
+  };
+  size_t channels = 0;
+  std::vector<uint8_t> idat;
+  for (size_t at = 8; at + 12 <= data.size();) {
+    size_t size = be32(at);
+    if (at + 12 + size > data.size()) {
+      return false;
+    }
+    const uint8_t *type = &data[at + 4], *chunk = &data[at + 8];
+    if (std::equal(type, type + 4, "IHDR")) {
+      width = be32(at + 8);
+      height = be32(at + 12);
+      // 8 bits, RGB or RGBA, not interlaced
+      channels = chunk[9] == 2 ? 3 : chunk[9] == 6 ? 4 : 0;
+      if (chunk[8] != 8 || channels == 0 || chunk[12] != 0) {
+        return false;
+      }
+    } else if (std::equal(type, type + 4, "IDAT")) {
+      idat.insert(idat.end(), chunk, chunk + size);
+    }
+    at += 12 + size;
+  }
+  if (channels == 0) {
+    return false;
+  }
+
+  const size_t stride = width * channels;
+  std::vector<uint8_t> raw(height * (1 + stride));
+  uLongf raw_size = static_cast<uLongf>(raw.size());
+  if (uncompress(raw.data(), &raw_size, idat.data(), static_cast<uLong>(idat.size())) != Z_OK ||
+      raw_size != raw.size()) {
+    return false;
+  }
+
+  // Undo each row's filter in place, then drop alpha
+  rgb.resize(width * height * 3);
+  for (size_t r = 0; r < height; ++r) {
+    uint8_t type = raw[r * (1 + stride)];
+    uint8_t *row = &raw[r * (1 + stride) + 1];
+    const uint8_t *prev = r > 0 ? row - 1 - stride : nullptr;
+    for (size_t i = 0; i < stride; ++i) {
+      int a = i >= channels ? row[i - channels] : 0;
+      int b = prev != nullptr ? prev[i] : 0;
+      int c = prev != nullptr && i >= channels ? prev[i - channels] : 0;
+      int predicted = type == 0 ? 0 : type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) / 2 : paeth(a, b, c);
+      if (type > 4) {
+        return false;
+      }
+      row[i] = static_cast<uint8_t>(row[i] + predicted);
+    }
+    for (size_t c = 0; c < width; ++c) {
+      std::copy(row + c * channels, row + c * channels + 3, &rgb[(r * width + c) * 3]);
+    }
+  }
+  return true;
+}
+
+// Writes 8 bit RGB as QOI (https://qoiformat.org), one pass with a 64 entry colour cache
+inline bool write_qoi(const std::string &path, size_t width, size_t height, const uint8_t *pixels) {
+  ArenaScope scope;
+  // Worst case: header, 4 bytes per pixel, end marker
+  uint8_t *out = thread_arena().allocate<uint8_t>(14 + width * height * 4 + 8);
+  size_t size = 0;
+  auto put = [&](std::initializer_list<uint8_t> bytes) {
+    for (uint8_t b : bytes) {
+      out[size++] = b;
+    }
+  };
+  put({'q', 'o', 'i', 'f'});
+  for (uint32_t v : {static_cast<uint32_t>(width), static_cast<uint32_t>(height)}) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out[size++] = static_cast<uint8_t>(v >> shift);
+    }
+  }
+  // 3 channels, sRGB with linear alpha (the tag is informative only)
+  out[size++] = 3;
+  out[size++] = 0;
+
+  // Slots start as transparent black, as in the decoder, so no pixel matches one that was never stored
+  uint8_t index[64][4] = {};
+  uint8_t prev[3] = {0, 0, 0};
+  int run = 0;
+  const size_t count = width * height;
+  for (size_t i = 0; i < count; ++i) {
+    const uint8_t *px = pixels + i * 3;
+    if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]) {
+      ++run;
+      if (run == 62 || i + 1 == count) {
+        out[size++] = static_cast<uint8_t>(0xc0 | (run - 1));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      out[size++] = static_cast<uint8_t>(0xc0 | (run - 1));
+      run = 0;
+    }
+
+    // Alpha is always 255
+    int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+    if (index[slot][0] == px[0] && index[slot][1] == px[1] && index[slot][2] == px[2] && index[slot][3] == 255) {
+      out[size++] = static_cast<uint8_t>(slot);
+    } else {
+      index[slot][0] = px[0];
+      index[slot][1] = px[1];
+      index[slot][2] = px[2];
+      index[slot][3] = 255;
+      int8_t dr = static_cast<int8_t>(px[0] - prev[0]);
+      int8_t dg = static_cast<int8_t>(px[1] - prev[1]);
+      int8_t db = static_cast<int8_t>(px[2] - prev[2]);
+      int8_t dr_dg = static_cast<int8_t>(dr - dg), db_dg = static_cast<int8_t>(db - dg);
+      if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+        out[size++] = static_cast<uint8_t>(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+      } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+        out[size++] = static_cast<uint8_t>(0x80 | (dg + 32));
+        out[size++] = static_cast<uint8_t>((dr_dg + 8) << 4 | (db_dg + 8));
+      } else {
+        put({0xfe, px[0], px[1], px[2]});
+      }
+    }
+    prev[0] = px[0];
+    prev[1] = px[1];
+    prev[2] = px[2];
+  }
+  put({0, 0, 0, 0, 0, 0, 0, 1});
+
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool written = std::fwrite(out, 1, size, file) == size;
+  return std::fclose(file) == 0 && written;
+}
+
+// Reads a QOI file as RGB, dropping alpha, decoding every op as the reference qoi.h does
+// rgb - output, width * height * 3 bytes
+// returns false if the file can't be read or isn't QOI
+inline bool read_qoi(const std::string &path, size_t &width, size_t &height, std::vector<uint8_t> &rgb) {
+  FILE *file = std::fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  std::vector<uint8_t> data;
+  uint8_t buffer[65536];
+  for (size_t size; (size = std::fread(buffer, 1, sizeof(buffer), file)) > 0;) {
+    data.insert(data.end(), buffer, buffer + size);
+  }
+  std::fclose(file);
+
+  if (data.size() < 14 + 8 || !std::equal(data.begin(), data.begin() + 4, "qoif")) {
+    return false;
+  }
+  auto be32 = [&](size_t at) {
+    return static_cast<uint32_t>(data[at]) << 24 | data[at + 1] << 16 | data[at + 2] << 8 | data[at + 3];
+  };
+  width = be32(4);
+  height = be32(8);
+  rgb.resize(width * height * 3);
+
+  uint8_t index[64][4] = {};
+  uint8_t px[4] = {0, 0, 0, 255};
+  const size_t end = data.size() - 8;
+  size_t at = 14;
+  int run = 0;
+  for (size_t i = 0; i < width * height; ++i) {
+    if (run > 0) {
+      --run;
+    } else {
+      if (at >= end) {
+        return false;
+      }
+      const uint8_t op = data[at++];
+      if (op == 0xfe || op == 0xff) {
+        const size_t channels = op == 0xfe ? 3 : 4;
+        if (at + channels > end) {
+          return false;
+        }
+        std::copy(&data[at], &data[at] + channels, px);
+        at += channels;
+      } else if ((op & 0xc0) == 0x00) {
+        std::copy(index[op], index[op] + 4, px);
+      } else if ((op & 0xc0) == 0x40) {
+        px[0] = static_cast<uint8_t>(px[0] + ((op >> 4) & 3) - 2);
+        px[1] = static_cast<uint8_t>(px[1] + ((op >> 2) & 3) - 2);
+        px[2] = static_cast<uint8_t>(px[2] + (op & 3) - 2);
+      } else if ((op & 0xc0) == 0x80) {
+        if (at >= end) {
+          return false;
+        }
+        const int dg = (op & 0x3f) - 32, next = data[at++];
+        px[0] = static_cast<uint8_t>(px[0] + dg - 8 + (next >> 4));
+        px[1] = static_cast<uint8_t>(px[1] + dg);
+        px[2] = static_cast<uint8_t>(px[2] + dg - 8 + (next & 0x0f));
+      } else {
+        run = op & 0x3f;
+      }
+      int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+      std::copy(px, px + 4, index[slot]);
+    }
+    std::copy(px, px + 3, &rgb[i * 3]);
+  }
+  return true;
+}
+
+// Writes 8 bit RGB as binary PPM, a header then the bytes unchanged
+inline bool write_ppm(const std::string &path, size_t width, size_t height, const uint8_t *pixels) {
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool written = std::fprintf(file, "P6\n%zu %zu\n255\n", width, height) > 0 &&
+                 std::fwrite(pixels, 1, width * height * 3, file) == width * height * 3;
+  return std::fclose(file) == 0 && written;
+}
+
+#endif
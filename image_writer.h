@@ -0,0 +1,160 @@
+#ifndef IMAGE_WRITER_H_
+#define IMAGE_WRITER_H_
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vec3.h"
+#include "output.h"
+
+// Asynchronous image output for multi-frame runs. The renderer fills a frame
+// buffer from a fixed pool and submits it with its path; writer threads take
+// frames from the queue, convert them to 8 bit, hand the buffer back to the
+// pool and then compress and write the file while later frames render. Buffers,
+// paths and each writer's 8 bit scratch are reused, so once every buffer has
+// been through the queue the frame loop allocates nothing.
+
+class ImageWriter {
+  public:
+    // Compresses and writes one frame's 8 bit RGB, called on a writer thread
+    using Write = std::function<bool(const std::string &path, const std::vector<char> &rgb)>;
+
+    // settings - output stage the frames go through, conversion is single threaded per writer
+    // write - called with each converted frame, from several writers at once
+    // writers - background threads, 0 writes on the caller's thread in submit()
+    // depth - frames the pool holds, the renderer waits once all of them are queued
+    ImageWriter(size_t width, size_t height, const OutputSettings &settings, Write write, unsigned writers = 2,
+                size_t depth = 4)
+        : width_(width), settings_(settings), write_(write), buffers_(depth, std::vector<color>(width * height)),
+          paths_(depth) {
+      settings_.threads = 1;
+      queued_.reserve(depth);
+      for (size_t i = 0; i < depth; ++i) {
+        free_.push_back(i);
+      }
+      for (unsigned i = 0; i < writers; ++i) {
+        threads_.emplace_back([this] { drain(); });
+      }
+    }
+
+    ~ImageWriter() {
+      finish();
+    }
+
+    ImageWriter(const ImageWriter &) = delete;
+    ImageWriter &operator=(const ImageWriter &) = delete;
+
+    // Frame buffer to render the next frame into, waiting only while every buffer is queued
+    std::vector<color> &acquire() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      free_ready_.wait(lock, [this] { return !free_.empty(); });
+      current_ = free_.back();
+      free_.pop_back();
+      return buffers_[current_];
+    }
+
+    // Queues the buffer from the last acquire() to be written to path
+    void submit(const std::string &path) {
+      if (threads_.empty()) {
+        paths_[current_] = path;
+        write(current_, inline_rgb_, inline_path_);
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paths_[current_] = path;
+        queued_.push_back(current_);
+      }
+      queued_ready_.notify_one();
+    }
+
+    // Writes every queued frame and stops the writer threads
+    // returns false if any write failed
+    bool finish() {
+      if (!threads_.empty()) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          done_ = true;
+        }
+        queued_ready_.notify_all();
+        for (std::thread &thread : threads_) {
+          thread.join();
+        }
+        threads_.clear();
+      }
+      return failed_.empty();
+    }
+
+    size_t frames() const {
+      return frames_;
+    }
+
+    // Paths that couldn't be written
+    const std::vector<std::string> &failed() const {
+      return failed_;
+    }
+
+  private:
+    // Writer thread: converts and writes queued frames until finish()
+    void drain() {
+      std::vector<char> rgb;
+      std::string path;
+      for (;;) {
+        size_t index;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          queued_ready_.wait(lock, [this] { return done_ || !queued_.empty(); });
+          if (queued_.empty()) {
+            return;
+          }
+          index = queued_.front();
+          queued_.erase(queued_.begin());
+        }
+        write(index, rgb, path);
+      }
+    }
+
+    // Converts buffer index, frees it, then writes its file
+    // rgb/path - the writer's scratch, reused from frame to frame
+    void write(size_t index, std::vector<char> &rgb, std::string &path) {
+      encode_8bit(buffers_[index], width_, settings_, rgb);
+      {
+        // The buffer is free again once converted, before the slower compression and write
+        std::lock_guard<std::mutex> lock(mutex_);
+        path.assign(paths_[index]);
+        free_.push_back(index);
+      }
+      free_ready_.notify_one();
+
+      bool ok = write_(path, rgb);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!ok) {
+        failed_.push_back(path);
+      }
+      ++frames_;
+    }
+
+    size_t width_;
+    OutputSettings settings_;
+    Write write_;
+    std::vector<std::vector<color>> buffers_;
+    std::vector<std::string> paths_;
+    // Buffer indices free for rendering, and waiting for a writer oldest first,
+    // both at most depth long so neither grows once built
+    std::vector<size_t> free_, queued_;
+    size_t current_ = 0;
+    bool done_ = false;
+    std::vector<char> inline_rgb_;
+    std::string inline_path_;
+    std::vector<std::string> failed_;
+    size_t frames_ = 0;
+    std::mutex mutex_;
+    std::condition_variable free_ready_, queued_ready_;
+    std::vector<std::thread> threads_;
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef INTEGRATOR_H_
+#define INTEGRATOR_H_
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "vec3.h"
+#include "ray.h"
+#include "scene.h"
+#include "rng.h"
+#include "light.h"
+
+// Path-tracing integrator for diffuse scenes lit by point lights.
+// Lights are sampled directly at every bounce (next-event estimation), so
+// a path only has to find its way to a surface a light reaches, not to the
+// light itself. Bounces are cosine-weighted, which cancels the Lambertian cos/pdf
+// term, and paths are ended early by Russian roulette once their throughput is low.
+// Point lights are delta lights that bounce rays can never hit, so their NEE
+// estimate needs no multiple importance sampling weight.
+
+// Path tracing settings
+struct PathSettings {
+  // Maximum number of surfaces a path may hit
+  int max_depth = 8;
+  // Surfaces hit before Russian roulette may end the path
+  int rr_depth = 2;
+};
+
+// Ray counts of a render, to compare noise against cost
+struct PathStats {
+  uint64_t camera_rays = 0;
+  uint64_t bounce_rays = 0;
+  uint64_t shadow_rays = 0;
+
+  uint64_t total() const {
+    return camera_rays + bounce_rays + shadow_rays;
+  }
+};
+
+// Samples a direction around normal with pdf cos(theta) / pi
+inline vec3 sample_cosine(const vec3 &normal, Rng &rng) {
+  double u1 = rng.uniform();
+  double u2 = rng.uniform();
+  double r = std::sqrt(u1);
+  double phi = 2 * M_PI * u2;
+
+  // Orthonormal basis around normal (Duff et al. 2017)
+  double sign = std::copysign(1.0, normal.z());
+  double a = -1 / (sign + normal.z());
+  double b = normal.x() * normal.y() * a;
+  vec3 tangent = {1 + sign * normal.x() * normal.x() * a, sign * b, -sign * normal.x()};
+  vec3 bitangent = {b, sign + normal.y() * normal.y() * a, -normal.y()};
+
+  return r * std::cos(phi) * tangent + r * std::sin(phi) * bitangent + std::sqrt(std::max(0.0, 1 - u1)) * normal;
+}
+
+// Traces one path and returns the radiance it carries back along r
+// With max_depth 1 this is the same direct lighting as shade()
+template <typename Scene>
+vec3 trace_path(const Scene &scene, Ray r, Rng &rng, const PathSettings &settings, PathStats &stats) {
+  vec3 radiance = {0, 0, 0};
+  vec3 throughput = {1, 1, 1};
+  ++stats.camera_rays;
+
+  for (int depth = 0; depth < settings.max_depth; ++depth) {
+    Hit hit;
+    if (!scene.closest(r, hit)) {
+      break;
+    }
+
+    // Next-event estimation towards picked lights, lit exactly as shade() does
+    radiance += throughput * direct_light(scene, hit, hash_point(hit.p), &stats.shadow_rays);
+
+    if (depth + 1 == settings.max_depth) {
+      break;
+    }
+
+    // Cosine-weighted bounce, the albedo is the whole BRDF * cos / pdf weight
+    throughput = throughput * hit.albedo;
+
+    // Russian roulette, survivors are reweighted to keep the estimate unbiased
+    if (depth + 1 >= settings.rr_depth) {
+      double survive = std::min(0.95, std::max({throughput.x(), throughput.y(), throughput.z()}));
+      if (rng.uniform() >= survive) {
+        break;
+      }
+      throughput /= survive;
+    }
+
+    // Bounce off the side of the surface the path arrived on
+    vec3 normal = dot(hit.normal, r.direction) > 0 ? -hit.normal : hit.normal;
+    ++stats.bounce_rays;
+    r = surface_ray(hit.p, sample_cosine(normal, rng));
+  }
+  return radiance;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef KERNEL_H_
+#define KERNEL_H_
+#include <algorithm>
+
+#include "vec3.h"
+#include "ray.h"
+#include "scene.h"
+#include "camera.h"
+#include "sampler.h"
+#include "light.h"
+
+// Render kernel specialised at compile time on projection and scene.
+// Closest-hit and occlusion queries are separate instantiations, so the
+// per-sample path has no runtime branches on camera, query or primitive type.
+
+// Calculates direct diffuse lighting with hard shadows, same as shoot_ray
+// scene - scene providing closest(), any() and light sampling
+// r - ray to test
+// returns color of the closest hit, black if nothing is hit
+template <typename Scene>
+vec3 shade(const Scene &scene, const Ray &r) {
+  Hit hit;
+  if (!scene.closest(r, hit)) {
+    return {0, 0, 0};
+  }
+
+  // Lights are picked by hashing the hit point, so the image doesn't depend on render order
+  return direct_light(scene, hit, hash_point(hit.p));
+}
+
+// Averages all samples of one pixel
+// Proj - Perspective or Orthographic
+// samples - n * n offsets within the pixel, row-major
+// r/c - pixel row and column
+// Flattened so the whole per-sample path, down to each primitive test, is inlined here
+template <typename Proj, typename Scene>
+__attribute__((flatten)) vec3 render_pixel(const Scene &scene, const Camera &cam, const Sample *samples, size_t n,
+                  size_t r, size_t c, size_t width, size_t height) {
+  vec3 color_sum = {};
+  for (size_t i = 0; i < n * n; ++i) {
+    double row_ratio = (static_cast<double>(r) + samples[i].r) / height;
+    double col_ratio = (static_cast<double>(c) + samples[i].c) / width;
+    color_sum += shade(scene, Proj::generate(cam, row_ratio, col_ratio));
+  }
+  return color_sum / (n * n);
+}
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef LIGHT_H_
+#define LIGHT_H_
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "vec3.h"
+#include "ray.h"
+#include "rng.h"
+
+// Point lights and how shading picks among them. As in shoot_ray, lights
+// don't fall off with distance, so a light's share of the lighting anywhere
+// is its power, and sampling lights in proportion to power through an alias
+// table (Vose 1991) is the importance sampling that fits. Each shading point
+// casts a fixed number of shadow rays whatever the light count.
+
+struct PointLight {
+  point3 position;
+  color intensity;
+};
+
+// A light picked for one shading point
+struct LightSample {
+  point3 position;
+  // Intensity divided by the chance of picking the light
+  color weight;
+  // Index of the light in its set
+  uint32_t light;
+};
+
+// Uniform number in [0, 1) hashed from a point, so shading code without a
+// random number generator can still pick lights, and pick the same ones on every run
+inline double hash_point(const point3 &p) {
+  uint64_t h = 0;
+  for (double e : p.e) {
+    uint64_t bits;
+    std::memcpy(&bits, &e, sizeof(bits));
+    // splitmix64 finaliser
+    h += bits + 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+  }
+  return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Lights with a power-weighted alias table for picking one in O(1)
+class LightSet {
+  public:
+    // Shadow rays cast per shading point
+    int samples_per_point = 1;
+
+    void clear() {
+      lights_.clear();
+      table_.clear();
+    }
+
+    // Adds a light, call build() once all are added
+    void add(const PointLight &light) {
+      lights_.push_back(light);
+    }
+
+    // Builds the alias table from the lights' powers
+    void build() {
+      const size_t n = lights_.size();
+      table_.assign(n, Column());
+      double total_power = 0;
+      for (const PointLight &l : lights_) {
+        total_power += power(l);
+      }
+      if (n == 0 || total_power <= 0) {
+        return;
+      }
+
+      // Split lights into those below and above the average power, then let each
+      // small one borrow the rest of its column from a large one
+      std::vector<double> scaled(n);
+      std::vector<uint32_t> small, large;
+      for (size_t i = 0; i < n; ++i) {
+        scaled[i] = power(lights_[i]) * n / total_power;
+        (scaled[i] < 1 ? small : large).push_back(static_cast<uint32_t>(i));
+      }
+      std::vector<uint32_t> alias(n);
+      for (size_t i = 0; i < n; ++i) {
+        alias[i] = static_cast<uint32_t>(i);
+      }
+      while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+        table_[s].keep = scaled[s];
+        alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+          large.pop_back();
+          small.push_back(l);
+        }
+      }
+      // Leftovers are 1 up to rounding
+      for (uint32_t i : small) {
+        table_[i].keep = 1;
+      }
+      for (uint32_t i : large) {
+        table_[i].keep = 1;
+      }
+
+      // Each column holds both its samples, so a pick touches one column and nothing else
+      for (size_t i = 0; i < n; ++i) {
+        table_[i].own = weighted(i, total_power);
+        table_[i].alias = weighted(alias[i], total_power);
+      }
+    }
+
+    size_t size() const {
+      return lights_.size();
+    }
+
+    const PointLight &operator[](size_t i) const {
+      return lights_[i];
+    }
+
+    // Picks a light in proportion to its power
+    // u - uniform number in [0, 1)
+    LightSample sample(double u) const {
+      const size_t n = table_.size();
+      double x = u * n;
+      size_t column = std::min(n - 1, static_cast<size_t>(x));
+      const Column &c = table_[column];
+      return x - column < c.keep ? c.own : c.alias;
+    }
+
+  private:
+    struct Column {
+      // Chance of keeping the column's own light rather than its alias
+      double keep = 1;
+      LightSample own, alias;
+    };
+
+    static double power(const PointLight &l) {
+      return (l.intensity.x() + l.intensity.y() + l.intensity.z()) / 3;
+    }
+
+    LightSample weighted(size_t i, double total_power) const {
+      const PointLight &l = lights_[i];
+      // A single light is always picked, so its weight is exactly its intensity
+      if (lights_.size() == 1) {
+        return {l.position, l.intensity, 0};
+      }
+      return {l.position, l.intensity * (total_power / power(l)), static_cast<uint32_t>(i)};
+    }
+
+    std::vector<PointLight> lights_;
+    std::vector<Column> table_;
+};
+
+// Fills lights with count coloured lights scattered over a dome above the scene,
+// their total power equal to one product shot light
+// seed - placement and colour sequence
+inline void make_light_dome(LightSet &lights, size_t count, uint64_t seed = 7) {
+  Rng rng(seed);
+  std::vector<PointLight> dome(count);
+  double total = 0;
+  for (PointLight &l : dome) {
+    double z = 0.2 + 0.8 * rng.uniform();
+    double phi = 2 * M_PI * rng.uniform();
+    double s = std::sqrt(1 - z * z);
+    l.position = point3(0, 0.5, -2) + 15 * vec3(s * std::cos(phi), z, s * std::sin(phi));
+    // Powers spread over two orders of magnitude, so importance sampling matters
+    double strength = std::pow(10.0, 2 * rng.uniform());
+    l.intensity = strength * color(0.6 + 0.4 * rng.uniform(), 0.6 + 0.4 * rng.uniform(), 0.6 + 0.4 * rng.uniform());
+    total += (l.intensity.x() + l.intensity.y() + l.intensity.z()) / 3;
+  }
+
+  lights.clear();
+  for (PointLight &l : dome) {
+    l.intensity = l.intensity / total;
+    lights.add(l);
+  }
+  lights.build();
+}
+
+// Direct diffuse lighting at a hit, averaged over scene.light_samples() picked lights
+// u - uniform number picking the first light, the others are stratified from it
+// shadow_rays - incremented per shadow ray cast, may be nullptr
+// The single light of the product shot gives exactly shoot_ray's result
+template <typename Scene, typename Hit>
+color direct_light(const Scene &scene, const Hit &hit, double u, uint64_t *shadow_rays = nullptr) {
+  const int samples = scene.light_samples();
+  color result = {0, 0, 0};
+  for (int j = 0; j < samples; ++j) {
+    double uj = (j + u) / samples;
+    LightSample light = scene.sample_light(uj);
+    vec3 to_light = unit_vector(light.position - hit.p);
+    double diffuse = std::max(dot(to_light, hit.normal), 0.0);
+    if (diffuse <= 0) {
+      continue;
+    }
+    if (hit.shadowed) {
+      if (shadow_rays != nullptr) {
+        ++*shadow_rays;
+      }
+      if (scene.any(segment_ray(hit.p, light.position), light.light)) {
+        continue;
+      }
+    }
+    result += diffuse * hit.albedo * light.weight;
+  }
+  return samples == 1 ? result : result / samples;
+}
+
+#endif
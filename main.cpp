@@ -1,114 +1,67 @@
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
 #include "vec3.h"
 #include "ray.h"
+#include "hit.h"
+#include "scene.h"
+#include "camera.h"
+#include "sampler.h"
+#include "kernel.h"
+#include "wavefront.h"
+#include "rng.h"
+#include "integrator.h"
+#include "parallel.h"
+#include "denoise.h"
+#include "texture.h"
+#include "accel_scene.h"
+#include "raster.h"
+#include "morton.h"
+#include "perf_counters.h"
+#include "output.h"
+#include "image_io.h"
+#include "video.h"
+#include "regress.h"
+#include "vrs.h"
+#include "dynamic_resolution.h"
+#include "progressive.h"
+#include "image_writer.h"
+#include "heatmap.h"
+#include "arena.h"
+#include "scheduler.h"
 
-// Assigns a vec3 to char*, used for assigning float pixels to discrete images
-// img - target array
-// color - color to assign in [0,1] range
-void img_assign(char *img, const vec3 &color) {
-  img[0] = 255.999 * color.e[0];
-  img[1] = 255.999 * color.e[1];
-  img[2] = 255.999 * color.e[2];
-}
-
-// Checks if a ray hits a sphere
-// center - the sphere center
-// radius - the sphere radius
-// r - ray to test
-// t0 - output for first hit
-// t1 - output for second hit
-// returns true if any hit found. Sets t0 to smaller t of hits, t1 to second t if found.
-bool hit_sphere(const point3& center, double radius, const Ray& r, double *t0, double *t1) {
-  // Adapted from lecture
-  vec3 d = r.direction;
-  vec3 d_unit = unit_vector(d);
-  vec3 f = r.origin - center;
-  double a = d.length_squared();
-  double b = 2 * dot(f, d);
-  double c = f.length_squared() - radius * radius;
-
-  double b2_minus_4ac = 4 * a * (radius * radius - (f - dot(f, d_unit) * d_unit).length_squared());
-
-  // Return early for invaid determinant
-  if (b2_minus_4ac < 0) {
-    return false;
-  }
-
-  double q = -0.5 * (b + (b >= 0 ? 1 : -1) * std::sqrt(b2_minus_4ac));
-
-  // Calculate two solutions
-  *t0 = c / q;
-  *t1 = q / a;
-
-  // Order them
-  if (*t1 < *t0) {
-    std::swap(*t0, *t1);
-  }
-
-  // Try putting t1 first if t0 is negative
-  if (*t0 < 0) {
-    std::swap(*t0, *t1);
-  }
-
-  // If still negative, both are negative, put it back and return
-  if (*t0 < 0) {
-    std::swap(*t0, *t1);
-    return false;
-  }
-
-  // Otherwise, t0 is positive
-  return true;
-}
-
-// Checks if a ray hits a plane
-// anchor - anchor of plane
-// normal - normal of plane
-// r - ray to test
-// returns t of hit
-double hit_plane(const vec3 &anchor, const vec3 &normal, const Ray &r) {
-  double denominator = dot(r.direction, normal);
-  if (denominator == 0.0) {
-    denominator = 0.0000001;
+// Counts every heap allocation into heap_allocations(), for the steady state check in --regress.
+// Both are kept out of line, or the compiler pairs the inlined malloc() and free() with new and delete
+__attribute__((noinline)) void *operator new(size_t size) {
+  heap_allocations().fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
   }
-  return dot(anchor - r.origin, normal) / denominator;
+  throw std::bad_alloc();
 }
 
-// https://en.wikipedia.org/wiki/M%C3%B6ller%E2%80%93Trumbore_intersection_algorithm
-// Check if a ray hits a triangle
-// r - ray to test
-// vertex0/1/2 - three vertices of triangle
-// returns t of hit, else -1
-double hit_triangle(const Ray &r, const vec3 &vertex0, const vec3 &vertex1, const vec3 &vertex2) {
-    const float EPSILON = 0.0000001;
-    vec3 edge1, edge2, h, s, q;
-    float a,f,u,v;
-    edge1 = vertex1 - vertex0;
-    edge2 = vertex2 - vertex0;
-    h = cross(r.direction, edge2);
-    a = dot(edge1, h);
-    if (a > -EPSILON && a < EPSILON)
-        return -1;    // This ray is parallel to this triangle.
-    f = 1.0/a;
-    s = r.origin - vertex0;
-    u = f * dot(s, h);
-    if (u < 0.0 || u > 1.0)
-        return -1;
-    q = cross(s, edge1);
-    v = f * dot(r.direction, q);
-    if (v < 0.0 || u + v > 1.0)
-        return -1;
-    // At this stage we can compute t to find out where the intersection point is on the line.
-    float t = f * dot(edge2, q);
-    if (t > EPSILON) // ray intersection
-    {
-        return t;
-    }
-    else // This means that there is a line intersection but not a ray intersection.
-        return -1;
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+  std::free(p);
 }
 
 // Shoots a ray and either calculates color or if it hit an object
@@ -121,8 +74,11 @@ vec3 shoot_ray(const Ray &r, bool *hit=nullptr) {
   vec3 normal = {0, 1, 0};
   vec3 light = {10, 10, 10};
 
+  // Hits outside the ray's range count as misses
+  auto in_range = [&r](double t) { return t > r.t_min && t < r.t_max ? t : -1; };
+
   // Plane hit or not
-  double plane_hit_time = hit_plane(anchor, normal, r);
+  double plane_hit_time = in_range(hit_plane(anchor, normal, r));
 
   // Triangle details
   vec3 v0 = {0.2, 0, -1};
@@ -130,11 +86,11 @@ vec3 shoot_ray(const Ray &r, bool *hit=nullptr) {
   vec3 v2 = {1, 1.5, -2};
 
   // Triangle hit or not
-  double triangle_hit_time = hit_triangle(r, v0, v1, v2);
+  double triangle_hit_time = in_range(hit_triangle(r, v0, v1, v2));
 
   double t0, t1;
   // If hit sphere and t is smallest compared to the other two
-  if (hit_sphere({0, 0.5, -2}, 0.5, r, &t0, &t1) && (plane_hit_time <= 0 || t0 <= plane_hit_time) && (triangle_hit_time <= 0 || t0 <= triangle_hit_time)) {
+  if (hit_sphere({0, 0.5, -2}, 0.5, r, &t0, &t1) && in_range(t0) > 0 && (plane_hit_time <= 0 || t0 <= plane_hit_time) && (triangle_hit_time <= 0 || t0 <= triangle_hit_time)) {
     // Early out if only looking for collision
     if (hit != nullptr) {
       *hit = true;
@@ -149,7 +105,7 @@ vec3 shoot_ray(const Ray &r, bool *hit=nullptr) {
 
     // Check if hit anything to cast shadow
     bool hit_shadow;
-    shoot_ray({sphere_hit + normal * 0.001, to_light}, &hit_shadow);
+    shoot_ray(segment_ray(sphere_hit, light), &hit_shadow);
     if (hit_shadow) {
       return {0, 0, 0};
     }
@@ -192,7 +148,7 @@ vec3 shoot_ray(const Ray &r, bool *hit=nullptr) {
     double diffuse = std::max(dot(to_light, normal), 0.0);
 
     bool hit_shadow;
-    shoot_ray({plane_hit + normal * 0.001, to_light}, &hit_shadow);
+    shoot_ray(segment_ray(plane_hit, light), &hit_shadow);
     if (hit_shadow) {
       return {0, 0, 0};
     }
@@ -206,195 +162,1629 @@ vec3 shoot_ray(const Ray &r, bool *hit=nullptr) {
   return {0, 0, 0};
 }
 
-// Generates a random number between [min, max]
-int rand_int(int min, int max) {
-  return rand() % (max - min + 1) + min;
+// Calls pixel(r, c, samples) for every pixel with its n * n jitter samples: row-major from
+// the global rand() stream, or with det.enabled rows across threads, each pixel's jitter
+// from its own generator
+template <typename F>
+void for_each_pixel(size_t width, size_t height, size_t n, const Determinism &det, F pixel) {
+  if (!det.enabled) {
+    ArenaScope scope;
+    Sample *samples = thread_arena().allocate<Sample>(n * n);
+    for (size_t r = 0; r < height; ++r) {
+      for (size_t c = 0; c < width; ++c) {
+        multi_jitter(samples, n);
+        pixel(r, c, samples);
+      }
+    }
+    return;
+  }
+  parallel_for(height, det.threads, [&](size_t r) {
+    ArenaScope scope;
+    Sample *samples = thread_arena().allocate<Sample>(n * n);
+    for (size_t c = 0; c < width; ++c) {
+      multi_jitter(samples, n, det, r * width + c);
+      pixel(r, c, samples);
+    }
+  });
+}
+
+// Renders the image through the generic, runtime-dispatched path
+// image - output, height * width linear colors
+// n - multi jitter samples per side
+void render_generic(color *image, const Camera &cam, size_t width, size_t height, size_t n, const Determinism &det) {
+  for_each_pixel(width, height, n, det, [&](size_t r, size_t c, const Sample *samples) {
+    // Sum results of all samples
+    vec3 color_sum = {};
+
+    for (size_t i = 0; i < n * n; ++i) {
+      // Position within viewport plus jitter
+      double row_ratio = (static_cast<double>(r) + samples[i].r) / height;
+      double col_ratio = (static_cast<double>(c) + samples[i].c) / width;
+      color_sum += shoot_ray(camera_ray(cam, row_ratio, col_ratio));
+    }
+
+    // Assign final color
+    image[r * width + c] = color_sum / (n * n);
+  });
+}
+
+// Renders the image through the kernel specialised on projection and scene
+template <typename Proj, typename Scene>
+void render_specialised(color *image, const Scene &scene, const Camera &cam, size_t width, size_t height, size_t n,
+                        const Determinism &det) {
+  for_each_pixel(width, height, n, det, [&](size_t r, size_t c, const Sample *samples) {
+    image[r * width + c] = render_pixel<Proj>(scene, cam, samples, n, r, c, width, height);
+  });
 }
 
-// Holds row and column in [0, 1]
-struct Sample {
-  double r;
-  double c;
+// Side of a scheduler tile task in pixels
+const size_t task_tile_size = 32;
+
+// One frame as tile tasks for a TaskScheduler. Each pixel's jitter is drawn as with --deterministic,
+// so the image is the deterministic render's whatever order the tiles run in.
+template <typename Scene>
+class TileFrame {
+  public:
+    // image - output, cam.height rows of cam.width colors, written as the tiles run
+    // det - sampling seed and frame, det.enabled is ignored
+    TileFrame(color *image, const Scene &scene, const Camera &cam, size_t n, const Determinism &det)
+        : image_(image), scene_(scene), cam_(cam), n_(n), det_(det),
+          tiles_x_((cam.width + task_tile_size - 1) / task_tile_size),
+          tiles_y_((cam.height + task_tile_size - 1) / task_tile_size) {}
+
+    size_t tiles() const {
+      return tiles_x_ * tiles_y_;
+    }
+
+    // Renders tile index, row-major over the tiles
+    void operator()(size_t tile) const {
+      if (cam_.is_ortho) {
+        render_tile<Orthographic>(tile);
+      } else {
+        render_tile<Perspective>(tile);
+      }
+    }
+
+  private:
+    template <typename Proj>
+    void render_tile(size_t tile) const {
+      const size_t width = cam_.width, height = cam_.height;
+      const size_t row0 = tile / tiles_x_ * task_tile_size, col0 = tile % tiles_x_ * task_tile_size;
+      ArenaScope scope;
+      Sample *samples = thread_arena().allocate<Sample>(n_ * n_);
+      for (size_t r = row0; r < std::min(row0 + task_tile_size, height); ++r) {
+        for (size_t c = col0; c < std::min(col0 + task_tile_size, width); ++c) {
+          multi_jitter(samples, n_, det_, r * width + c);
+          image_[r * width + c] = render_pixel<Proj>(scene_, cam_, samples, n_, r, c, width, height);
+        }
+      }
+    }
+
+    color *image_;
+    const Scene &scene_;
+    Camera cam_;
+    size_t n_;
+    Determinism det_;
+    size_t tiles_x_, tiles_y_;
 };
 
-int main(int argc, char **argv) {
-  // Output params
-  const size_t width = 500;
-  const size_t height = 500;
-  const size_t channels = 3;
-  char png[height][width][channels] = {};
+// Renders like render_specialised, recording each pixel's cost
+// costs - output, ticks, rays and primitive tests of every pixel
+template <typename Proj, typename Scene>
+void render_profiled(color *image, const Scene &scene, const Camera &cam, size_t width, size_t height, size_t n,
+                     const Determinism &det, CostMaps &costs) {
+  CountingScene<Scene> counting(scene);
+  costs.resize(width, height);
+  for_each_pixel(width, height, n, det, [&](size_t r, size_t c, const Sample *samples) {
+    const RayCounts &counts = ray_counts();
+    const RayCounts before = counts;
+    const uint64_t start = cost_ticks();
+    image[r * width + c] = render_pixel<Proj>(counting, cam, samples, n, r, c, width, height);
+    costs.ticks[r * width + c] = cost_ticks() - start;
+    costs.rays[r * width + c] = counts.rays - before.rays;
+    costs.tests[r * width + c] = counts.tests - before.tests;
+  });
+}
 
-  // Switch this if needed
-  bool is_ortho = false;
+// Renders like render_specialised, but tile by tile with pixels in Morton order into a
+// tiled image, converted to row-major at the end. Jitter is still drawn row-major a band
+// of tiles at a time, so every pixel gets the same samples as in the other paths.
+// With det.enabled, tiles run across threads and each pixel draws its own jitter.
+template <typename Proj, typename Scene>
+void render_morton(color *image, const Scene &scene, const Camera &cam, size_t width, size_t height, size_t n,
+                   const Determinism &det) {
+  const size_t spp = n * n;
+  Pool<TiledImage>::Lease frame = pool<TiledImage>().acquire();
+  TiledImage &tiled = *frame;
+  tiled.resize(width, height);
 
-  int frame = 0;
-  // Change this to any vectors if needed
-  vec3 camera_pos = {2 * std::sin(frame / 20.0), 1, 2 * std::cos(frame / 20.0)};
-  vec3 camera_forward = unit_vector(vec3(0, 0.5, -2) - camera_pos);
+  // Renders the pixels of tile (tx, ty), jitter of pixel (r, c) starting at
+  // jitter[((r - row0) * stride + c - col0) * spp]
+  auto render_tile = [&](size_t tx, size_t ty, const Sample *jitter, size_t stride, size_t row0, size_t col0) {
+    for (uint32_t code = 0; code < morton_tile_size * morton_tile_size; ++code) {
+      uint32_t x, y;
+      morton_decode(code, x, y);
+      size_t r = ty * morton_tile_size + y, c = tx * morton_tile_size + x;
+      if (r >= height || c >= width) {
+        continue;
+      }
+      const Sample *samples = &jitter[((r - row0) * stride + c - col0) * spp];
+      tiled.at(tx, ty, code) = render_pixel<Proj>(scene, cam, samples, n, r, c, width, height);
+    }
+  };
 
-  // Slightly different viewpoint for the ortho images
-  if (is_ortho) {
-    camera_pos = {4 * std::sin(0 / 20.0), 2, 4 * std::cos(0 / 20.0)};
-    camera_forward = unit_vector(vec3(0, 1, -2) - camera_pos);
+  if (det.enabled) {
+    parallel_for(tiled.tiles_x() * tiled.tiles_y(), det.threads, [&](size_t tile) {
+      const size_t tx = tile % tiled.tiles_x(), ty = tile / tiled.tiles_x();
+      const size_t row0 = ty * morton_tile_size, col0 = tx * morton_tile_size;
+      ArenaScope scope;
+      Sample *jitter = thread_arena().allocate<Sample>(morton_tile_size * morton_tile_size * spp);
+      for (size_t y = 0; y < morton_tile_size && row0 + y < height; ++y) {
+        for (size_t x = 0; x < morton_tile_size && col0 + x < width; ++x) {
+          multi_jitter(&jitter[(y * morton_tile_size + x) * spp], n, det, (row0 + y) * width + col0 + x);
+        }
+      }
+      render_tile(tx, ty, jitter, morton_tile_size, row0, col0);
+    });
+  } else {
+    ArenaScope scope;
+    Sample *band = thread_arena().allocate<Sample>(morton_tile_size * width * spp);
+    for (size_t ty = 0; ty < tiled.tiles_y(); ++ty) {
+      const size_t row0 = ty * morton_tile_size;
+      const size_t rows = std::min(morton_tile_size, height - row0);
+      for (size_t p = 0; p < rows * width; ++p) {
+        multi_jitter(&band[p * spp], n);
+      }
+      for (size_t tx = 0; tx < tiled.tiles_x(); ++tx) {
+        render_tile(tx, ty, band, width, row0, 0);
+      }
+    }
   }
+  tiled.to_linear(image);
+}
 
-  // Calculate camera-local axis
-  vec3 camera_right = cross(camera_forward, {0, 1, 0});
-  vec3 camera_up = cross(camera_right, camera_forward);
+// Path traces the image with the specialised kernel's scene and projection
+// settings - depth and Russian roulette limits
+// stats - output, rays traced
+// det - with det.enabled every sample also draws its path decisions from its own generator
+template <typename Proj, typename Scene>
+void render_path_traced(color *image, const Scene &scene, const Camera &cam, size_t width, size_t height, size_t n,
+                        const PathSettings &settings, PathStats &stats, const Determinism &det) {
+  Rng rng;
+  // Rows are never split across threads, so each row counts its own rays
+  ArenaScope scope;
+  PathStats *row_stats = thread_arena().make<PathStats>(height);
 
-  // Calculate viewport vectors
-  double aspect_ratio = static_cast<double>(width) / height;
-  double focal = 1.0;
+  for_each_pixel(width, height, n, det, [&](size_t r, size_t c, const Sample *samples) {
+    vec3 color_sum = {};
+    for (size_t i = 0; i < n * n; ++i) {
+      double row_ratio = (static_cast<double>(r) + samples[i].r) / height;
+      double col_ratio = (static_cast<double>(c) + samples[i].c) / width;
+      Ray ray = Proj::generate(cam, row_ratio, col_ratio);
+      if (det.enabled) {
+        Rng sample_rng = pixel_rng(det, r * width + c, 1 + i);
+        color_sum += trace_path(scene, ray, sample_rng, settings, row_stats[r]);
+      } else {
+        color_sum += trace_path(scene, ray, rng, settings, row_stats[r]);
+      }
+    }
+    image[r * width + c] = color_sum / (n * n);
+  });
+  for (size_t r = 0; r < height; ++r) {
+    const PathStats &row = row_stats[r];
+    stats.camera_rays += row.camera_rays;
+    stats.bounce_rays += row.bounce_rays;
+    stats.shadow_rays += row.shadow_rays;
+  }
+}
 
-  double viewport_height = 1;
-  if (is_ortho) {
-    viewport_height *= 3.5;
+// Render paths selectable from the command line
+enum class RenderPath { Generic, Specialised, Morton, Wavefront, PathTraced, Hybrid };
+
+const char *path_name(RenderPath path) {
+  switch (path) {
+    case RenderPath::Generic: return "generic";
+    case RenderPath::Specialised: return "specialised";
+    case RenderPath::Morton: return "morton";
+    case RenderPath::Wavefront: return "wavefront";
+    case RenderPath::PathTraced: return "path traced";
+    case RenderPath::Hybrid: return "hybrid";
   }
+  return "";
+}
 
-  // These are used to get world coords of pixels in viewport
-  double viewport_width = viewport_height * aspect_ratio;
-  vec3 viewport_right = viewport_width * camera_right;
-  vec3 viewport_down = -viewport_height * camera_up;
-  vec3 viewport_top_left = camera_pos - viewport_right / 2 - viewport_down / 2 + focal * camera_forward;
+// Renders through the wavefront engine into image
+template <typename Proj, typename Scene>
+void render_wavefront_image(color *image, const Scene &scene, const Camera &cam, size_t width, size_t height, size_t n,
+                            const Determinism &det) {
+  render_wavefront<Proj>(scene, cam, width, height, n, det, [&](size_t r, size_t c, const vec3 &pixel) {
+    image[r * width + c] = pixel;
+  });
+}
 
-  // Number of multi jitter samples = n^2
-  size_t n = 4;
-  double n_d = n;
-  Sample samples[n][n] = {};
+// Renders with the selected path, restarting the jitter sequence so every path sees the same samples
+// scene - used by every path except RenderPath::Generic, whose scene is built into shoot_ray
+// settings - used by RenderPath::PathTraced only
+// det - deterministic sampling across det.threads, otherwise every path but RenderPath::Hybrid is single threaded
+// returns the rays RenderPath::PathTraced traced, none for the other paths
+template <typename Scene>
+PathStats render(color *image, RenderPath path, const Scene &scene, const Camera &cam, size_t width, size_t height,
+                 size_t n, const PathSettings &settings = PathSettings(), const Determinism &det = Determinism()) {
+  srand(1);
+  PathStats stats;
+  switch (path) {
+    case RenderPath::Generic:
+      render_generic(image, cam, width, height, n, det);
+      break;
+    case RenderPath::Specialised:
+      if (cam.is_ortho) {
+        render_specialised<Orthographic>(image, scene, cam, width, height, n, det);
+      } else {
+        render_specialised<Perspective>(image, scene, cam, width, height, n, det);
+      }
+      break;
+    case RenderPath::Morton:
+      if (cam.is_ortho) {
+        render_morton<Orthographic>(image, scene, cam, width, height, n, det);
+      } else {
+        render_morton<Perspective>(image, scene, cam, width, height, n, det);
+      }
+      break;
+    case RenderPath::Wavefront:
+      if (cam.is_ortho) {
+        render_wavefront_image<Orthographic>(image, scene, cam, width, height, n, det);
+      } else {
+        render_wavefront_image<Perspective>(image, scene, cam, width, height, n, det);
+      }
+      break;
+    case RenderPath::PathTraced:
+      if (cam.is_ortho) {
+        render_path_traced<Orthographic>(image, scene, cam, width, height, n, settings, stats, det);
+      } else {
+        render_path_traced<Perspective>(image, scene, cam, width, height, n, settings, stats, det);
+      }
+      break;
+    case RenderPath::Hybrid:
+      if (cam.is_ortho) {
+        render_hybrid<Orthographic>(image, scene, cam, width, height, n, det.threads);
+      } else {
+        render_hybrid<Perspective>(image, scene, cam, width, height, n, det.threads);
+      }
+      break;
+  }
+  return stats;
+}
 
-  for (size_t r = 0; r < height; ++r) {
-    for (size_t c = 0; c < width; ++c) {
-      // Generate grid of samples diagonally by row
-      for (size_t rr = 0; rr < n; ++rr) {
-        for (size_t cc = 0; cc < n; ++cc) {
-          samples[rr][cc].r = rr / n_d + (cc % n) / n_d / n_d + 0.5 / n_d / n_d;
-          samples[rr][cc].c = cc / n_d + (rr % n) / n_d / n_d + 0.5 / n_d / n_d;
-        }
+// Renders a full frame through the specialised kernel with per-pixel costs, the image the same as render()'s
+// scene - counted_tests() of a StaticScene also fills in costs.tests
+template <typename Scene>
+void profile_frame(std::vector<color> &image, const Scene &scene, const Camera &cam, size_t n, const Determinism &det,
+                   CostMaps &costs) {
+  srand(1);
+  if (cam.is_ortho) {
+    render_profiled<Orthographic>(image.data(), scene, cam, cam.width, cam.height, n, det, costs);
+  } else {
+    render_profiled<Perspective>(image.data(), scene, cam, cam.width, cam.height, n, det, costs);
+  }
+}
+
+// Writes one per-pixel measure as a heatmap and prints its scale, skipped if every value is zero
+// unit - what the values count, for the printed scale
+// returns false if the file can't be written
+bool write_measure(const std::string &path, const std::vector<uint64_t> &values, size_t width, size_t height,
+                   const char *unit) {
+  uint64_t total = 0;
+  for (uint64_t value : values) {
+    total += value;
+  }
+  if (total == 0) {
+    return true;
+  }
+  uint64_t top = write_heatmap(path, values, width, height);
+  if (top == 0) {
+    std::cerr << "Can't write " << path << std::endl;
+    return false;
+  }
+  std::cout << "Heatmap " << path << ": mean " << static_cast<double>(total) / values.size() << ", white at " << top
+            << " " << unit << " per pixel" << std::endl;
+  return true;
+}
+
+// Writes each cost of a render as out_stem_<measure>.png, scenes without counted primitives have no tests map
+// returns false if a file can't be written
+bool write_heatmaps(const std::string &out_stem, const CostMaps &costs) {
+  return write_measure(out_stem + "_time.png", costs.ticks, costs.width, costs.height, cost_tick_unit()) &&
+         write_measure(out_stem + "_rays.png", costs.rays, costs.width, costs.height, "rays") &&
+         write_measure(out_stem + "_tests.png", costs.tests, costs.width, costs.height, "primitive tests");
+}
+
+// Renders like render_specialised, recording each pixel's acceleration structure walks
+// counts - output, closest hit and occlusion query counts of every pixel
+template <typename Proj, typename Scene>
+void render_traversal(color *image, const Scene &scene, const Camera &cam, size_t width, size_t height, size_t n,
+                      const Determinism &det, std::vector<TraversalCounts> &counts) {
+  TraversalScene<Scene> traced(scene);
+  counts.assign(width * height, TraversalCounts());
+  for_each_pixel(width, height, n, det, [&](size_t r, size_t c, const Sample *samples) {
+    TraversalCounts &pixel = traversal_counts();
+    pixel = TraversalCounts();
+    image[r * width + c] = render_pixel<Proj>(traced, cam, samples, n, r, c, width, height);
+    counts[r * width + c] = pixel;
+  });
+}
+
+// Writes nodes visited, primitives tested and stack depth of both queries as out_stem_<query>_<measure>.png,
+// and prints a histogram of each
+// returns false if a file can't be written
+bool write_traversal(const std::string &out_stem, const std::vector<TraversalCounts> &counts, size_t width,
+                     size_t height) {
+  struct Measure {
+    const char *name;
+    const char *unit;
+    uint64_t (*get)(const TraversalStats &);
+  };
+  const Measure measures[] = {{"nodes", "nodes visited", [](const TraversalStats &s) { return s.nodes; }},
+                              {"prims", "primitives tested", [](const TraversalStats &s) { return s.prims; }},
+                              {"depth", "stack entries", [](const TraversalStats &s) { return uint64_t(s.depth); }}};
+  std::vector<uint64_t> values(counts.size());
+  for (int query = 0; query < 2; ++query) {
+    for (const Measure &measure : measures) {
+      for (size_t i = 0; i < counts.size(); ++i) {
+        values[i] = measure.get(query == 0 ? counts[i].closest : counts[i].any);
+      }
+      // Grids walk without a stack
+      if (std::all_of(values.begin(), values.end(), [](uint64_t v) { return v == 0; })) {
+        continue;
+      }
+      std::string name = std::string(query == 0 ? "closest" : "any") + "_" + measure.name;
+      if (!write_measure(out_stem + "_" + name + ".png", values, width, height, measure.unit)) {
+        return false;
       }
+      print_histogram(name, values);
+    }
+  }
+  return true;
+}
 
-      // Shuffle samples[r][...].r
-      for (size_t r = 0; r < n; ++r) {
-        for (size_t i = n - 1; i >= 1; --i) {
-          int rand = rand_int(0, i);
-          std::swap(samples[r][i].r, samples[r][rand].r);
-        }
+// Renders a full frame through the specialised kernel counting every acceleration structure walk, the image the
+// same as render()'s
+template <typename Scene>
+void traversal_frame(std::vector<color> &image, const Scene &scene, const Camera &cam, size_t n, const Determinism &det,
+                     std::vector<TraversalCounts> &counts) {
+  srand(1);
+  if (cam.is_ortho) {
+    render_traversal<Orthographic>(image.data(), scene, cam, cam.width, cam.height, n, det, counts);
+  } else {
+    render_traversal<Perspective>(image.data(), scene, cam, cam.width, cam.height, n, det, counts);
+  }
+}
+
+// Renders a full frame with the given scene, then denoises it if requested
+// image - output, width * height of the camera
+// denoise_settings - nullptr to skip denoising
+// returns render()'s ray counts
+template <typename Scene>
+PathStats render_frame(std::vector<color> &image, RenderPath path, const Scene &scene, const Camera &cam, size_t n,
+                       const PathSettings &path_settings, const DenoiseSettings *denoise_settings,
+                       const Determinism &det = Determinism()) {
+  PathStats stats = render(image.data(), path, scene, cam, cam.width, cam.height, n, path_settings, det);
+
+  if (denoise_settings != nullptr) {
+    Pool<FeatureBuffer>::Lease features = pool<FeatureBuffer>().acquire();
+    features->resize(cam.width, cam.height);
+    if (cam.is_ortho) {
+      render_features<Orthographic>(scene, cam, n, *features, denoise_settings->threads);
+    } else {
+      render_features<Perspective>(scene, cam, n, *features, denoise_settings->threads);
+    }
+    denoise(image, *features, *denoise_settings);
+  }
+  return stats;
+}
+
+// Writes 8 bit RGB in format
+// threads - worker count for the parallel PNG encoder, 0 for default_threads()
+// returns false if the file can't be written
+bool write_image(ImageFormat format, const std::string &path, size_t width, size_t height,
+                 const std::vector<char> &pixels, unsigned threads = 0) {
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(pixels.data());
+  switch (format) {
+    case ImageFormat::Png: return write_png(path, width, height, 8, bytes, threads);
+    case ImageFormat::StbPng:
+      return stbi_write_png(path.c_str(), width, height, 3, pixels.data(), width * 3) != 0;
+    case ImageFormat::Qoi: return write_qoi(path, width, height, bytes);
+    case ImageFormat::Ppm: return write_ppm(path, width, height, bytes);
+  }
+  return false;
+}
+
+// Times render paths for both projections and checks they agree with the first one,
+// counting cache misses where the machine exposes the counters. The counters only see
+// the calling thread, so they count a separate single threaded render of each path.
+// paths - paths to compare, the first is the reference
+// iterations - renders per configuration
+template <typename Scene>
+void benchmark(const Scene &scene, const std::vector<RenderPath> &paths, size_t width, size_t height, size_t n,
+               int iterations) {
+  const size_t path_count = paths.size();
+  std::vector<std::vector<color>> images(path_count, std::vector<color>(width * height));
+  std::vector<char> reference(width * height * 3), png(width * height * 3);
+  CacheCounters counters;
+  if (!counters.available()) {
+    std::cout << "Cache counters unavailable, timing only" << std::endl;
+  }
+
+  for (bool is_ortho : {false, true}) {
+    Camera cam = make_camera(is_ortho, 0, width, height);
+    std::vector<double> ms(path_count);
+    std::vector<CacheCounters::Counts> counts(path_count);
+
+    // Alternate paths and keep the best time of each, so all see the same machine noise
+    for (int i = 0; i < iterations; ++i) {
+      for (size_t p = 0; p < path_count; ++p) {
+        auto start = std::chrono::steady_clock::now();
+        render(images[p].data(), paths[p], scene, cam, width, height, n);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        ms[p] = i == 0 ? elapsed.count() : std::min(ms[p], elapsed.count());
       }
+    }
+    if (counters.available()) {
+      Determinism one_thread;
+      one_thread.threads = 1;
+      std::vector<color> counted(width * height);
+      for (size_t p = 0; p < path_count; ++p) {
+        counters.start();
+        render(counted.data(), paths[p], scene, cam, width, height, n, PathSettings(), one_thread);
+        counts[p] = counters.stop();
+      }
+    }
+
+    std::cout << (is_ortho ? "orthographic" : "perspective") << ":" << std::endl;
+    encode_8bit(images[0], width, OutputSettings(), reference);
+    for (size_t p = 0; p < path_count; ++p) {
+      encode_8bit(images[p], width, OutputSettings(), png);
+      std::cout << "  " << path_name(paths[p]) << " " << ms[p] << " ms, speedup " << ms[0] / ms[p]
+                << "x, image " << (png == reference ? "matches" : "DIFFERS");
+      if (counters.available()) {
+        std::cout << ", on 1 thread cache misses " << counts[p].misses << " of " << counts[p].references << " references, L1D misses "
+                  << counts[p].l1d_misses;
+      }
+      std::cout << std::endl;
+    }
+  }
+
+  // Write the last reference image in every format, keeping the best time of each
+  std::cout << "writing " << width << "x" << height << ":" << std::endl;
+  for (ImageFormat format : {ImageFormat::StbPng, ImageFormat::Png, ImageFormat::Qoi, ImageFormat::Ppm}) {
+    std::string path = std::string("out/bench.") + format_extension(format);
+    double best = 0;
+    for (int i = 0; i < iterations; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      write_image(format, path, width, height, reference);
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+      best = i == 0 ? elapsed.count() : std::min(best, elapsed.count());
+    }
+    FILE *file = std::fopen(path.c_str(), "rb");
+    long size = 0;
+    if (file != nullptr) {
+      std::fseek(file, 0, SEEK_END);
+      size = std::ftell(file);
+      std::fclose(file);
+    }
+    std::remove(path.c_str());
+    std::cout << "  " << format_name(format) << " " << best << " ms, " << size / 1024 << " KB" << std::endl;
+  }
+}
+
+// Renders the product shot's orbit frame by frame into a raw video stream
+// target - "-" for stdout, otherwise a file or named pipe
+// frames - frame count, from frame 0 of the orbit
+// det - deterministic sampling settings, keyed on each frame's number
+// returns the exit code for main
+int stream_video(const std::string &target, VideoFormat format, int frames, int fps, RenderPath path, bool is_ortho,
+                 size_t width, size_t height, size_t n, const PathSettings &path_settings, const OutputSettings &output,
+                 Determinism det) {
+  FILE *file = target == "-" ? stdout : std::fopen(target.c_str(), "wb");
+  if (file == nullptr) {
+    std::cerr << "Can't open " << target << std::endl;
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  VideoStream stream(file, width, height, fps, format, output);
+  for (int frame = 0; frame < frames; ++frame) {
+    Camera cam = make_camera(is_ortho, frame, width, height);
+    det.frame = frame;
+    render_frame(stream.acquire(), path, product_shot, cam, n, path_settings, nullptr, det);
+    stream.submit();
+  }
+  bool ok = stream.finish();
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  if (file != stdout) {
+    ok = std::fclose(file) == 0 && ok;
+  }
+  if (!ok) {
+    std::cerr << "Can't write " << target << std::endl;
+    return 1;
+  }
+  // stdout may be the video, so report on stderr
+  std::cerr << "Streamed " << stream.frames() << " frames in " << elapsed.count() << " ms" << std::endl;
+  return 0;
+}
+
+// Size, samples and camera of the --regress checks after the reference images;
+// fewer samples keep the path traced renders short
+const size_t regress_width = 500, regress_height = 500, regress_samples = 2;
+
+inline Camera regress_camera() {
+  return make_camera(false, 0, regress_width, regress_height);
+}
+
+// Re-renders every reference image in out/ through each render path that should
+// reproduce it, checking the image by PSNR and the best time of iterations renders
+// against the baseline in out/regress_baseline.txt
+// tolerance - allowed slowdown over the baseline, in percent
+// update - record this run's times as the new baseline
+// returns false if any image differs or any render is slower
+bool check_references(int iterations, double tolerance, bool update) {
+  struct Reference {
+    const char *name;
+    bool is_ortho;
+    Orbit orbit;
+    size_t size, n;
+  };
+  // The viewpoint image looks down from higher up; n = 1 samples every pixel's centre, the image without anti aliasing
+  Orbit above;
+  above.angle = 0.5;
+  above.height = 4;
+  above.radius = 3;
+  const Reference references[] = {{"perspective", false, Orbit(), 500, 4},
+                                  {"orthographic", true, Orbit(), 500, 4},
+                                  {"perspective_viewpoint", false, above, 500, 4},
+                                  {"multi_jitter", false, Orbit(), 200, 4},
+                                  {"no_multi_jitter", false, Orbit(), 200, 1}};
+  // Infinity requires identical bytes
+  const double exact = std::numeric_limits<double>::infinity();
+  // The hybrid path samples a regular grid instead of multi jitter, so it only has to come close
+  const double hybrid_psnr = 45;
 
-      // Shuffle samples[...][c].c
-      for (size_t c = 0; c < n; ++c) {
-        for (size_t i = n - 1; i >= 1; --i) {
-          int rand = rand_int(0, i);
-          std::swap(samples[i][c].c, samples[rand][c].c);
+  const std::string baseline_path = "out/regress_baseline.txt";
+  TimingBaseline baseline(baseline_path);
+  std::vector<color> image;
+  std::vector<char> rendered;
+  bool ok = true;
+  for (const Reference &r : references) {
+    for (RenderPath path : {RenderPath::Generic, RenderPath::Specialised, RenderPath::Morton, RenderPath::Wavefront,
+                            RenderPath::Hybrid}) {
+      const double min_psnr = path == RenderPath::Hybrid ? hybrid_psnr : exact;
+      std::string name = std::string(r.name) + "/" + path_name(path);
+      size_t ref_width = 0, ref_height = 0;
+      std::vector<uint8_t> reference;
+      if (!read_png(std::string("out/") + r.name + ".png", ref_width, ref_height, reference) ||
+          ref_width != r.size || ref_height != r.size) {
+        std::cout << name << ": can't read a " << r.size << "x" << r.size << " out/" << r.name << ".png, FAIL"
+                  << std::endl;
+        ok = false;
+        continue;
+      }
+
+      Camera cam = make_camera(r.is_ortho, r.orbit, r.size, r.size);
+      image.resize(r.size * r.size);
+      double ms = 0;
+      for (int i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        render(image.data(), path, product_shot, cam, r.size, r.size, r.n);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        ms = i == 0 ? elapsed.count() : std::min(ms, elapsed.count());
+      }
+      encode_8bit(image, r.size, OutputSettings(), rendered);
+      double quality = psnr(reference.data(), reinterpret_cast<const uint8_t *>(rendered.data()), reference.size());
+      bool image_ok = quality >= min_psnr;
+
+      double base = baseline.get(name);
+      bool time_ok = update || base == 0 || ms <= base * (1 + tolerance / 100);
+      if (update || base == 0) {
+        baseline.set(name, ms);
+      }
+
+      std::cout << name << ": PSNR " << quality << " dB" << (min_psnr == exact ? " (exact)" : "") << ", " << ms
+                << " ms";
+      if (base > 0) {
+        std::cout << ", baseline " << base << " ms (" << (ms / base - 1) * 100 << "%)";
+      } else {
+        std::cout << ", recorded as baseline";
+      }
+      std::cout << (image_ok && time_ok ? " ok" : image_ok ? " SLOWER" : " IMAGE DIFFERS") << std::endl;
+      ok = ok && image_ok && time_ok;
+    }
+  }
+
+  if (!baseline.save()) {
+    std::cerr << "Can't write " << baseline_path << std::endl;
+  }
+  return ok;
+}
+
+// Checks deterministic mode gives identical bytes at every thread count and, given
+// the same jitter, on every primary-visibility path
+// same_jitter - output, the generic path's deterministic image the later checks compare against
+bool check_determinism(std::vector<char> &same_jitter) {
+  Determinism det;
+  det.enabled = true;
+  const Camera cam = regress_camera();
+  std::vector<color> image(regress_width * regress_height);
+  std::vector<char> rendered, single_thread;
+  bool all_ok = true;
+  for (RenderPath path : {RenderPath::Generic, RenderPath::Specialised, RenderPath::Morton, RenderPath::Wavefront,
+                          RenderPath::PathTraced, RenderPath::Hybrid}) {
+    // Hybrid samples a regular grid and path tracing adds bounces, the rest must match the generic path
+    bool jittered = path != RenderPath::PathTraced && path != RenderPath::Hybrid;
+    bool ok = true;
+    for (unsigned threads : {1u, 2u, 3u, 8u}) {
+      det.threads = threads;
+      render(image.data(), path, product_shot, cam, regress_width, regress_height, regress_samples, PathSettings(),
+             det);
+      encode_8bit(image, regress_width, OutputSettings(), rendered);
+      if (threads == 1) {
+        single_thread = rendered;
+        if (jittered && same_jitter.empty()) {
+          same_jitter = rendered;
         }
+        ok = !jittered || rendered == same_jitter;
+      } else {
+        ok = ok && rendered == single_thread;
       }
+    }
+    std::cout << "deterministic/" << path_name(path) << ": 1, 2, 3 and 8 threads "
+              << (ok ? "identical ok" : "DIFFER") << std::endl;
+    all_ok = all_ok && ok;
+  }
+  return all_ok;
+}
 
-      // Sum results of all samples
-      vec3 color_sum = {};
-
-      for (size_t r_s = 0; r_s < n; ++r_s) {
-        for (size_t c_s = 0; c_s < n; ++c_s) {
-          // Position within viewport plus jitter
-          double row_ratio = (static_cast<double>(r) + samples[r_s][c_s].r) / height;
-          double col_ratio = (static_cast<double>(c) + samples[r_s][c_s].c) / width;
-          // For perspective shoot from camera towards viewport
-          Ray ray = {camera_pos, viewport_top_left + viewport_down * row_ratio + viewport_right * col_ratio - camera_pos};
-          if (is_ortho) {
-            // For orthographic shoot forwards from viewport
-            ray = {viewport_top_left + viewport_down * row_ratio + viewport_right * col_ratio, camera_forward};
-          }
-          color_sum += shoot_ray(ray);
+// Checks n * n progressive passes are the deterministic render
+bool check_progressive(const std::vector<char> &same_jitter) {
+  Determinism det;
+  det.enabled = true;
+  const Camera cam = regress_camera();
+  ProgressiveImage progressive(regress_width, regress_height, regress_samples);
+  for (size_t i = 0; i < regress_samples * regress_samples; ++i) {
+    progressive.add_pass<Perspective>(product_shot, cam, det, 3);
+  }
+  std::vector<color> image(regress_width * regress_height);
+  std::vector<char> rendered;
+  progressive.resolve(image.data());
+  encode_8bit(image, regress_width, OutputSettings(), rendered);
+  bool ok = rendered == same_jitter;
+  std::cout << "deterministic/progressive: " << regress_samples * regress_samples << " passes "
+            << (ok ? "identical ok" : "DIFFER") << std::endl;
+  return ok;
+}
+
+// Checks variable rate shading: with the focus over the whole image every pixel takes the deterministic
+// render's samples; away from it, blocks across edges shade every pixel exactly as a full-rate
+// render does, the rest interpolate with bounded error, and uniformly flat settings leave only
+// the 4x4 block corners
+bool check_vrs(const std::vector<char> &same_jitter) {
+  const size_t width = regress_width, height = regress_height;
+  Determinism det;
+  det.enabled = true;
+  const Camera cam = regress_camera();
+  std::vector<color> image(width * height);
+  std::vector<char> rendered;
+  const size_t blocks = (width / vrs_block_size) * (height / vrs_block_size);
+  const size_t corners = (width / vrs_block_size + 1) * (height / vrs_block_size + 1);
+  VrsSettings focused;
+  focused.threads = 3;
+  focused.focus_x = width / 2.0;
+  focused.focus_y = height / 2.0;
+  focused.full_radius = width + height;
+  focused.focus_samples = regress_samples;
+  VrsStats stats = render_vrs<Perspective>(image.data(), product_shot, cam, width, height, focused, det);
+  encode_8bit(image, width, OutputSettings(), rendered);
+  bool focus_ok = rendered == same_jitter && stats.blocks[0] == blocks &&
+                  stats.rays == corners + width * height * regress_samples * regress_samples;
+
+  // Focus off screen, so block rates follow contrast alone
+  VrsSettings full = focused;
+  full.focus_x = full.focus_y = -1e9;
+  full.full_radius = 0;
+  full.full_contrast = full.half_contrast = -1;
+  std::vector<color> full_image(image.size());
+  stats = render_vrs<Perspective>(full_image.data(), product_shot, cam, width, height, full, det);
+  std::vector<char> full_rate;
+  encode_8bit(full_image, width, OutputSettings(), full_rate);
+  bool full_ok = stats.blocks[0] == blocks && stats.rays == corners + width * height;
+
+  VrsSettings periphery = full;
+  periphery.full_contrast = VrsSettings().full_contrast;
+  periphery.half_contrast = VrsSettings().half_contrast;
+  const VrsStats periphery_stats = render_vrs<Perspective>(image.data(), product_shot, cam, width, height, periphery,
+                                                           det);
+  encode_8bit(image, width, OutputSettings(), rendered);
+  // Blocks whose corners differ by more than full_contrast must match the full-rate render exactly
+  bool exact = true;
+  size_t full_blocks = 0;
+  for (size_t by = 0; by < height / vrs_block_size; ++by) {
+    for (size_t bx = 0; bx < width / vrs_block_size; ++bx) {
+      double lo = 1e9, hi = -1e9;
+      for (size_t k = 0; k < 4; ++k) {
+        size_t x = std::min((bx + k % 2) * vrs_block_size, width - 1);
+        size_t y = std::min((by + k / 2) * vrs_block_size, height - 1);
+        lo = std::min(lo, luminance(full_image[y * width + x]));
+        hi = std::max(hi, luminance(full_image[y * width + x]));
+      }
+      if (hi - lo <= periphery.full_contrast) {
+        continue;
+      }
+      ++full_blocks;
+      for (size_t y = by * vrs_block_size; y < (by + 1) * vrs_block_size; ++y) {
+        for (size_t x = bx * vrs_block_size; x < (bx + 1) * vrs_block_size; ++x) {
+          exact = exact && std::memcmp(&rendered[(y * width + x) * 3], &full_rate[(y * width + x) * 3], 3) == 0;
         }
       }
+    }
+  }
+  const double vrs_min_psnr = 45;
+  const double quality = psnr(reinterpret_cast<const uint8_t *>(full_rate.data()),
+                              reinterpret_cast<const uint8_t *>(rendered.data()), rendered.size());
+  bool periphery_ok = exact && full_blocks == periphery_stats.blocks[0] && periphery_stats.blocks[2] > 0 &&
+                      periphery_stats.blocks[0] + periphery_stats.blocks[1] + periphery_stats.blocks[2] == blocks &&
+                      periphery_stats.rays < corners + width * height && quality >= vrs_min_psnr;
+
+  VrsSettings flat = full;
+  flat.full_contrast = flat.half_contrast = std::numeric_limits<double>::infinity();
+  stats = render_vrs<Perspective>(image.data(), product_shot, cam, width, height, flat, det);
+  bool flat_ok = stats.blocks[2] == blocks && stats.rays == corners;
+
+  bool ok = focus_ok && full_ok && periphery_ok && flat_ok;
+  std::cout << "vrs: focus everywhere " << (focus_ok ? "is the deterministic render" : "DIFFERS")
+            << ", periphery " << periphery_stats.blocks[0] << " full-rate blocks " << (exact ? "exact" : "NOT EXACT")
+            << " at PSNR " << quality << " dB, flat " << (flat_ok ? "corners only" : "WRONG RATES")
+            << (ok ? " ok" : " FAIL") << std::endl;
+  return ok;
+}
+
+// Checks tile tasks in any order on any number of workers are the deterministic render
+bool check_scheduled_tiles(const std::vector<char> &same_jitter) {
+  Determinism det;
+  det.enabled = true;
+  const Camera cam = regress_camera();
+  std::vector<color> image(regress_width * regress_height);
+  std::vector<char> rendered;
+  bool ok = true;
+  for (unsigned threads : {1u, 3u}) {
+    TaskScheduler scheduler(threads);
+    TileFrame<ProductShot> final_frame(image.data(), product_shot, cam, regress_samples, det);
+    TaskGroup group;
+    scheduler.submit(group, TaskPriority::Final, final_frame.tiles(), final_frame);
+    group.wait();
+    encode_8bit(image, regress_width, OutputSettings(), rendered);
+    ok = ok && rendered == same_jitter && group.completed() == final_frame.tiles();
+  }
+  std::cout << "deterministic/scheduler: tile tasks on 1 and 3 threads " << (ok ? "identical ok" : "DIFFER")
+            << std::endl;
+  return ok;
+}
+
+// Checks that with the only worker held on a gate task, preview tasks queued after final ones
+// still run first, and the tasks of a group cancelled while queued are dropped instead of run
+bool check_scheduler_order() {
+  const size_t tasks = 8;
+  TaskScheduler scheduler(1);
+  std::atomic<bool> started(false), open(false);
+  // Only the one worker appends, and each group's wait() orders it before the reads below
+  std::vector<TaskPriority> order;
+  order.reserve(3 * tasks);
+  auto gate = [&](size_t) {
+    started = true;
+    while (!open) {
+      std::this_thread::yield();
+    }
+  };
+  auto final_task = [&](size_t) { order.push_back(TaskPriority::Final); };
+  auto preview_task = [&](size_t) { order.push_back(TaskPriority::Preview); };
+  TaskGroup held, finals, previews, stale;
+  scheduler.submit(held, TaskPriority::Final, 1, gate);
+  while (!started) {
+    std::this_thread::yield();
+  }
+  scheduler.submit(finals, TaskPriority::Final, tasks, final_task);
+  scheduler.submit(previews, TaskPriority::Preview, tasks, preview_task);
+  scheduler.submit(stale, TaskPriority::Preview, tasks, preview_task);
+  stale.cancel();
+  open = true;
+  for (TaskGroup *group : {&held, &finals, &previews, &stale}) {
+    group->wait();
+  }
+  const auto first_runs = order.begin() + std::min(tasks, order.size());
+  const size_t previews_first = static_cast<size_t>(std::count(order.begin(), first_runs, TaskPriority::Preview));
+  const bool ok = order.size() == 2 * tasks && previews_first == tasks && finals.completed() == tasks &&
+                  previews.completed() == tasks && stale.completed() == 0 && stale.dropped() == tasks;
+  std::cout << "scheduler: previews overtake queued finals, cancelled tasks dropped " << (ok ? "ok" : "WRONG ORDER")
+            << std::endl;
+  return ok;
+}
+
+// Checks dynamic resolution settles on the budget without oscillating: synthetic frames cost a full resolution,
+// one sample frame's time times the pixel and sample fraction, and the scene's cost steps half way through
+bool check_dynamic_resolution() {
+  const double budget_ms = 16;
+  const size_t max_samples = 4;
+  const int frames = 120, step_frame = 60, settled_frames = 30;
+  const std::pair<double, double> costs[] = {{2, 2}, {40, 40}, {1000, 1000}, {2, 40}, {40, 2}, {1000, 40}};
+  bool all_ok = true;
+  for (const auto &cost : costs) {
+    ResolutionController controller(640, 480, budget_ms, max_samples);
+    double frame_ms = 0, last_scale = controller.scale();
+    size_t last_samples = controller.samples();
+    int reversals = 0, late_changes = 0, direction = 0;
+    for (int frame = 0; frame < frames; ++frame) {
+      const double full_ms = frame < step_frame ? cost.first : cost.second;
+      const double pixels = controller.scale() * controller.scale();
+      const double samples = static_cast<double>(controller.samples() * controller.samples());
+      frame_ms = full_ms * pixels * samples;
+      controller.update(frame_ms);
+      // The scale keeps one direction between cost steps, and nothing moves once settled
+      int moved = controller.scale() > last_scale ? 1 : controller.scale() < last_scale ? -1 : 0;
+      if (frame == step_frame) {
+        direction = 0;
+      }
+      if (moved != 0) {
+        reversals += direction != 0 && moved != direction;
+        direction = moved;
+      }
+      late_changes += frame >= frames - settled_frames &&
+                      (controller.scale() != last_scale || controller.samples() != last_samples);
+      last_scale = controller.scale();
+      last_samples = controller.samples();
+    }
+    // Settled within the deadband, or held at a limit: full resolution with no further sample that fits, or the
+    // smallest scale and still over budget
+    const size_t n = controller.samples();
+    const bool on_budget = std::fabs(frame_ms / budget_ms - 1) < resolution_deadband + 0.01;
+    const bool at_full = controller.scale() >= 1 && frame_ms < budget_ms &&
+                         (n == max_samples || cost.second * (n + 1) * (n + 1) > budget_ms * (1 + resolution_deadband));
+    const bool at_min = controller.scale() <= resolution_min_scale && frame_ms > budget_ms;
+    const bool ok = (on_budget || at_full || at_min) && reversals == 0 && late_changes == 0;
+    std::cout << "dynamic resolution: " << cost.first << " then " << cost.second << " ms at full size, scale "
+              << controller.scale() << " x" << n << " samples, " << frame_ms << " ms";
+    std::cout << (ok ? " ok" : reversals || late_changes ? " OSCILLATES" : " OFF BUDGET") << std::endl;
+    all_ok = all_ok && ok;
+  }
+  return all_ok;
+}
+
+// Checks a streamed video holds nothing but frames, even when it's stdout and the frames are path traced
+bool check_stdout_stream() {
+  const char *stream_path = "out/regress_stream.y4m";
+  const size_t stream_width = 64, stream_height = 48;
+  Determinism det;
+  det.enabled = true;
+  std::fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int stream_fd = open(stream_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = saved_stdout >= 0 && stream_fd >= 0 && dup2(stream_fd, STDOUT_FILENO) >= 0;
+  if (ok) {
+    ok = stream_video("-", VideoFormat::Y4m, 2, 30, RenderPath::PathTraced, false, stream_width, stream_height, 1,
+                      PathSettings(), OutputSettings(), det) == 0;
+    std::fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+  }
+  for (int fd : {saved_stdout, stream_fd}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  const int streamed = count_y4m_frames(stream_path, stream_width, stream_height);
+  std::remove(stream_path);
+  ok = ok && streamed == 2;
+  std::cout << "video/path traced: 2 frames on stdout, " << streamed << " parsed" << (ok ? " ok" : " CORRUPT")
+            << std::endl;
+  return ok;
+}
 
-      // Assign final color
-      img_assign(png[r][c], color_sum / (n * n));
+// Checks the PNG and QOI writers round-trip through their decoders: a row that revisits colours after black,
+// which a QOI encoder must not index before storing, and a render with --exposure 2, whose first pixel isn't black
+bool check_image_files() {
+  const size_t row_width = 6;
+  const uint8_t row_bytes[row_width * 3] = {255, 255, 255, 0, 0, 0, 200, 10, 10, 255, 255, 255, 0, 0, 0, 200, 10, 10};
+  const std::vector<char> row(row_bytes, row_bytes + sizeof(row_bytes));
+  std::vector<color> image(regress_width * regress_height);
+  render(image.data(), RenderPath::Specialised, product_shot, regress_camera(), regress_width, regress_height,
+         regress_samples);
+  OutputSettings bright;
+  bright.exposure = 2;
+  std::vector<char> rendered;
+  encode_8bit(image, regress_width, bright, rendered);
+
+  const std::vector<char> *images[] = {&row, &rendered};
+  bool ok = true;
+  for (ImageFormat format : {ImageFormat::Png, ImageFormat::Qoi}) {
+    const std::string path = std::string("out/regress_image.") + format_extension(format);
+    bool format_ok = true;
+    for (const std::vector<char> *rgb : images) {
+      const size_t width = rgb == &row ? row_width : regress_width, height = rgb->size() / 3 / width;
+      size_t read_width = 0, read_height = 0;
+      std::vector<uint8_t> read;
+      bool decoded = write_image(format, path, width, height, *rgb, 1) &&
+                     (format == ImageFormat::Png ? read_png(path, read_width, read_height, read)
+                                                 : read_qoi(path, read_width, read_height, read));
+      format_ok = format_ok && decoded && read_width == width && read_height == height &&
+                  read == std::vector<uint8_t>(rgb->begin(), rgb->end());
+    }
+    std::remove(path.c_str());
+    std::cout << "image files/" << format_name(format) << ": written and decoded "
+              << (format_ok ? "identical ok" : "DIFFER") << std::endl;
+    ok = ok && format_ok;
+  }
+  return ok;
+}
+
+// Checks warm renders allocate nothing: scratch comes from the thread arenas, frames and ray batches from pools
+bool check_allocations() {
+  const size_t width = regress_width, height = regress_height;
+  auto count_allocations = [](const std::string &name, const std::function<void()> &frame) {
+    frame();
+    uint64_t before = heap_allocations();
+    for (int i = 0; i < 3; ++i) {
+      frame();
+    }
+    uint64_t allocations = heap_allocations() - before;
+    std::cout << "allocations/" << name << ": " << allocations << " in 3 warm frames"
+              << (allocations == 0 ? " ok" : " ALLOCATES") << std::endl;
+    return allocations == 0;
+  };
+  Determinism det;
+  det.threads = 3;
+  const Camera cam = regress_camera();
+  std::vector<color> image(width * height);
+  bool ok = true;
+  for (RenderPath path : {RenderPath::Generic, RenderPath::Specialised, RenderPath::Morton, RenderPath::Wavefront,
+                          RenderPath::PathTraced, RenderPath::Hybrid}) {
+    for (bool deterministic : {false, true}) {
+      det.enabled = deterministic;
+      ok = count_allocations(std::string(path_name(path)) + (deterministic ? " deterministic" : ""), [&] {
+        render(image.data(), path, product_shot, cam, width, height, regress_samples, PathSettings(), det);
+      }) && ok;
     }
   }
-  
-  // Write image
-  stbi_write_png("out/test.png", width, height, channels, png, width * channels);
+  VrsSettings vrs_settings;
+  vrs_settings.threads = 3;
+  ok = count_allocations("vrs", [&] {
+    render_vrs<Perspective>(image.data(), product_shot, cam, width, height, vrs_settings, det);
+  }) && ok;
+  ProgressiveImage progressive(width, height, regress_samples);
+  ok = count_allocations("progressive", [&] {
+    progressive.add_pass<Perspective>(product_shot, cam, det, 3);
+  }) && ok;
+  // The rest of a frame: denoising, the output stage and writing files
+  DenoiseSettings denoise_settings;
+  denoise_settings.threads = 3;
+  std::vector<color> frame_image(width * height);
+  ok = count_allocations("denoise", [&] {
+    render_frame(frame_image, RenderPath::Specialised, product_shot, cam, regress_samples, PathSettings(),
+                 &denoise_settings, det);
+  }) && ok;
+  std::vector<char> rendered;
+  ok = count_allocations("encode", [&] {
+    encode_8bit(frame_image, width, OutputSettings(), rendered);
+  }) && ok;
+  for (ImageFormat format : {ImageFormat::Png, ImageFormat::Qoi, ImageFormat::Ppm}) {
+    const std::string frame_path = std::string("out/regress_frame.") + format_extension(format);
+    // One thread per PNG as write_sequence does, so the scratch is the writing thread's arena
+    ImageWriter writer(width, height, OutputSettings(), [&](const std::string &file, const std::vector<char> &rgb) {
+      return write_image(format, file, width, height, rgb, 1);
+    }, 0);
+    ok = count_allocations(std::string("writer ") + format_name(format), [&] {
+      writer.acquire() = frame_image;
+      writer.submit(frame_path);
+    }) && ok;
+    std::remove(frame_path.c_str());
+  }
+  return ok;
+}
+
+// Runs every --regress check: the reference images and their timings, then deterministic
+// rendering, variable rate shading, scheduling, dynamic resolution, video streaming and
+// allocation counts
+// tolerance - allowed slowdown over the baseline, in percent
+// update - record this run's times as the new baseline
+// returns the exit code for main, 1 if any check fails
+int run_regress(int iterations, double tolerance, bool update) {
+  int failures = !check_references(iterations, tolerance, update);
+  std::vector<char> same_jitter;
+  failures += !check_determinism(same_jitter);
+  failures += !check_progressive(same_jitter);
+  failures += !check_vrs(same_jitter);
+  failures += !check_scheduled_tiles(same_jitter);
+  failures += !check_scheduler_order();
+  failures += !check_dynamic_resolution();
+  failures += !check_stdout_stream();
+  failures += !check_image_files();
+  failures += !check_allocations();
+
+  if (failures > 0) {
+    std::cout << "Regression suite FAILED: " << failures << " checks" << std::endl;
+    return 1;
+  }
+  std::cout << "Regression suite passed" << std::endl;
   return 0;
 }
 
-// Uncomment and rename other main() to main2 to run with SDL
-/*
+#ifdef SDL_VIEWER
 // https://gist.github.com/CoryBloyd/6725bb78323bb1157ff8d4175d42d789
-#include <stdio.h>
 #include <SDL2/SDL.h>
 inline uint32_t argb(uint8_t a, uint8_t r, uint8_t g, uint8_t b) { return (a<<24) | (r << 16) | (g << 8) | (b << 0); }
 
-int main(int argc, char *argv[]) {
-    SDL_Init(SDL_INIT_VIDEO);
-
-    SDL_Rect    screenRect = { 0,0,500, 500 };
-    SDL_Window   *window   = SDL_CreateWindow("SDL", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screenRect.w, screenRect.h, SDL_WINDOW_SHOWN);
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    SDL_Texture  *texture  = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, screenRect.w, screenRect.h);
-    
-    for (int frame = 0; ; ++frame) {
-        SDL_Event event;
-        while (SDL_PollEvent(&event) != 0)
-            if (event.type == SDL_QUIT)
-                return 0;
-    
-        int pitch;
-        int *pixels;
-        SDL_LockTexture(texture, &screenRect, (void**)&pixels, &pitch);
-        uint32_t startTicks = SDL_GetTicks();
-        const size_t width = 500;
-        const size_t height = 500;
-        const size_t channels = 3;
-
-        bool is_ortho = false;
-
-        vec3 camera_pos = {4 * std::sin(frame / 20.0), 1, 4 * std::cos(frame / 20.0)};
-        vec3 camera_forward = unit_vector(vec3(0, 0.5, -2) - camera_pos);
-
-        if (is_ortho) {
-          camera_pos = {4 * std::sin(frame / 20.0), 2, 4 * std::cos(frame / 20.0)};
-          camera_forward = unit_vector(vec3(0, 1, -2) - camera_pos);
-        }
-
-        vec3 camera_right = cross(camera_forward, {0, 1, 0});
-        vec3 camera_up = cross(camera_right, camera_forward);
+// Orbits the product shot in a window, one sample per pixel, showing each frame's render time in ms as the title
+// path - render path for every frame, RenderPath::Hybrid only traces shadow rays
+// vrs - shade at variable rate around the mouse instead (vrs.h), adding rays per pixel to the title
+// budget_ms - frame time to hold by scaling the internal resolution and samples, 0 for a fixed size
+// interactive - drag, wheel and arrow keys move the camera instead of the orbit playing, and while it's
+// still each frame adds a sample per pixel to a running average (progressive.h)
+int run_viewer(RenderPath path, bool is_ortho, size_t width, size_t height, bool vrs, double budget_ms,
+               bool interactive) {
+  SDL_Init(SDL_INIT_VIDEO);
 
-        double aspect_ratio = static_cast<double>(width) / height;
-        double focal = 1.0;
+  SDL_Rect screen_rect = {0, 0, static_cast<int>(width), static_cast<int>(height)};
+  SDL_Window *window = SDL_CreateWindow("SDL", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, screen_rect.w,
+                                        screen_rect.h, SDL_WINDOW_SHOWN);
+  SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+  SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+                                           screen_rect.w, screen_rect.h);
+  std::vector<color> image(width * height);
+  std::vector<char> png(width * height * 3);
+  VrsSettings vrs_settings;
+  vrs_settings.focus_x = width / 2.0;
+  vrs_settings.focus_y = height / 2.0;
+  Determinism det;
+  VrsStats vrs_stats;
+  ResolutionController resolution(width, height, budget_ms > 0 ? budget_ms : 1);
+  std::vector<color> internal(width * height);
+  Orbit orbit;
+  ProgressiveImage progressive(width, height);
+  bool dragging = false;
 
-        double viewport_height = 1;
-        if (is_ortho) {
-          viewport_height *= 3;
+  for (int frame = 0; ; ++frame) {
+    const Orbit last = orbit;
+    SDL_Event event;
+    while (SDL_PollEvent(&event) != 0) {
+      if (event.type == SDL_QUIT) {
+        SDL_Quit();
+        return 0;
+      }
+      if (event.type == SDL_MOUSEMOTION) {
+        vrs_settings.focus_x = event.motion.x;
+        vrs_settings.focus_y = event.motion.y;
+        if (dragging) {
+          orbit.angle -= event.motion.xrel * 0.01;
+          orbit.height += event.motion.yrel * 0.01;
         }
-        double viewport_width = viewport_height * aspect_ratio;
-        vec3 viewport_right = viewport_width * camera_right;
-        vec3 viewport_down = -viewport_height * camera_up;
-        
-        vec3 viewport_top_left = camera_pos - viewport_right / 2 - viewport_down / 2 + focal * camera_forward;
-
-        for (size_t r = 0; r < height; ++r) {
-          for (size_t c = 0; c < width; ++c) {
-            double row_ratio = (static_cast<double>(r) + 0.5) / height;
-            double col_ratio = (static_cast<double>(c) + 0.5) / width;
-            Ray ray = {camera_pos, viewport_top_left + viewport_down * row_ratio + viewport_right * col_ratio - camera_pos};
-            if (is_ortho) {
-              ray = {viewport_top_left + viewport_down * row_ratio + viewport_right * col_ratio, camera_forward};
-            }
-            char p[4];
-            img_assign(p, shoot_ray(ray));
-            p[3] = 255;
-            pixels[r*screenRect.w + c] = argb(p[3], p[0], p[1], p[2]);
-          }
+      } else if ((event.type == SDL_MOUSEBUTTONDOWN || event.type == SDL_MOUSEBUTTONUP) &&
+                 event.button.button == SDL_BUTTON_LEFT) {
+        dragging = event.type == SDL_MOUSEBUTTONDOWN;
+      } else if (event.type == SDL_MOUSEWHEEL) {
+        orbit.radius *= std::pow(0.9, event.wheel.y);
+      } else if (event.type == SDL_KEYDOWN) {
+        switch (event.key.keysym.sym) {
+          case SDLK_LEFT: orbit.angle -= 0.05; break;
+          case SDLK_RIGHT: orbit.angle += 0.05; break;
+          case SDLK_UP: orbit.height += 0.05; break;
+          case SDLK_DOWN: orbit.height -= 0.05; break;
+          case SDLK_w: orbit.radius *= 0.95; break;
+          case SDLK_s: orbit.radius /= 0.95; break;
         }
-        uint32_t endTicks = SDL_GetTicks();
-        SDL_UnlockTexture(texture);
+      }
+    }
+    orbit.radius = std::min(std::max(orbit.radius, 0.5), 10.0);
+    if (!interactive) {
+      orbit = Orbit();
+      orbit.angle = frame / 20.0;
+    }
+    const bool still = interactive && orbit.angle == last.angle && orbit.height == last.height &&
+                       orbit.radius == last.radius && frame > 0;
+
+    uint32_t start_ticks = SDL_GetTicks();
+    // Internal size and samples, or the window size with one sample
+    const size_t w = budget_ms > 0 ? resolution.width() : width, h = budget_ms > 0 ? resolution.height() : height;
+    const size_t n = budget_ms > 0 ? resolution.samples() : 1;
+    color *target = w == width && h == height ? image.data() : internal.data();
+    Camera cam = make_camera(is_ortho, orbit, w, h);
+    if (still) {
+      // Refine at full size, whatever the preview renders at: progressive passes always go through
+      // the kernel's shade() with multi jitter, so --budget and the render path only shape the preview
+      cam = make_camera(is_ortho, orbit, width, height);
+      if (is_ortho) {
+        progressive.add_pass<Orthographic>(product_shot, cam, det);
+      } else {
+        progressive.add_pass<Perspective>(product_shot, cam, det);
+      }
+      progressive.resolve(image.data());
+      target = image.data();
+    } else if (vrs) {
+      det.frame = frame;
+      VrsSettings scaled = vrs_settings;
+      scaled.focus_x *= static_cast<double>(w) / width;
+      scaled.focus_y *= static_cast<double>(h) / height;
+      scaled.focus_samples = std::max(scaled.focus_samples, n);
+      if (is_ortho) {
+        vrs_stats = render_vrs<Orthographic>(target, product_shot, cam, w, h, scaled, det);
+      } else {
+        vrs_stats = render_vrs<Perspective>(target, product_shot, cam, w, h, scaled, det);
+      }
+    } else {
+      render(target, path, product_shot, cam, w, h, n);
+    }
+    if (!still) {
+      progressive.reset();
+    }
+    if (target != image.data()) {
+      upscale_bilinear(target, w, h, image.data(), width, height);
+    }
+    encode_8bit(image, width, OutputSettings(), png);
+    uint32_t end_ticks = SDL_GetTicks();
+    if (budget_ms > 0 && !still) {
+      resolution.update(end_ticks - start_ticks);
+    }
+
+    int pitch;
+    uint32_t *pixels;
+    SDL_LockTexture(texture, &screen_rect, reinterpret_cast<void **>(&pixels), &pitch);
+    for (size_t r = 0; r < height; ++r) {
+      for (size_t c = 0; c < width; ++c) {
+        const char *p = &png[(r * width + c) * 3];
+        pixels[r * (pitch / 4) + c] = argb(255, p[0], p[1], p[2]);
+      }
+    }
+    SDL_UnlockTexture(texture);
+
+    SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, &screen_rect, &screen_rect);
+    SDL_RenderPresent(renderer);
+
+    // Formatted in place, so the frame loop allocates nothing
+    char title[128];
+    int length = std::snprintf(title, sizeof(title), "%lu", static_cast<unsigned long>(end_ticks - start_ticks));
+    if (still) {
+      length += std::snprintf(title + length, sizeof(title) - length, " ms, %zu spp", progressive.passes());
+    } else if (budget_ms > 0) {
+      length += std::snprintf(title + length, sizeof(title) - length, " ms, %zux%zu at %zu spp", w, h, n * n);
+    }
+    if (vrs && !still) {
+      std::snprintf(title + length, sizeof(title) - length, "%s%.2f rays per pixel", budget_ms > 0 ? ", " : " ms, ",
+                    static_cast<double>(vrs_stats.rays) / (w * h));
+    }
+    SDL_SetWindowTitle(window, title);
+  }
+}
+#endif
+
+// Renders frame 0 of the product shot as final quality tile tasks while previews of the following orbit
+// frames arrive every preview_ms at preview priority, as a viewer being dragged would send them. A preview
+// not done by the time the next one arrives is stale, so it's cancelled.
+// image - output, the final frame, the same as a --deterministic render
+// previews - preview frames to send
+// det - sampling seed, det.threads sets the scheduler's workers
+void run_schedule(std::vector<color> &image, bool is_ortho, size_t width, size_t height, size_t n,
+                  const Determinism &det, int previews) {
+  const double preview_ms = 40;
+  TaskScheduler scheduler(det.threads);
+  auto start = std::chrono::steady_clock::now();
+  auto since = [](std::chrono::steady_clock::time_point t) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+  };
+
+  Camera cam = make_camera(is_ortho, 0, width, height);
+  TileFrame<ProductShot> final_frame(image.data(), product_shot, cam, n, det);
+  TaskGroup final_group;
+  scheduler.submit(final_group, TaskPriority::Final, final_frame.tiles(), final_frame);
+
+  std::vector<color> preview(width * height);
+  int done = 0, cancelled = 0;
+  double latency = 0, worst = 0;
+  for (int i = 1; i <= previews; ++i) {
+    Determinism preview_det = det;
+    preview_det.frame = i;
+    TileFrame<ProductShot> preview_frame(preview.data(), product_shot, make_camera(is_ortho, i, width, height), 1,
+                                         preview_det);
+    TaskGroup group;
+    auto sent = std::chrono::steady_clock::now();
+    scheduler.submit(group, TaskPriority::Preview, preview_frame.tiles(), preview_frame);
+    if (group.wait_for(preview_ms)) {
+      ++done;
+      latency += since(sent);
+      worst = std::max(worst, since(sent));
+      std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(preview_ms - since(sent)));
+    } else {
+      group.cancel();
+      group.wait();
+      ++cancelled;
+    }
+  }
+  const double previews_ms = since(start);
+  final_group.wait();
+
+  std::cout << "Final frame: " << since(start) << " ms on " << scheduler.threads() << " threads, alongside " << previews
+            << " previews over " << previews_ms << " ms" << std::endl;
+  std::cout << "Previews: " << done << " done, mean latency " << (done > 0 ? latency / done : 0) << " ms, worst "
+            << worst << " ms; " << cancelled << " stale ones cancelled" << std::endl;
+}
+
+// Renders the product shot's orbit frame by frame into numbered images
+// directory - existing directory for frame_0000.<ext> and on
+// frames - frame count, from frame 0 of the orbit
+// writers - background writer threads, 0 writes each frame before rendering the next
+// det - deterministic sampling settings, keyed on each frame's number
+// returns the exit code for main
+int write_sequence(const std::string &directory, ImageFormat format, int frames, unsigned writers, RenderPath path,
+                   bool is_ortho, size_t width, size_t height, size_t n, const PathSettings &path_settings,
+                   const OutputSettings &output, Determinism det) {
+  auto start = std::chrono::steady_clock::now();
+  // The writers share the cores with rendering, so each encodes its PNG on one thread
+  ImageWriter writer(width, height, output, [&](const std::string &file, const std::vector<char> &rgb) {
+    return write_image(format, file, width, height, rgb, 1);
+  }, writers);
+  std::string file;
+  for (int frame = 0; frame < frames; ++frame) {
+    Camera cam = make_camera(is_ortho, frame, width, height);
+    det.frame = frame;
+    render_frame(writer.acquire(), path, product_shot, cam, n, path_settings, nullptr, det);
+    // Reuses the path's storage from frame to frame
+    char name[32];
+    std::snprintf(name, sizeof(name), "/frame_%04d.", frame);
+    file.assign(directory).append(name).append(format_extension(format));
+    writer.submit(file);
+  }
+  bool ok = writer.finish();
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  for (const std::string &failed : writer.failed()) {
+    std::cerr << "Can't write " << failed << std::endl;
+  }
+  std::cout << "Wrote " << writer.frames() << " frames in " << elapsed.count() << " ms" << std::endl;
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  // Output params
+  const size_t width = 500;
+  const size_t height = 500;
+  const size_t channels = 3;
+  std::vector<color> image(width * height);
+  std::vector<char> png(width * height * channels);
+
+  // Switch these with --ortho / --specialised / --wavefront if needed
+  bool is_ortho = false;
+  RenderPath path = RenderPath::Generic;
+  PathSettings path_settings;
+  bool denoise_image = false;
+  DenoiseSettings denoise_settings;
+  std::string texture_path;
+  std::string scene_kind;
+  size_t scene_size = 0;
+  AccelType accel = AccelType::Auto;
+  size_t light_count = 0;
+  int light_samples = 1;
+  int bench_iterations = 0;
+  int regress_iterations = 0;
+  double regress_tolerance = 25;
+  bool regress_update = false;
+  Determinism det;
+  bool viewer = false;
+  bool vrs = false;
+  double budget_ms = 0;
+  bool interactive = false;
+  OutputSettings output;
+  ImageFormat format = ImageFormat::Png;
+  std::string video_path;
+  VideoFormat video_format = VideoFormat::Y4m;
+  // One orbit of make_camera is 2 pi * 20 frames
+  int video_frames = 126;
+  int video_fps = 30;
+  std::string sequence_dir;
+  unsigned writers = 2;
+  bool heatmap = false;
+  CostMaps costs;
+  bool traversal = false;
+  int schedule_previews = 0;
+  std::vector<TraversalCounts> traversal_pixels;
+  std::string png16_path;
+  std::string pfm_path;
+
+  // Number of multi jitter samples = n^2
+  size_t n = 4;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--ortho") {
+      is_ortho = true;
+    } else if (arg == "--specialised") {
+      path = RenderPath::Specialised;
+    } else if (arg == "--morton") {
+      path = RenderPath::Morton;
+    } else if (arg == "--wavefront") {
+      path = RenderPath::Wavefront;
+    } else if (arg == "--hybrid") {
+      path = RenderPath::Hybrid;
+    } else if (arg == "--path-trace") {
+      path = RenderPath::PathTraced;
+    } else if (arg == "--max-depth" && i + 1 < argc) {
+      path_settings.max_depth = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--samples" && i + 1 < argc) {
+      n = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--denoise") {
+      denoise_image = true;
+    } else if (arg == "--texture" && i + 1 < argc) {
+      texture_path = argv[++i];
+    } else if (arg == "--texture-cache-mb" && i + 1 < argc) {
+      long mb = std::atol(argv[++i]);
+      if (mb <= 0) {
+        std::cerr << "Texture cache size must be a positive number of MB" << std::endl;
+        return 1;
+      }
+      texture_system().set_cache_bytes(static_cast<size_t>(mb) << 20);
+    } else if (arg == "--scene" && i + 2 < argc) {
+      scene_kind = argv[++i];
+      scene_size = std::max(1L, std::atol(argv[++i]));
+      if (scene_kind != "particles" && scene_kind != "mesh") {
+        std::cerr << "Unknown scene " << scene_kind << std::endl;
+        return 1;
+      }
+    } else if (arg == "--accel" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "auto") {
+        accel = AccelType::Auto;
+      } else if (name == "grid") {
+        accel = AccelType::Grid;
+      } else if (name == "bvh") {
+        accel = AccelType::Bvh;
+      } else if (name == "calibrate") {
+        accel = AccelType::Calibrate;
+      } else {
+        std::cerr << "Unknown acceleration structure " << name << std::endl;
+        return 1;
+      }
+    } else if (arg == "--lights" && i + 1 < argc) {
+      light_count = std::max(1L, std::atol(argv[++i]));
+    } else if (arg == "--light-samples" && i + 1 < argc) {
+      light_samples = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--exposure" && i + 1 < argc) {
+      output.exposure = std::atof(argv[++i]);
+    } else if (arg == "--tonemap" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "clamp") {
+        output.tone_map = ToneMap::Clamp;
+      } else if (name == "reinhard") {
+        output.tone_map = ToneMap::Reinhard;
+      } else if (name == "aces") {
+        output.tone_map = ToneMap::Aces;
+      } else {
+        std::cerr << "Unknown tone map " << name << std::endl;
+        return 1;
+      }
+    } else if (arg == "--srgb") {
+      output.srgb = true;
+    } else if (arg == "--dither") {
+      output.dither = true;
+    } else if (arg == "--format" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "png") {
+        format = ImageFormat::Png;
+      } else if (name == "stb") {
+        format = ImageFormat::StbPng;
+      } else if (name == "qoi") {
+        format = ImageFormat::Qoi;
+      } else if (name == "ppm") {
+        format = ImageFormat::Ppm;
+      } else {
+        std::cerr << "Unknown format " << name << std::endl;
+        return 1;
+      }
+    } else if (arg == "--video" && i + 1 < argc) {
+      video_path = argv[++i];
+    } else if (arg == "--video-format" && i + 1 < argc) {
+      std::string name = argv[++i];
+      if (name == "y4m") {
+        video_format = VideoFormat::Y4m;
+      } else if (name == "rgb") {
+        video_format = VideoFormat::Rgb;
+      } else {
+        std::cerr << "Unknown video format " << name << std::endl;
+        return 1;
+      }
+    } else if (arg == "--frames" && i + 1 < argc) {
+      video_frames = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--heatmap") {
+      heatmap = true;
+    } else if (arg == "--traversal") {
+      traversal = true;
+    } else if (arg == "--schedule") {
+      schedule_previews = 25;
+      if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+        schedule_previews = std::atoi(argv[++i]);
+      }
+    } else if (arg == "--sequence" && i + 1 < argc) {
+      sequence_dir = argv[++i];
+    } else if (arg == "--writers" && i + 1 < argc) {
+      writers = static_cast<unsigned>(std::max(0, std::atoi(argv[++i])));
+    } else if (arg == "--fps" && i + 1 < argc) {
+      video_fps = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--png16" && i + 1 < argc) {
+      png16_path = argv[++i];
+    } else if (arg == "--pfm" && i + 1 < argc) {
+      pfm_path = argv[++i];
+    } else if (arg == "--viewer") {
+      viewer = true;
+    } else if (arg == "--vrs") {
+      vrs = true;
+    } else if (arg == "--interactive") {
+      interactive = true;
+    } else if (arg == "--budget" && i + 1 < argc) {
+      budget_ms = std::max(1.0, std::atof(argv[++i]));
+    } else if (arg == "--deterministic") {
+      det.enabled = true;
+      if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+        det.seed = std::strtoull(argv[++i], nullptr, 10);
+      }
+    } else if (arg == "--threads" && i + 1 < argc) {
+      det.threads = std::max(1, std::atoi(argv[++i]));
+      output.threads = det.threads;
+    } else if (arg == "--regress") {
+      regress_iterations = i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))
+                               ? std::max(1, std::atoi(argv[++i]))
+                               : 3;
+    } else if (arg == "--regress-tolerance" && i + 1 < argc) {
+      regress_tolerance = std::atof(argv[++i]);
+    } else if (arg == "--regress-update") {
+      regress_update = true;
+    } else if (arg == "--bench") {
+      bench_iterations = i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))
+                             ? std::max(1, std::atoi(argv[++i]))
+                             : 5;
+    } else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      return 1;
+    }
+  }
 
-        SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
-        SDL_RenderClear(renderer);
-        SDL_RenderCopy(renderer, texture, &screenRect, &screenRect);
-        SDL_RenderPresent(renderer);
+  if (traversal && scene_kind.empty()) {
+    std::cerr << "--traversal needs --scene, the product shot has no acceleration structure" << std::endl;
+    return 1;
+  }
+  if (regress_iterations > 0) {
+    return run_regress(regress_iterations, regress_tolerance, regress_update);
+  }
+  if (bench_iterations > 0 && scene_kind.empty()) {
+    benchmark(product_shot, {RenderPath::Generic, RenderPath::Specialised, RenderPath::Morton, RenderPath::Wavefront},
+              width, height, n, bench_iterations);
+    return 0;
+  }
+  if (viewer) {
+#ifdef SDL_VIEWER
+    return run_viewer(path, is_ortho, width, height, vrs, budget_ms, interactive);
+#else
+    // The viewer options only feed run_viewer
+    (void)vrs;
+    (void)budget_ms;
+    (void)interactive;
+    std::cerr << "Built without SDL_VIEWER" << std::endl;
+    return 1;
+#endif
+  }
+  if (!video_path.empty()) {
+    return stream_video(video_path, video_format, video_frames, video_fps, path, is_ortho, width, height, n,
+                        path_settings, output, det);
+  }
+  if (!sequence_dir.empty()) {
+    return write_sequence(sequence_dir, format, video_frames, writers, path, is_ortho, width, height, n, path_settings,
+                          output, det);
+  }
 
-        char title[32];
-        SDL_SetWindowTitle(window, SDL_itoa(endTicks - startTicks, title, 10));
+  int frame = 0;
+  Camera cam = make_camera(is_ortho, frame, width, height);
+  det.frame = frame;
+  // Rays of a path traced render, printed once the image is done
+  PathStats path_stats;
+  if (!scene_kind.empty()) {
+    AccelScene scene;
+    if (scene_kind == "particles") {
+      make_particle_scene(scene, scene_size);
+    } else {
+      make_mesh_scene(scene, scene_size);
+    }
+    if (light_count > 0) {
+      make_light_dome(scene.lights, light_count);
     }
+    scene.lights.samples_per_point = light_samples;
+
+    // Calibration probes: a coarse grid of camera rays standing in for the full render
+    const size_t probe_side = 32;
+    std::vector<Ray> probes;
+    for (size_t r = 0; r < probe_side; ++r) {
+      for (size_t c = 0; c < probe_side; ++c) {
+        probes.push_back(camera_ray(cam, (r + 0.5) / probe_side, (c + 0.5) / probe_side));
+      }
+    }
+    scene.build(accel, probes, static_cast<double>(width * height * n * n) / probes.size());
+    std::cout << "Acceleration: " << scene.info() << std::endl;
+    if (bench_iterations > 0) {
+      benchmark(scene, {RenderPath::Specialised, RenderPath::Morton, RenderPath::Wavefront}, width, height, n,
+                bench_iterations);
+      return 0;
+    }
+
+    // shoot_ray only knows the product shot, so the generic path renders through the kernel
+    if (path == RenderPath::Generic) {
+      path = RenderPath::Specialised;
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (traversal) {
+      traversal_frame(image, scene, cam, n, det, traversal_pixels);
+    } else if (heatmap) {
+      profile_frame(image, scene, cam, n, det, costs);
+    } else {
+      path_stats = render_frame(image, path, scene, cam, n, path_settings,
+                                denoise_image ? &denoise_settings : nullptr, det);
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Render: " << elapsed.count() << " ms" << std::endl;
+    OccluderCache::Stats shadow = OccluderCache::stats();
+    std::cout << "Occluder cache: " << shadow.lookups << " shadow rays, " << shadow.occluded << " occluded, " << shadow.hits
+              << " by the cached occluder (" << (shadow.occluded > 0 ? 100.0 * shadow.hits / shadow.occluded : 0.0) << "%)"
+              << std::endl;
+  } else if (!texture_path.empty()) {
+    if (texture_system().add(texture_path) != 0) {
+      std::cerr << "Can't load texture " << texture_path << std::endl;
+      return 1;
+    }
+    if (heatmap) {
+      profile_frame(image, counted_tests(textured_product_shot), cam, n, det, costs);
+    } else {
+      path_stats = render_frame(image, path, textured_product_shot, cam, n, path_settings,
+                                denoise_image ? &denoise_settings : nullptr, det);
+    }
+
+    TileCache::Stats stats = texture_system().cache_stats();
+    std::cout << "Texture cache: " << texture_system().cache_bytes() / 1024 << " KB, " << stats.lookups << " lookups, "
+              << stats.misses << " tile loads" << std::endl;
+  } else if (schedule_previews > 0) {
+    run_schedule(image, is_ortho, width, height, n, det, schedule_previews);
+  } else if (heatmap) {
+    profile_frame(image, counted_tests(product_shot), cam, n, det, costs);
+  } else {
+    path_stats = render_frame(image, path, product_shot, cam, n, path_settings,
+                              denoise_image ? &denoise_settings : nullptr, det);
+  }
+  if (path_stats.total() > 0) {
+    std::cout << "Rays per pixel: " << static_cast<double>(path_stats.total()) / (width * height) << " (camera "
+              << path_stats.camera_rays << ", bounce " << path_stats.bounce_rays << ", shadow "
+              << path_stats.shadow_rays << ")" << std::endl;
+  }
+  // Write image, every format from the same render
+  encode_8bit(image, width, output, png);
+  std::string out_path = std::string("out/test.") + format_extension(format);
+  if (!write_image(format, out_path, width, height, png, output.threads)) {
+    std::cerr << "Can't write " << out_path << std::endl;
+    return 1;
+  }
+  if (heatmap && !write_heatmaps("out/test", costs)) {
+    return 1;
+  }
+  if (!traversal_pixels.empty() && !write_traversal("out/test", traversal_pixels, width, height)) {
+    return 1;
+  }
+  if (!png16_path.empty()) {
+    std::vector<uint16_t> png16;
+    encode_16bit(image, width, output, png16);
+    if (!write_png16(png16_path, width, height, png16, output.threads)) {
+      std::cerr << "Can't write " << png16_path << std::endl;
+      return 1;
+    }
+  }
+  if (!pfm_path.empty() && !write_pfm(pfm_path, width, height, image, output)) {
+    std::cerr << "Can't write " << pfm_path << std::endl;
+    return 1;
+  }
+  return 0;
 }
-*/
\ No newline at end of file
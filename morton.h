@@ -0,0 +1,103 @@
+#ifndef MORTON_H_
+#define MORTON_H_
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "vec3.h"
+
+// Z-order (Morton) pixel traversal. Interleaving the bits of x and y visits a
+// square tile as nested 2x2, 4x4, 8x8 ... blocks, so consecutive pixels stay
+// close in both directions and their rays reuse the same scene data from cache.
+
+// Side of a Morton tile, a power of two
+const size_t morton_tile_size = 16;
+
+// Spreads the low 16 bits of v to the even bits
+inline uint32_t morton_spread(uint32_t v) {
+  v &= 0xffff;
+  v = (v | (v << 8)) & 0x00ff00ff;
+  v = (v | (v << 4)) & 0x0f0f0f0f;
+  v = (v | (v << 2)) & 0x33333333;
+  v = (v | (v << 1)) & 0x55555555;
+  return v;
+}
+
+// Gathers the even bits of v into the low 16 bits
+inline uint32_t morton_compact(uint32_t v) {
+  v &= 0x55555555;
+  v = (v | (v >> 1)) & 0x33333333;
+  v = (v | (v >> 2)) & 0x0f0f0f0f;
+  v = (v | (v >> 4)) & 0x00ff00ff;
+  v = (v | (v >> 8)) & 0x0000ffff;
+  return v;
+}
+
+inline uint32_t morton_encode(uint32_t x, uint32_t y) {
+  return morton_spread(x) | (morton_spread(y) << 1);
+}
+
+inline void morton_decode(uint32_t code, uint32_t &x, uint32_t &y) {
+  x = morton_compact(code);
+  y = morton_compact(code >> 1);
+}
+
+// Image stored tile by tile, each tile in Morton order, so a tile rendered in
+// Morton order is written to consecutive memory. Converted to row-major only
+// once rendering is done.
+class TiledImage {
+  public:
+    TiledImage() = default;
+
+    TiledImage(size_t width, size_t height) {
+      resize(width, height);
+    }
+
+    // Sizes the image for width * height pixels, keeping the memory of a larger one
+    void resize(size_t width, size_t height) {
+      width_ = width;
+      height_ = height;
+      tiles_x_ = (width + morton_tile_size - 1) / morton_tile_size;
+      tiles_y_ = (height + morton_tile_size - 1) / morton_tile_size;
+      pixels_.resize(tiles_x_ * tiles_y_ * morton_tile_size * morton_tile_size);
+    }
+
+    size_t tiles_x() const {
+      return tiles_x_;
+    }
+
+    size_t tiles_y() const {
+      return tiles_y_;
+    }
+
+    // Pixel code of tile (tx, ty), codes past the image edge hold nothing
+    // code - Morton index within the tile
+    color &at(size_t tx, size_t ty, uint32_t code) {
+      return pixels_[(ty * tiles_x_ + tx) * morton_tile_size * morton_tile_size + code];
+    }
+
+    // Writes the image row-major into linear, width * height colors
+    void to_linear(color *linear) const {
+      const size_t tile_pixels = morton_tile_size * morton_tile_size;
+      for (size_t ty = 0; ty < tiles_y_; ++ty) {
+        for (size_t tx = 0; tx < tiles_x_; ++tx) {
+          const color *tile = &pixels_[(ty * tiles_x_ + tx) * tile_pixels];
+          for (uint32_t code = 0; code < tile_pixels; ++code) {
+            uint32_t x, y;
+            morton_decode(code, x, y);
+            size_t r = ty * morton_tile_size + y, c = tx * morton_tile_size + x;
+            if (r < height_ && c < width_) {
+              linear[r * width_ + c] = tile[code];
+            }
+          }
+        }
+      }
+    }
+
+  private:
+    size_t width_ = 0, height_ = 0;
+    size_t tiles_x_ = 0, tiles_y_ = 0;
+    std::vector<color> pixels_;
+};
+
+#endif
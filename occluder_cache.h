@@ -0,0 +1,109 @@
+#ifndef OCCLUDER_CACHE_H_
+#define OCCLUDER_CACHE_H_
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Cache entry of a light no primitive has blocked yet
+const uint32_t no_occluder = UINT32_MAX;
+
+// Last primitive found blocking each light, per thread. Neighbouring shading
+// points are usually shadowed by the same primitive, so testing it before
+// traversing the whole scene answers most occluded shadow rays with one test.
+// A cached primitive only gets a real intersection test, so a stale entry
+// costs that test and can never give a wrong answer.
+class OccluderCache {
+  public:
+    struct Stats {
+      // Shadow rays that consulted the cache
+      uint64_t lookups = 0;
+      // Of those, rays found to be blocked
+      uint64_t occluded = 0;
+      // Of those, rays the cached primitive was found to block
+      uint64_t hits = 0;
+    };
+
+    OccluderCache() {
+      std::lock_guard<std::mutex> lock(totals().mutex);
+      totals().live.push_back(this);
+    }
+
+    ~OccluderCache() {
+      std::lock_guard<std::mutex> lock(totals().mutex);
+      totals().lookups += stats_.lookups;
+      totals().occluded += stats_.occluded;
+      totals().hits += stats_.hits;
+      std::vector<OccluderCache *> &live = totals().live;
+      live.erase(std::find(live.begin(), live.end(), this));
+    }
+
+    OccluderCache(const OccluderCache &) = delete;
+    OccluderCache &operator=(const OccluderCache &) = delete;
+
+    // Primitive that last blocked light, no_occluder if unknown
+    uint32_t get(uint32_t light) {
+      ++stats_.lookups;
+      return light < last_.size() ? last_[light] : no_occluder;
+    }
+
+    // Counts a ray the cached primitive blocked
+    void hit() {
+      ++stats_.occluded;
+      ++stats_.hits;
+    }
+
+    // Remembers prim as the light's occluder after a traversal found it
+    void record(uint32_t light, uint32_t prim) {
+      ++stats_.occluded;
+      if (light >= last_.size()) {
+        last_.resize(light + 1, no_occluder);
+      }
+      last_[light] = prim;
+    }
+
+    // Counts of every thread, read while no other thread is shading
+    static Stats stats();
+
+  private:
+    // Counts of finished threads, and the caches of running ones (pool workers live on)
+    struct Totals {
+      std::mutex mutex;
+      uint64_t lookups = 0;
+      uint64_t occluded = 0;
+      uint64_t hits = 0;
+      std::vector<OccluderCache *> live;
+    };
+
+    // Never destroyed, pool workers' caches merge into it as the pool shuts down at exit
+    static Totals &totals() {
+      static Totals *t = new Totals;
+      return *t;
+    }
+
+    std::vector<uint32_t> last_;
+    Stats stats_;
+};
+
+// This thread's cache, merged into the totals when the thread ends
+inline OccluderCache &occluder_cache() {
+  thread_local OccluderCache cache;
+  return cache;
+}
+
+inline OccluderCache::Stats OccluderCache::stats() {
+  std::lock_guard<std::mutex> lock(totals().mutex);
+  Stats s;
+  s.lookups = totals().lookups;
+  s.occluded = totals().occluded;
+  s.hits = totals().hits;
+  for (const OccluderCache *cache : totals().live) {
+    s.lookups += cache->stats_.lookups;
+    s.occluded += cache->stats_.occluded;
+    s.hits += cache->stats_.hits;
+  }
+  return s;
+}
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "vec3.h"
+#include "parallel.h"
+#include "arena.h"
+
+// Output stage: turns the linear HDR image the renderer accumulates into
+// display values and then into files. Exposure, tone mapping, sRGB encoding,
+// clamping and quantisation each run as a flat loop over a whole row of
+// channels, which the compiler vectorises, with rows spread across threads.
+// Every format is encoded from the same image, so none needs another render.
+
+enum class ToneMap {
+  // Clip at 1, the renderer's original look
+  Clamp,
+  // x / (1 + x) per channel
+  Reinhard,
+  // Narkowicz's fit of the ACES filmic curve
+  Aces
+};
+
+struct OutputSettings {
+  // Stops of exposure, 0 leaves radiance unscaled
+  double exposure = 0;
+  ToneMap tone_map = ToneMap::Clamp;
+  // Encode with the sRGB transfer curve instead of writing linear values
+  bool srgb = false;
+  // Add up to one step of noise before quantising, trading banding for grain
+  bool dither = false;
+  // Worker count, 0 for default_threads()
+  unsigned threads = 0;
+};
+
+// Maps count linear channels to display values in [0, 1]
+// in/out - may be the same array
+inline void display_row(const double *in, double *out, size_t count, const OutputSettings &settings) {
+  // exp2(0) is exactly 1, so the default settings leave values bit-identical
+  const double scale = std::exp2(settings.exposure);
+  switch (settings.tone_map) {
+    case ToneMap::Clamp:
+      for (size_t i = 0; i < count; ++i) {
+        out[i] = in[i] * scale;
+      }
+      break;
+    case ToneMap::Reinhard:
+      for (size_t i = 0; i < count; ++i) {
+        double v = std::max(in[i] * scale, 0.0);
+        out[i] = v / (1 + v);
+      }
+      break;
+    case ToneMap::Aces:
+      for (size_t i = 0; i < count; ++i) {
+        double v = std::max(in[i] * scale, 0.0);
+        out[i] = v * (2.51 * v + 0.03) / (v * (2.43 * v + 0.59) + 0.14);
+      }
+      break;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = std::min(std::max(out[i], 0.0), 1.0);
+  }
+  if (settings.srgb) {
+    for (size_t i = 0; i < count; ++i) {
+      double v = out[i];
+      out[i] = v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+    }
+  }
+}
+
+// Uniform number in [0, 1) per channel of a pixel, for dithering
+inline double dither_noise(size_t index) {
+  uint64_t h = index * 0x9e3779b97f4a7c15ULL;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return (h >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Quantises display values in [0, 1] to integers in [0, max_value]
+// first - channel index of values[0] within the image, seeds the dither
+template <typename T>
+void quantize_row(const double *values, T *out, size_t count, double max_value, bool dither, size_t first) {
+  if (dither) {
+    for (size_t i = 0; i < count; ++i) {
+      double v = values[i] * max_value + dither_noise(first + i);
+      out[i] = static_cast<T>(std::min(v, max_value));
+    }
+    return;
+  }
+  // Without dithering, 8 bit output keeps the renderer's original 255.999 scaling
+  const double scale = max_value == 255 ? 255.999 : max_value + 0.999;
+  for (size_t i = 0; i < count; ++i) {
+    out[i] = static_cast<T>(values[i] * scale);
+  }
+}
+
+// Encodes the whole image through the output stage, one row per task
+// image - height rows of width linear colors
+// out - output, 3 channels per pixel
+template <typename T>
+void encode_image(const std::vector<color> &image, size_t width, const OutputSettings &settings, double max_value,
+                  T *out) {
+  const size_t height = image.size() / width;
+  parallel_for(height, settings.threads, [&](size_t r) {
+    ArenaScope scope;
+    double *row = thread_arena().allocate<double>(width * 3);
+    for (size_t c = 0; c < width; ++c) {
+      for (int k = 0; k < 3; ++k) {
+        row[c * 3 + k] = image[r * width + c].e[k];
+      }
+    }
+    display_row(row, row, width * 3, settings);
+    quantize_row(row, &out[r * width * 3], width * 3, max_value, settings.dither, r * width * 3);
+  });
+}
+
+// 8 bit RGB, for PNG, QOI and PPM
+// out - output, keeps its storage from call to call
+inline void encode_8bit(const std::vector<color> &image, size_t width, const OutputSettings &settings,
+                        std::vector<char> &out) {
+  out.resize(image.size() * 3);
+  encode_image(image, width, settings, 255, reinterpret_cast<uint8_t *>(out.data()));
+}
+
+// 16 bit RGB, for PNG
+inline void encode_16bit(const std::vector<color> &image, size_t width, const OutputSettings &settings,
+                         std::vector<uint16_t> &out) {
+  out.resize(image.size() * 3);
+  encode_image(image, width, settings, 65535, out.data());
+}
+
+// Writes the linear image as a little-endian PFM, keeping the full range
+// for HDR tools. Only exposure is applied.
+// returns false if the file can't be written
+inline bool write_pfm(const std::string &path, size_t width, size_t height, const std::vector<color> &image,
+                      const OutputSettings &settings) {
+  FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  bool written = std::fprintf(file, "PF\n%zu %zu\n-1.0\n", width, height) > 0;
+  const double scale = std::exp2(settings.exposure);
+  std::vector<float> row(width * 3);
+  // PFM stores the bottom row first
+  for (size_t r = height; written && r-- > 0;) {
+    for (size_t c = 0; c < width; ++c) {
+      for (int k = 0; k < 3; ++k) {
+        row[c * 3 + k] = static_cast<float>(image[r * width + c].e[k] * scale);
+      }
+    }
+    written = std::fwrite(row.data(), sizeof(float), row.size(), file) == row.size();
+  }
+  return std::fclose(file) == 0 && written;
+}
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of worker threads to use when none is given
+inline unsigned default_threads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Threads kept for parallel_for across calls, so a loop after the first starts
+// no threads and each worker's thread_local scratch (arena.h, occluder cache)
+// lives from frame to frame. A loop is posted as a job that idle workers join
+// as helpers while the caller works on it too; workers busy elsewhere simply
+// don't join, so loops nested in loops can't wait on each other.
+class WorkerPool {
+  public:
+    ~WorkerPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      work_ready_.notify_all();
+      for (std::thread &t : workers_) {
+        t.join();
+      }
+    }
+
+    // Runs work(context) on the calling thread and on up to helpers workers at once,
+    // returning when every call has. work must return once the loop's work is taken.
+    void run(void (*work)(void *), void *context, unsigned helpers) {
+      Job job = {work, context, helpers, 0, 0, nullptr};
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Start workers the first time a loop asks for more than there are
+        while (workers_.size() < helpers) {
+          workers_.emplace_back([this] { serve(); });
+        }
+        job.next = jobs_;
+        jobs_ = &job;
+      }
+      work_ready_.notify_all();
+
+      work(context);
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      Job **link = &jobs_;
+      while (*link != &job) {
+        link = &(*link)->next;
+      }
+      *link = job.next;
+      job_done_.wait(lock, [&] { return job.active == 0; });
+    }
+
+  private:
+    struct Job {
+      void (*work)(void *);
+      void *context;
+      // Helpers the job takes, helpers that joined and are still working
+      unsigned wanted, joined, active;
+      Job *next;
+    };
+
+    // Worker: joins jobs with room for a helper until the pool is destroyed
+    void serve() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (;;) {
+        Job *job = nullptr;
+        work_ready_.wait(lock, [&] {
+          job = jobs_;
+          while (job != nullptr && job->joined >= job->wanted) {
+            job = job->next;
+          }
+          return stop_ || job != nullptr;
+        });
+        if (stop_) {
+          return;
+        }
+        ++job->joined;
+        ++job->active;
+        lock.unlock();
+        job->work(job->context);
+        lock.lock();
+        if (--job->active == 0) {
+          job_done_.notify_all();
+        }
+      }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable work_ready_, job_done_;
+    // Jobs taking helpers, newest first
+    Job *jobs_ = nullptr;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+inline WorkerPool &worker_pool() {
+  static WorkerPool pool;
+  return pool;
+}
+
+// Calls f(i) for every i in [0, count) across threads, handing out
+// indices one at a time so uneven work still balances
+// threads - worker count, 0 for default_threads()
+template <typename F>
+void parallel_for(size_t count, unsigned threads, F f) {
+  if (threads == 0) {
+    threads = default_threads();
+  }
+  threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      f(i);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++) {
+      f(i);
+    }
+  };
+  worker_pool().run([](void *w) { (*static_cast<decltype(worker) *>(w))(); }, &worker, threads - 1);
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+#include <cstdint>
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware cache counters of the calling thread through perf_event_open.
+// Virtual machines and locked-down kernels often expose no counters, in
+// which case available() is false and every count reads as zero.
+class CacheCounters {
+  public:
+    struct Counts {
+      // Last level cache references and misses
+      uint64_t references = 0;
+      uint64_t misses = 0;
+      // L1 data cache read misses
+      uint64_t l1d_misses = 0;
+    };
+
+    CacheCounters() {
+      references_ = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES);
+      misses_ = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+      l1d_misses_ = open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    }
+
+    ~CacheCounters() {
+      for (int fd : {references_, misses_, l1d_misses_}) {
+        if (fd >= 0) {
+          close(fd);
+        }
+      }
+    }
+
+    CacheCounters(const CacheCounters &) = delete;
+    CacheCounters &operator=(const CacheCounters &) = delete;
+
+    bool available() const {
+      return misses_ >= 0;
+    }
+
+    // Zeroes and starts every counter
+    void start() {
+      for (int fd : {references_, misses_, l1d_misses_}) {
+        if (fd >= 0) {
+          ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+          ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+    }
+
+    // Stops every counter and returns the counts since start()
+    Counts stop() {
+      Counts counts;
+      counts.references = read_stopped(references_);
+      counts.misses = read_stopped(misses_);
+      counts.l1d_misses = read_stopped(l1d_misses_);
+      return counts;
+    }
+
+  private:
+    static int open(uint32_t type, uint64_t config) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.type = type;
+      attr.size = sizeof(attr);
+      attr.config = config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    static uint64_t read_stopped(int fd) {
+      uint64_t value = 0;
+      if (fd < 0) {
+        return 0;
+      }
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+      }
+      return value;
+    }
+
+    int references_ = -1;
+    int misses_ = -1;
+    int l1d_misses_ = -1;
+};
+
+#endif
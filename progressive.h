@@ -0,0 +1,71 @@
+#ifndef PROGRESSIVE_H_
+#define PROGRESSIVE_H_
+#include <cstddef>
+#include <vector>
+
+#include "vec3.h"
+#include "camera.h"
+#include "kernel.h"
+#include "sampler.h"
+#include "parallel.h"
+#include "arena.h"
+
+// Progressive refinement: each pass shades one more sample per pixel into a
+// running sum, so a still camera shows a noisy image at once that sharpens
+// every frame. Pass i takes sample i % (n * n) of each pixel's multi jitter
+// pattern, drawn as in --deterministic with frame i / (n * n), so after n * n
+// passes the image is exactly the deterministic n x n render, summed in the
+// same order, and later passes keep adding fresh patterns. A pass generates
+// only the one sample it shades (multi_jitter_sample), not the whole pattern.
+
+class ProgressiveImage {
+  public:
+    // n - multi jitter samples per side of one full pattern
+    ProgressiveImage(size_t width, size_t height, size_t n = 4)
+        : width_(width), height_(height), n_(n), sum_(width * height) {}
+
+    // Drops every pass, e.g. when the camera moves
+    void reset() {
+      passes_ = 0;
+    }
+
+    size_t passes() const {
+      return passes_;
+    }
+
+    // Shades one sample per pixel and adds it to the sum
+    // det - seed of the jitter patterns, its frame and enabled are ignored
+    // threads - worker count, 0 for default_threads()
+    template <typename Proj, typename Scene>
+    void add_pass(const Scene &scene, const Camera &cam, Determinism det, unsigned threads = 0) {
+      const size_t spp = n_ * n_;
+      const size_t index = passes_ % spp;
+      det.frame = passes_ / spp;
+      const bool first = passes_ == 0;
+      parallel_for(height_, threads, [&](size_t r) {
+        for (size_t c = 0; c < width_; ++c) {
+          Sample jitter = multi_jitter_sample(n_, det, r * width_ + c, index);
+          double row_ratio = (static_cast<double>(r) + jitter.r) / height_;
+          double col_ratio = (static_cast<double>(c) + jitter.c) / width_;
+          vec3 sample = shade(scene, Proj::generate(cam, row_ratio, col_ratio));
+          sum_[r * width_ + c] = first ? sample : sum_[r * width_ + c] + sample;
+        }
+      });
+      ++passes_;
+    }
+
+    // Writes the average of every pass so far, black before the first
+    void resolve(color *image) const {
+      for (size_t i = 0; i < sum_.size(); ++i) {
+        image[i] = passes_ == 0 ? color(0, 0, 0) : sum_[i] / passes_;
+      }
+    }
+
+  private:
+    size_t width_, height_;
+    size_t n_;
+    std::vector<color> sum_;
+    size_t passes_ = 0;
+};
+
+#endif
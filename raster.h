@@ -0,0 +1,333 @@
+#ifndef RASTER_H_
+#define RASTER_H_
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "vec3.h"
+#include "ray.h"
+#include "hit.h"
+#include "scene.h"
+#include "camera.h"
+#include "light.h"
+#include "parallel.h"
+#include "arena.h"
+
+// Hybrid renderer: primary visibility is rasterised, only shadow rays are traced.
+// Every camera ray of a pinhole or orthographic camera varies affinely with the
+// sample position, so a primitive's edge tests and plane distance become affine
+// functions of the sample too, and each sample costs a few multiply-adds per
+// primitive instead of a ray traversal. Samples lie on a regular n x n grid per
+// pixel, since a rasteriser needs the same pattern in every pixel.
+// Primitives are binned into screen tiles that threads rasterise independently
+// into a visibility buffer holding the closest primitive and its t per sample,
+// then each sample is shaded exactly as shade() shades a traced hit.
+
+// Samples along each side of a tile
+const size_t raster_tile_size = 16;
+
+// Closest primitive and its t for every sample
+struct VisibilityBuffer {
+  size_t width = 0;
+  size_t height = 0;
+  std::vector<double> t;
+  // -1 where nothing was hit
+  std::vector<int> prim;
+
+  void resize(size_t w, size_t h) {
+    width = w;
+    height = h;
+    t.resize(w * h);
+    prim.resize(w * h);
+  }
+};
+
+// c + x * px + y * py for sample position (px, py)
+struct Affine {
+  double c, x, y;
+
+  double at(double px, double py) const {
+    return c + x * px + y * py;
+  }
+};
+
+// Camera rays as affine functions of the sample position: origin o0 + ox * px + oy * py,
+// direction d0 + dx * px + dy * py. One of the two is constant for either projection.
+struct RasterView {
+  const Camera &cam;
+  // Sample grid size
+  size_t width, height;
+  vec3 o0, ox, oy;
+  vec3 d0, dx, dy;
+
+  RasterView(const Camera &cam, size_t width, size_t height) : cam(cam), width(width), height(height) {
+    vec3 right = cam.viewport_right / width;
+    vec3 down = cam.viewport_down / height;
+    if (cam.is_ortho) {
+      o0 = cam.viewport_top_left;
+      ox = right;
+      oy = down;
+      d0 = cam.forward;
+    } else {
+      o0 = cam.pos;
+      d0 = cam.viewport_top_left - cam.pos;
+      dx = right;
+      dy = down;
+    }
+  }
+
+  // Fits an affine function to f(origin, direction), which must itself be affine in
+  // the ray, such as a dot product with the direction
+  template <typename F>
+  Affine fit(F f) const {
+    double c = f(o0, d0);
+    return {c, f(o0 + ox, d0 + dx) - c, f(o0 + oy, d0 + dy) - c};
+  }
+
+  // Sample position p projects to
+  // returns false if p is behind a perspective camera
+  bool project(const point3 &p, double &px, double &py) const {
+    vec3 q;
+    if (cam.is_ortho) {
+      q = p - o0;
+      px = dot(q, ox) / ox.length_squared();
+      py = dot(q, oy) / oy.length_squared();
+      return true;
+    }
+    // The viewport is one unit along forward, and its axes are perpendicular to it
+    double depth = dot(p - o0, cam.forward);
+    if (depth <= 0) {
+      return false;
+    }
+    q = (p - o0) / depth - d0;
+    px = dot(q, dx) / dx.length_squared();
+    py = dot(q, dy) / dy.length_squared();
+    return true;
+  }
+};
+
+// Half-open range of samples a primitive may cover
+struct RasterRect {
+  long x0, y0, x1, y1;
+};
+
+// One primitive set up for rasterisation
+struct RasterPrim {
+  enum Kind { TriangleKind, PlaneKind, SphereKind };
+  Kind kind;
+  int id;
+  RasterRect rect;
+  // Triangle: signed volume of the ray with each edge, all the same sign inside
+  Affine edge[3];
+  // Triangle and plane: t is num / den
+  Affine num, den;
+  // Sphere: tested exactly against the sample's ray
+  point3 center;
+  double radius;
+};
+
+// Builds RasterPrims, called for every primitive of the scene in order
+struct RasterSetup {
+  const RasterView &view;
+  std::vector<RasterPrim> &prims;
+
+  void operator()(const Triangle &tri, int id) {
+    point3 v[3] = {tri.v0, tri.v0 + tri.edge1, tri.v0 + tri.edge2};
+    RasterPrim p = prim(RasterPrim::TriangleKind, id, v, 3);
+    for (int k = 0; k < 3; ++k) {
+      const point3 &a = v[k], &b = v[(k + 1) % 3];
+      p.edge[k] = view.fit([&](const vec3 &o, const vec3 &d) { return dot(d, cross(a - o, b - o)); });
+    }
+    // The lighting normal may differ from the geometric one, which t needs
+    plane(p, tri.v0, cross(tri.edge1, tri.edge2));
+    prims.push_back(p);
+  }
+
+  void operator()(const Plane &pl, int id) {
+    RasterPrim p = prim(RasterPrim::PlaneKind, id, nullptr, 0);
+    plane(p, pl.anchor, pl.normal);
+    prims.push_back(p);
+  }
+
+  void operator()(const Sphere &s, int id) {
+    point3 corners[8];
+    for (int k = 0; k < 8; ++k) {
+      corners[k] = s.center + s.radius * vec3(k & 1 ? 1 : -1, k & 2 ? 1 : -1, k & 4 ? 1 : -1);
+    }
+    RasterPrim p = prim(RasterPrim::SphereKind, id, corners, 8);
+    p.center = s.center;
+    p.radius = s.radius;
+    prims.push_back(p);
+  }
+
+  // Primitive covering the projection of points, or the whole grid if any is behind the
+  // camera or there are none to bound it
+  RasterPrim prim(RasterPrim::Kind kind, int id, const point3 *points, int count) const {
+    RasterPrim p = {};
+    p.kind = kind;
+    p.id = id;
+    p.rect = {0, 0, static_cast<long>(view.width), static_cast<long>(view.height)};
+    if (count == 0) {
+      return p;
+    }
+    double lo[2] = {std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity()};
+    double hi[2] = {-lo[0], -lo[1]};
+    for (int k = 0; k < count; ++k) {
+      double px, py;
+      if (!view.project(points[k], px, py)) {
+        return p;
+      }
+      lo[0] = std::min(lo[0], px);
+      lo[1] = std::min(lo[1], py);
+      hi[0] = std::max(hi[0], px);
+      hi[1] = std::max(hi[1], py);
+    }
+    // Samples sit at half-integer positions, widened by one for rounding in the projection
+    p.rect.x0 = std::max(0L, static_cast<long>(std::floor(lo[0])) - 1);
+    p.rect.y0 = std::max(0L, static_cast<long>(std::floor(lo[1])) - 1);
+    p.rect.x1 = std::min(static_cast<long>(view.width), static_cast<long>(std::ceil(hi[0])) + 1);
+    p.rect.y1 = std::min(static_cast<long>(view.height), static_cast<long>(std::ceil(hi[1])) + 1);
+    return p;
+  }
+
+  void plane(RasterPrim &p, const point3 &anchor, const vec3 &normal) const {
+    p.num = view.fit([&](const vec3 &o, const vec3 &) { return dot(anchor - o, normal); });
+    p.den = view.fit([&](const vec3 &, const vec3 &d) { return dot(d, normal); });
+  }
+};
+
+// Rasterises every primitive binned to one tile into the visibility buffer
+// Proj - Perspective or Orthographic, generating the rays spheres are tested with
+template <typename Proj>
+void raster_tile(const RasterView &view, const std::vector<RasterPrim> &prims, const std::vector<uint32_t> &bin,
+                 long tx, long ty, VisibilityBuffer &vis) {
+  const long x_end = std::min<long>(tx + raster_tile_size, vis.width);
+  const long y_end = std::min<long>(ty + raster_tile_size, vis.height);
+  for (long y = ty; y < y_end; ++y) {
+    std::fill(&vis.t[y * vis.width + tx], &vis.t[y * vis.width + x_end], std::numeric_limits<double>::infinity());
+    std::fill(&vis.prim[y * vis.width + tx], &vis.prim[y * vis.width + x_end], -1);
+  }
+
+  // Bins hold primitives in id order and depth tests are strict, so ties go to the earlier one as in tracing
+  for (uint32_t index : bin) {
+    const RasterPrim &p = prims[index];
+    const long x0 = std::max(tx, p.rect.x0), x1 = std::min(x_end, p.rect.x1);
+    const long y0 = std::max(ty, p.rect.y0), y1 = std::min(y_end, p.rect.y1);
+    for (long y = y0; y < y1; ++y) {
+      const double py = y + 0.5;
+      double *t_row = &vis.t[y * vis.width];
+      int *prim_row = &vis.prim[y * vis.width];
+      for (long x = x0; x < x1; ++x) {
+        const double px = x + 0.5;
+        double t = -1;
+        if (p.kind == RasterPrim::SphereKind) {
+          double t1;
+          Ray r = Proj::generate(view.cam, py / view.height, px / view.width);
+          if (!hit_sphere(p.center, p.radius, r, &t, &t1)) {
+            continue;
+          }
+        } else {
+          if (p.kind == RasterPrim::TriangleKind) {
+            double e0 = p.edge[0].at(px, py), e1 = p.edge[1].at(px, py), e2 = p.edge[2].at(px, py);
+            bool inside = (e0 >= 0 && e1 >= 0 && e2 >= 0) || (e0 <= 0 && e1 <= 0 && e2 <= 0);
+            if (!inside) {
+              continue;
+            }
+          }
+          double den = p.den.at(px, py);
+          if (den == 0) {
+            continue;
+          }
+          t = p.num.at(px, py) / den;
+        }
+        if (t > 0 && t < t_row[x]) {
+          t_row[x] = t;
+          prim_row[x] = p.id;
+        }
+      }
+    }
+  }
+}
+
+// Primitive setups and per-tile bins of a rasterise(), pooled so each frame reuses the last one's memory
+struct RasterBins {
+  std::vector<RasterPrim> prims;
+  std::vector<std::vector<uint32_t>> bins;
+};
+
+// Rasterises the scene into vis, one tile per task across threads
+// scene - provides visit(f), calling f(primitive, id) for every primitive in id order
+template <typename Proj, typename Scene>
+void rasterise(const Scene &scene, const RasterView &view, VisibilityBuffer &vis, unsigned threads) {
+  Pool<RasterBins>::Lease scratch = pool<RasterBins>().acquire();
+  std::vector<RasterPrim> &prims = scratch->prims;
+  prims.clear();
+  RasterSetup setup = {view, prims};
+  scene.visit(setup);
+
+  const long tiles_x = (view.width + raster_tile_size - 1) / raster_tile_size;
+  const long tiles_y = (view.height + raster_tile_size - 1) / raster_tile_size;
+  std::vector<std::vector<uint32_t>> &bins = scratch->bins;
+  bins.resize(tiles_x * tiles_y);
+  for (std::vector<uint32_t> &bin : bins) {
+    bin.clear();
+  }
+  for (size_t i = 0; i < prims.size(); ++i) {
+    const RasterRect &r = prims[i].rect;
+    if (r.x0 >= r.x1 || r.y0 >= r.y1) {
+      continue;
+    }
+    for (long y = r.y0 / raster_tile_size; y <= (r.y1 - 1) / static_cast<long>(raster_tile_size); ++y) {
+      for (long x = r.x0 / raster_tile_size; x <= (r.x1 - 1) / static_cast<long>(raster_tile_size); ++x) {
+        bins[y * tiles_x + x].push_back(static_cast<uint32_t>(i));
+      }
+    }
+  }
+
+  vis.resize(view.width, view.height);
+  parallel_for(bins.size(), threads, [&](size_t tile) {
+    long tx = (tile % tiles_x) * raster_tile_size;
+    long ty = (tile / tiles_x) * raster_tile_size;
+    raster_tile<Proj>(view, prims, bins[tile], tx, ty, vis);
+  });
+}
+
+// Renders the image by rasterising primary visibility on an n x n grid per pixel,
+// then shading each sample with traced shadow rays
+// image - output, height * width linear colors
+// threads - worker count, 0 for default_threads()
+template <typename Proj, typename Scene>
+void render_hybrid(color *image, const Scene &scene, const Camera &cam, size_t width, size_t height, size_t n,
+                   unsigned threads = 0) {
+  RasterView view(cam, width * n, height * n);
+  Pool<VisibilityBuffer>::Lease buffer = pool<VisibilityBuffer>().acquire();
+  VisibilityBuffer &vis = *buffer;
+  rasterise<Proj>(scene, view, vis, threads);
+
+  parallel_for(height, threads, [&](size_t r) {
+    for (size_t c = 0; c < width; ++c) {
+      vec3 color_sum = {};
+      for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+          size_t y = r * n + i, x = c * n + j;
+          int prim = vis.prim[y * vis.width + x];
+          if (prim < 0) {
+            continue;
+          }
+          Ray ray = Proj::generate(cam, (y + 0.5) / vis.height, (x + 0.5) / vis.width);
+          Hit hit;
+          hit.t = vis.t[y * vis.width + x];
+          hit.prim = prim;
+          scene.describe(ray, hit);
+          color_sum += direct_light(scene, hit, hash_point(hit.p));
+        }
+      }
+      image[r * width + c] = color_sum / (n * n);
+    }
+  });
+}
+
+#endif
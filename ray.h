@@ -1,19 +1,81 @@
 #ifndef RAY_H_
 #define RAY_H_
+#include <cmath>
+#include <limits>
+
 #include "vec3.h"
 
 // Represents a ray with origin and direction
+// The constructors precompute values derived from the direction that intersection
+// loops would otherwise redo per test, so call precompute() after changing direction
 struct Ray {
   vec3 origin;
   vec3 direction;
-  Ray() : origin(vec3()), direction(vec3()) {}
+  // direction scaled to unit length
+  vec3 unit_direction;
+  // 1 / direction per axis, infinite for zero components so slab tests still work
+  vec3 inv_direction;
+  // 1 where direction is negative (-0 included), selecting the box corner a slab test enters by
+  int sign[3];
+  // Only hits with t in (t_min, t_max) count
+  double t_min = 0;
+  double t_max = std::numeric_limits<double>::infinity();
+  // Ray cone for texture filtering: footprint width at the origin, and its
+  // growth per unit distance travelled. Zero for rays that don't track one.
+  double cone_width = 0;
+  double cone_spread = 0;
+
+  Ray() : origin(vec3()), direction(vec3()) {
+    precompute();
+  }
 
-  Ray(vec3 origin, vec3 direction) : origin(std::move(origin)), direction(std::move(direction)) {}
+  Ray(vec3 origin, vec3 direction) : origin(std::move(origin)), direction(std::move(direction)) {
+    precompute();
+  }
+
+  Ray(vec3 origin, vec3 direction, double cone_width, double cone_spread)
+      : origin(std::move(origin)), direction(std::move(direction)), cone_width(cone_width), cone_spread(cone_spread) {
+    precompute();
+  }
 
   // Calculates R(t)
   vec3 at(double t) const {
     return origin + direction * t;
   }
+
+  // Width of the ray cone at t
+  double footprint(double t) const {
+    return cone_width + cone_spread * t * direction.length();
+  }
+
+  // Fills in the values derived from direction, called by the constructors
+  void precompute() {
+    unit_direction = unit_vector(direction);
+    for (int k = 0; k < 3; ++k) {
+      inv_direction.e[k] = 1 / direction.e[k];
+      sign[k] = std::signbit(direction.e[k]) ? 1 : 0;
+    }
+  }
 };
 
-#endif
\ No newline at end of file
+// Distance a ray leaving a surface skips before hits count, so rounding in the hit
+// point can't make it hit that surface again
+const double surface_offset = 0.001;
+
+// Ray leaving a surface at p, hits counted past surface_offset
+inline Ray surface_ray(const vec3 &p, const vec3 &direction) {
+  Ray r(p, direction);
+  r.t_min = surface_offset;
+  return r;
+}
+
+// Ray from a surface at p towards target, hits counted past surface_offset and short of target,
+// e.g. a shadow ray towards a light
+inline Ray segment_ray(const vec3 &p, const vec3 &target) {
+  vec3 to_target = target - p;
+  Ray r = surface_ray(p, unit_vector(to_target));
+  r.t_max = to_target.length();
+  return r;
+}
+
+#endif
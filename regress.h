@@ -0,0 +1,69 @@
+#ifndef REGRESS_H_
+#define REGRESS_H_
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+// Golden-image regression checks: every reference configuration is rendered
+// again and compared with its stored image by PSNR, and its best render time
+// is compared with a stored per-machine baseline. Paths that should reproduce
+// a reference exactly require infinite PSNR, i.e. identical bytes.
+
+// Peak signal-to-noise ratio of two 8 bit images in dB, infinity if identical
+inline double psnr(const uint8_t *a, const uint8_t *b, size_t count) {
+  if (count == 0) {
+    return 0;
+  }
+  double sum = 0;
+  for (size_t i = 0; i < count; ++i) {
+    double d = static_cast<double>(a[i]) - b[i];
+    sum += d * d;
+  }
+  if (sum == 0) {
+    return std::numeric_limits<double>::infinity();
+  }
+  return 10 * std::log10(255.0 * 255.0 / (sum / count));
+}
+
+// Render time baseline, one "name milliseconds" line per configuration
+class TimingBaseline {
+  public:
+    explicit TimingBaseline(const std::string &path) : path_(path) {
+      std::ifstream file(path);
+      std::string name;
+      double ms;
+      while (file >> name >> ms) {
+        ms_[name] = ms;
+      }
+    }
+
+    // Baseline time of name, 0 if it has none yet
+    double get(const std::string &name) const {
+      auto found = ms_.find(name);
+      return found == ms_.end() ? 0 : found->second;
+    }
+
+    void set(const std::string &name, double ms) {
+      ms_[name] = ms;
+    }
+
+    // returns false if the file can't be written
+    bool save() const {
+      std::ofstream file(path_);
+      for (const auto &entry : ms_) {
+        file << entry.first << " " << entry.second << "\n";
+      }
+      return static_cast<bool>(file);
+    }
+
+  private:
+    std::string path_;
+    std::map<std::string, double> ms_;
+};
+
+#endif
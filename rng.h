@@ -0,0 +1,49 @@
+#ifndef RNG_H_
+#define RNG_H_
+#include <cstdint>
+
+// PCG32 random number generator (https://www.pcg-random.org)
+// Small state and independent streams, so each render thread or pixel can own one
+struct Rng {
+  uint64_t state;
+  uint64_t inc;
+
+  // seed - starting state
+  // stream - selects one of 2^63 independent sequences
+  explicit Rng(uint64_t seed = 0x853c49e6748fea9bULL, uint64_t stream = 0xda3e39cb94b95bdbULL) : state(0), inc((stream << 1) | 1) {
+    next_u32();
+    state += seed;
+    next_u32();
+  }
+
+  uint32_t next_u32() {
+    uint64_t old = state;
+    state = old * 6364136223846793005ULL + inc;
+    uint32_t xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+    uint32_t rot = static_cast<uint32_t>(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+  }
+
+  // Skips the next delta outputs in O(log delta) steps (Brown, "Random Number Generation
+  // with Arbitrary Strides")
+  void advance(uint64_t delta) {
+    uint64_t mult = 6364136223846793005ULL, plus = inc;
+    uint64_t acc_mult = 1, acc_plus = 0;
+    for (; delta > 0; delta >>= 1) {
+      if (delta & 1) {
+        acc_mult *= mult;
+        acc_plus = acc_plus * mult + plus;
+      }
+      plus *= mult + 1;
+      mult *= mult;
+    }
+    state = acc_mult * state + acc_plus;
+  }
+
+  // Returns a double in [0, 1)
+  double uniform() {
+    return next_u32() * (1.0 / 4294967296.0);
+  }
+};
+
+#endif
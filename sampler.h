@@ -0,0 +1,119 @@
+#ifndef SAMPLER_H_
+#define SAMPLER_H_
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "rng.h"
+#include "arena.h"
+
+// Generates a random number between [min, max]
+inline int rand_int(int min, int max) {
+  return rand() % (max - min + 1) + min;
+}
+
+// Holds row and column in [0, 1]
+struct Sample {
+  double r;
+  double c;
+};
+
+// Fills n * n multi jitter samples for one pixel
+// samples - output, row-major n x n grid
+// n - samples per side
+// rand_int - called as rand_int(min, max) for every shuffle, in a fixed order
+template <typename RandInt>
+void multi_jitter(Sample *samples, size_t n, RandInt &&rand_int) {
+  double n_d = n;
+
+  // Generate grid of samples diagonally by row
+  for (size_t rr = 0; rr < n; ++rr) {
+    for (size_t cc = 0; cc < n; ++cc) {
+      samples[rr * n + cc].r = rr / n_d + (cc % n) / n_d / n_d + 0.5 / n_d / n_d;
+      samples[rr * n + cc].c = cc / n_d + (rr % n) / n_d / n_d + 0.5 / n_d / n_d;
+    }
+  }
+
+  // Shuffle samples[r][...].r
+  for (size_t r = 0; r < n; ++r) {
+    for (size_t i = n - 1; i >= 1; --i) {
+      int rand = rand_int(0, i);
+      std::swap(samples[r * n + i].r, samples[r * n + rand].r);
+    }
+  }
+
+  // Shuffle samples[...][c].c
+  for (size_t c = 0; c < n; ++c) {
+    for (size_t i = n - 1; i >= 1; --i) {
+      int rand = rand_int(0, i);
+      std::swap(samples[i * n + c].c, samples[rand * n + c].c);
+    }
+  }
+}
+
+// Multi jitter from the global rand() stream, so pixels must be sampled in row-major order
+inline void multi_jitter(Sample *samples, size_t n) {
+  multi_jitter(samples, n, ::rand_int);
+}
+
+// Deterministic rendering: each pixel draws its random decisions from its own
+// generator, keyed only on (seed, frame, pixel, stream), so the image is the
+// same whatever the thread count or the order pixels are rendered in.
+struct Determinism {
+  bool enabled = false;
+  uint64_t seed = 1;
+  uint64_t frame = 0;
+  // Worker count, 0 for default_threads()
+  unsigned threads = 0;
+};
+
+// Mixes v into a well distributed 64 bit value (splitmix64 finaliser)
+inline uint64_t mix64(uint64_t v) {
+  v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+  return v ^ (v >> 31);
+}
+
+// Generator for one pixel of a frame
+// pixel - row * width + column
+// stream - 0 for the pixel's jitter, 1 + i for the decisions of sample i
+inline Rng pixel_rng(const Determinism &det, uint64_t pixel, uint64_t stream = 0) {
+  return Rng(mix64(det.seed ^ mix64(det.frame ^ mix64(pixel))), stream);
+}
+
+// Multi jitter for one pixel from its own generator
+inline void multi_jitter(Sample *samples, size_t n, const Determinism &det, uint64_t pixel) {
+  Rng rng = pixel_rng(det, pixel);
+  multi_jitter(samples, n, [&](int min, int max) { return static_cast<int>(rng.next_u32() % (max - min + 1)) + min; });
+}
+
+// Sample index of the pattern multi_jitter(samples, n, det, pixel) fills, without the rest:
+// only the shuffle of its row and the shuffle of its column are replayed, O(n) instead of O(n * n)
+inline Sample multi_jitter_sample(size_t n, const Determinism &det, uint64_t pixel, size_t index) {
+  const size_t row = index / n, column = index % n;
+  const double n_d = n;
+  ArenaScope scope;
+  size_t *order = thread_arena().allocate<size_t>(n);
+  // Grid slot whose value the shuffle starting at generator output first moves to slot
+  auto shuffled = [&](uint64_t first, size_t slot) {
+    Rng rng = pixel_rng(det, pixel);
+    rng.advance(first);
+    for (size_t i = 0; i < n; ++i) {
+      order[i] = i;
+    }
+    for (size_t i = n - 1; i >= 1; --i) {
+      std::swap(order[i], order[rng.next_u32() % (i + 1)]);
+    }
+    return order[slot];
+  };
+  // multi_jitter shuffles every row's r, then every column's c, n - 1 outputs each
+  const size_t from_column = shuffled(row * (n - 1), column);
+  const size_t from_row = shuffled((n + column) * (n - 1), row);
+  Sample sample;
+  sample.r = row / n_d + (from_column % n) / n_d / n_d + 0.5 / n_d / n_d;
+  sample.c = column / n_d + (from_row % n) / n_d / n_d + 0.5 / n_d / n_d;
+  return sample;
+}
+
+#endif
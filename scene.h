@@ -0,0 +1,273 @@
+#ifndef SCENE_H_
+#define SCENE_H_
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+#include "vec3.h"
+#include "ray.h"
+#include "hit.h"
+#include "texture.h"
+#include "light.h"
+
+// Surface response of a primitive
+struct Material {
+  color albedo;
+  // Whether shading tests a shadow ray towards the light
+  bool shadowed;
+  // Id in texture_system() multiplying the albedo, -1 for none
+  int texture;
+  // Texture repeats per unit of the primitive's uv mapping
+  double uv_scale;
+
+  constexpr Material(color albedo, bool shadowed, int texture = -1, double uv_scale = 1)
+      : albedo(albedo), shadowed(shadowed), texture(texture), uv_scale(uv_scale) {}
+};
+
+// Texture coordinates on a primitive
+struct UV {
+  double u;
+  double v;
+};
+
+// Closest intersection found along a ray
+struct Hit {
+  double t = std::numeric_limits<double>::infinity();
+  // Index of the primitive hit, -1 if none
+  int prim = -1;
+  point3 p;
+  // Normal used for lighting
+  vec3 normal;
+  color albedo;
+  bool shadowed = false;
+};
+
+struct Sphere {
+  point3 center;
+  double radius;
+  Material material;
+
+  constexpr Sphere(point3 center, double radius, Material material)
+      : center(center), radius(radius), material(material) {}
+
+  // Returns t of the nearest hit in front of the ray, else -1
+  double intersect(const Ray &r) const {
+    double t0, t1;
+    return hit_sphere(center, radius, r, &t0, &t1) ? t0 : -1;
+  }
+
+  vec3 normal_at(const point3 &p) const {
+    return unit_vector(p - center);
+  }
+
+  // Longitude and latitude, scaled so one unit of uv is about one unit of surface at the equator
+  UV uv_at(const point3 &p) const {
+    vec3 n = normal_at(p);
+    double circumference = 2 * M_PI * radius;
+    return {(std::atan2(n.z(), n.x()) / (2 * M_PI) + 0.5) * circumference,
+            std::acos(std::max(-1.0, std::min(1.0, n.y()))) / M_PI * circumference / 2};
+  }
+};
+
+struct Plane {
+  point3 anchor;
+  vec3 normal;
+  Material material;
+
+  constexpr Plane(point3 anchor, vec3 normal, Material material)
+      : anchor(anchor), normal(normal), material(material) {}
+
+  double intersect(const Ray &r) const {
+    return hit_plane(anchor, normal, r);
+  }
+
+  vec3 normal_at(const point3 &) const {
+    return normal;
+  }
+
+  // Distance from the anchor along two axes in the plane
+  UV uv_at(const point3 &p) const {
+    vec3 u_axis = unit_vector(cross(normal, std::fabs(normal.x()) > 0.9 ? vec3(0, 1, 0) : vec3(1, 0, 0)));
+    vec3 v_axis = cross(normal, u_axis);
+    return {dot(p - anchor, u_axis), dot(p - anchor, v_axis)};
+  }
+};
+
+struct Triangle {
+  point3 v0;
+  // v1 - v0 and v2 - v0, folded at compile time for constexpr scenes
+  vec3 edge1, edge2;
+  // Normal used for lighting, not necessarily the geometric one
+  vec3 normal;
+  Material material;
+
+  constexpr Triangle(point3 v0, point3 v1, point3 v2, vec3 normal, Material material)
+      : v0(v0), edge1(v1 - v0), edge2(v2 - v0), normal(normal), material(material) {}
+
+  double intersect(const Ray &r) const {
+    return hit_triangle_edges(r, v0, edge1, edge2);
+  }
+
+  vec3 normal_at(const point3 &) const {
+    return normal;
+  }
+
+  // Barycentric coordinates of p
+  UV uv_at(const point3 &p) const {
+    vec3 w = p - v0;
+    double d11 = dot(edge1, edge1), d12 = dot(edge1, edge2), d22 = dot(edge2, edge2);
+    double w1 = dot(w, edge1), w2 = dot(w, edge2);
+    double denominator = d11 * d22 - d12 * d12;
+    return {(d22 * w1 - d12 * w2) / denominator, (d11 * w2 - d12 * w1) / denominator};
+  }
+};
+
+// Looks up a material's texture at a hit, filtered to the ray's footprint
+inline color sample_material(const Material &material, UV uv, const Ray &r, const Hit &hit) {
+  // The footprint stretches along the surface as the ray grazes it
+  double cos_theta = std::fabs(dot(r.unit_direction, hit.normal));
+  double footprint = r.footprint(hit.t) / std::max(cos_theta, 0.05);
+  return texture_system().sample(material.texture, uv.u * material.uv_scale, uv.v * material.uv_scale,
+                                 footprint * material.uv_scale);
+}
+
+// Fixed list of primitives whose types are known at compile time, so every
+// query unrolls into straight-line calls to each primitive's intersect().
+// Earlier primitives win ties, so list them in the order they should take precedence.
+template <typename... Prims>
+struct PrimList;
+
+template <>
+struct PrimList<> {
+  constexpr PrimList() {}
+
+  bool closest(const Ray &, Hit &, int) const { return false; }
+  bool any(const Ray &) const { return false; }
+  void describe(const Ray &, Hit &, int) const {}
+  template <typename F>
+  void visit(F &, int) const {}
+};
+
+template <typename P, typename... Rest>
+struct PrimList<P, Rest...> {
+  P head;
+  PrimList<Rest...> tail;
+
+  constexpr PrimList(P head, Rest... rest) : head(head), tail(rest...) {}
+
+  // Converts each primitive of a list as long, e.g. to wrap them
+  template <typename Q, typename... Others>
+  constexpr PrimList(const PrimList<Q, Others...> &other) : head(other.head), tail(other.tail) {}
+
+  // Records the closest primitive within the ray's range closer than hit.t
+  // id - index of head within the full list
+  // returns true if hit was updated
+  bool closest(const Ray &r, Hit &hit, int id) const {
+    bool found = false;
+    double t = head.intersect(r);
+    if (t > r.t_min && t < hit.t) {
+      hit.t = t;
+      hit.prim = id;
+      found = true;
+    }
+    return tail.closest(r, hit, id + 1) || found;
+  }
+
+  // Returns true if any primitive is hit within the ray's range
+  bool any(const Ray &r) const {
+    double t = head.intersect(r);
+    return (t > r.t_min && t < r.t_max) || tail.any(r);
+  }
+
+  // Fills in the shading details of hit.prim once the closest hit is known
+  void describe(const Ray &r, Hit &hit, int id) const {
+    if (hit.prim != id) {
+      tail.describe(r, hit, id + 1);
+      return;
+    }
+    hit.p = r.at(hit.t);
+    hit.normal = head.normal_at(hit.p);
+    hit.albedo = head.material.albedo;
+    hit.shadowed = head.material.shadowed;
+    if (head.material.texture >= 0) {
+      hit.albedo = hit.albedo * sample_material(head.material, head.uv_at(hit.p), r, hit);
+    }
+  }
+
+  // Calls f(primitive, id) for every primitive in order
+  template <typename F>
+  void visit(F &f, int id) const {
+    f(head, id);
+    tail.visit(f, id + 1);
+  }
+};
+
+// Scene with a compile-time primitive list and a single point light
+template <typename... Prims>
+struct StaticScene {
+  PrimList<Prims...> prims;
+  point3 light;
+
+  constexpr StaticScene(PrimList<Prims...> prims, point3 light) : prims(prims), light(light) {}
+
+  bool closest(const Ray &r, Hit &hit) const {
+    hit.t = std::min(hit.t, r.t_max);
+    if (!prims.closest(r, hit, 0)) {
+      return false;
+    }
+    prims.describe(r, hit, 0);
+    return true;
+  }
+
+  bool any(const Ray &r) const {
+    return prims.any(r);
+  }
+
+  // Shadow ray towards a light, a handful of primitives is cheaper to test than to cache
+  bool any(const Ray &r, uint32_t) const {
+    return prims.any(r);
+  }
+
+  // Fills in the shading details of a hit whose t and prim are already known
+  void describe(const Ray &r, Hit &hit) const {
+    prims.describe(r, hit, 0);
+  }
+
+  template <typename F>
+  void visit(F &f) const {
+    prims.visit(f, 0);
+  }
+
+  // Shadow rays per shading point, one for the one light
+  int light_samples() const {
+    return 1;
+  }
+
+  LightSample sample_light(double) const {
+    return {light, {1, 1, 1}, 0};
+  }
+};
+
+// The sphere, triangle and ground plane rendered by shoot_ray.
+// The triangle is lit with the ground normal and never shadowed, as in shoot_ray.
+using ProductShot = StaticScene<Sphere, Triangle, Plane>;
+
+constexpr ProductShot product_shot = {
+  PrimList<Sphere, Triangle, Plane>(
+    Sphere({0, 0.5, -2}, 0.5, Material({0, 0.8, 0.8}, true)),
+    Triangle({0.2, 0, -1}, {1.5, 0, -1}, {1, 1.5, -2}, {0, 1, 0}, Material({0.8, 0.8, 0.8}, false)),
+    Plane({0, 0, 0}, {0, 1, 0}, Material({0.8, 0.1, 0.1}, true))),
+  {10, 10, 10}
+};
+
+// The product shot with texture 0 on the ground, repeating every half unit, and on the sphere
+constexpr ProductShot textured_product_shot = {
+  PrimList<Sphere, Triangle, Plane>(
+    Sphere({0, 0.5, -2}, 0.5, Material({1, 1, 1}, true, 0, 1)),
+    Triangle({0.2, 0, -1}, {1.5, 0, -1}, {1, 1.5, -2}, {0, 1, 0}, Material({0.8, 0.8, 0.8}, false)),
+    Plane({0, 0, 0}, {0, 1, 0}, Material({1, 1, 1}, true, 0, 2))),
+  {10, 10, 10}
+};
+
+#endif
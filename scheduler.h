@@ -0,0 +1,224 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+// Prioritised task scheduler for mixing interactive previews with final
+// renders on the same cores. Each worker keeps a deque per priority class:
+// it takes its own newest task and, when it has none, steals the oldest from
+// another worker. Every worker looks for preview tasks everywhere before any
+// final ones, so with frames split into tile tasks a preview waits at most
+// for the tiles already running, and final tiles fill whatever time previews
+// leave idle. Tasks are submitted in groups that can be waited on and
+// cancelled; tasks of a cancelled group are dropped instead of run, so a
+// stale preview stops taking cores after its running tiles.
+//
+// The deques are guarded by a mutex each rather than lock-free, which costs
+// nothing measurable with tasks as large as tiles. A worker only takes the
+// shared mutex to sleep when every deque is empty.
+
+enum class TaskPriority {
+  Preview,
+  Final
+};
+
+const int task_priorities = 2;
+
+// Tasks waited on and cancelled together. Must outlive its tasks, i.e. be waited on before it is destroyed.
+class TaskGroup {
+  public:
+    TaskGroup() = default;
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    // Drops the group's tasks that haven't started, running ones finish
+    void cancel() {
+      cancelled_ = true;
+    }
+
+    bool cancelled() const {
+      return cancelled_;
+    }
+
+    // Blocks until every task has run or been dropped
+    void wait() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    // As wait(), giving up after ms
+    // returns true if every task has run or been dropped
+    bool wait_for(double ms) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      return done_.wait_for(lock, std::chrono::duration<double, std::milli>(ms), [this] { return pending_ == 0; });
+    }
+
+    // Tasks run and dropped so far
+    size_t completed() const {
+      return completed_;
+    }
+
+    size_t dropped() const {
+      return dropped_;
+    }
+
+  private:
+    friend class TaskScheduler;
+
+    void add(size_t count) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      pending_ += count;
+    }
+
+    // Counts one task as run or dropped, under the lock so a waiter can't destroy the group in between
+    void finish(bool ran) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++(ran ? completed_ : dropped_);
+      if (--pending_ == 0) {
+        done_.notify_all();
+      }
+    }
+
+    std::atomic<bool> cancelled_{false};
+    std::mutex mutex_;
+    std::condition_variable done_;
+    size_t pending_ = 0;
+    std::atomic<size_t> completed_{0}, dropped_{0};
+};
+
+class TaskScheduler {
+  public:
+    // threads - worker count, 0 for default_threads()
+    explicit TaskScheduler(unsigned threads = 0) {
+      const unsigned count = threads == 0 ? default_threads() : threads;
+      for (unsigned i = 0; i < count; ++i) {
+        workers_.emplace_back(new Worker);
+      }
+      for (unsigned i = 0; i < count; ++i) {
+        workers_[i]->thread = std::thread([this, i] { serve(i); });
+      }
+    }
+
+    // Runs every queued task, dropping those of cancelled groups, then stops the workers
+    ~TaskScheduler() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      work_ready_.notify_all();
+      for (std::unique_ptr<Worker> &worker : workers_) {
+        worker->thread.join();
+      }
+    }
+
+    TaskScheduler(const TaskScheduler &) = delete;
+    TaskScheduler &operator=(const TaskScheduler &) = delete;
+
+    // Queues count tasks calling f(i) for i in [0, count), spread over the workers
+    // f - called from the workers, must outlive the group's wait()
+    template <typename F>
+    void submit(TaskGroup &group, TaskPriority priority, size_t count, F &f) {
+      group.add(count);
+      const int p = static_cast<int>(priority);
+      const size_t first = next_worker_++;
+      // Counted before any push, so a worker that takes a task as soon as it's queued can't wrap the count below zero
+      queued_ += count;
+      for (size_t i = 0; i < count; ++i) {
+        Worker &worker = *workers_[(first + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.tasks[p].push_back({[](void *context, size_t index) { (*static_cast<F *>(context))(index); }, &f, i,
+                                   &group});
+      }
+      {
+        // Orders the count before a worker that saw none goes to sleep, so the wakeup isn't lost
+        std::lock_guard<std::mutex> lock(mutex_);
+      }
+      work_ready_.notify_all();
+    }
+
+    size_t threads() const {
+      return workers_.size();
+    }
+
+  private:
+    struct Task {
+      void (*run)(void *, size_t);
+      void *context;
+      size_t index;
+      TaskGroup *group;
+    };
+
+    struct Worker {
+      std::mutex mutex;
+      std::deque<Task> tasks[task_priorities];
+      std::thread thread;
+    };
+
+    // The most urgent task: own newest first, then the oldest stolen from another worker
+    bool take(size_t self, Task &task) {
+      for (int p = 0; p < task_priorities; ++p) {
+        for (size_t k = 0; k < workers_.size(); ++k) {
+          Worker &worker = *workers_[(self + k) % workers_.size()];
+          std::lock_guard<std::mutex> lock(worker.mutex);
+          std::deque<Task> &tasks = worker.tasks[p];
+          if (tasks.empty()) {
+            continue;
+          }
+          if (k == 0) {
+            task = tasks.back();
+            tasks.pop_back();
+          } else {
+            task = tasks.front();
+            tasks.pop_front();
+          }
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Worker: runs tasks until stopped with nothing queued
+    void serve(size_t self) {
+      for (;;) {
+        Task task;
+        if (!take(self, task)) {
+          {
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_ready_.wait(lock, [this] { return stop_ || queued_ > 0; });
+            if (queued_ == 0) {
+              return;
+            }
+          }
+          // Queued, though maybe taken by another worker that hasn't counted it yet
+          std::this_thread::yield();
+          continue;
+        }
+        --queued_;
+        const bool run = !task.group->cancelled();
+        if (run) {
+          task.run(task.context, task.index);
+        }
+        task.group->finish(run);
+      }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<size_t> next_worker_{0};
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    // Tasks in the deques
+    std::atomic<size_t> queued_{0};
+    bool stop_ = false;
+};
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef TEXTURE_H_
+#define TEXTURE_H_
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "vec3.h"
+
+// Image textures with bounded memory.
+// Textures are converted once from PPM into a tiled, mipmapped .tex file.
+// Only each file's header stays in memory; texels are read a tile at a time
+// with pread() the first time a lookup needs them, into one fixed-size tile
+// cache shared by every texture and thread. Lookups never take a lock: cache
+// slots are versioned (seqlock), and a reader that races with a slot being
+// replaced simply retries.
+
+// Texels per tile side
+const uint32_t texture_tile_size = 32;
+const uint32_t texture_tile_texels = texture_tile_size * texture_tile_size;
+
+// Header of a .tex file, followed by each level's tiles in row-major order, level 0 first
+struct TextureHeader {
+  char magic[4];
+  uint32_t width;
+  uint32_t height;
+  uint32_t levels;
+};
+
+// Size and file position of one mip level
+struct TextureLevel {
+  uint32_t width;
+  uint32_t height;
+  uint32_t tiles_x;
+  uint32_t tiles_y;
+  uint64_t offset;
+};
+
+// Lays out the mip chain of a width x height texture
+// returns levels down to 1x1, each with its tiles' offset in the file
+inline std::vector<TextureLevel> texture_levels(uint32_t width, uint32_t height) {
+  std::vector<TextureLevel> levels;
+  uint64_t offset = sizeof(TextureHeader);
+  for (;;) {
+    TextureLevel level;
+    level.width = width;
+    level.height = height;
+    level.tiles_x = (width + texture_tile_size - 1) / texture_tile_size;
+    level.tiles_y = (height + texture_tile_size - 1) / texture_tile_size;
+    level.offset = offset;
+    levels.push_back(level);
+    offset += uint64_t(level.tiles_x) * level.tiles_y * texture_tile_texels * 4;
+    if (width == 1 && height == 1) {
+      return levels;
+    }
+    width = std::max(1u, width / 2);
+    height = std::max(1u, height / 2);
+  }
+}
+
+// Converts a binary PPM (P6, 8 bit) into a tiled, mipmapped .tex file
+// Texels are packed as 0x00BBGGRR; levels are 2x2 box filtered
+// returns false if the input can't be read or the output written
+inline bool convert_ppm_to_tex(const std::string &ppm_path, const std::string &tex_path) {
+  FILE *in = std::fopen(ppm_path.c_str(), "rb");
+  if (!in) {
+    return false;
+  }
+  unsigned width = 0, height = 0, maxval = 0;
+  bool ok = std::fscanf(in, "P6 %u %u %u", &width, &height, &maxval) == 3 && maxval == 255 && width > 0 && height > 0;
+  std::vector<uint32_t> texels(size_t(width) * height);
+  if (ok) {
+    std::fgetc(in);
+    std::vector<unsigned char> rgb(texels.size() * 3);
+    ok = std::fread(rgb.data(), 1, rgb.size(), in) == rgb.size();
+    for (size_t i = 0; ok && i < texels.size(); ++i) {
+      texels[i] = rgb[i * 3] | (rgb[i * 3 + 1] << 8) | (rgb[i * 3 + 2] << 16);
+    }
+  }
+  std::fclose(in);
+  if (!ok) {
+    return false;
+  }
+
+  FILE *out = std::fopen(tex_path.c_str(), "wb");
+  if (!out) {
+    return false;
+  }
+  std::vector<TextureLevel> levels = texture_levels(width, height);
+  TextureHeader header = {{'T', 'E', 'X', 'M'}, width, height, static_cast<uint32_t>(levels.size())};
+  ok = std::fwrite(&header, sizeof(header), 1, out) == 1;
+
+  std::vector<uint32_t> tile(texture_tile_texels);
+  for (size_t l = 0; ok && l < levels.size(); ++l) {
+    const TextureLevel &level = levels[l];
+    if (l > 0) {
+      // Box filter the previous level, clamping at odd edges
+      const TextureLevel &prev = levels[l - 1];
+      std::vector<uint32_t> smaller(size_t(level.width) * level.height);
+      for (uint32_t y = 0; y < level.height; ++y) {
+        for (uint32_t x = 0; x < level.width; ++x) {
+          uint32_t sum[3] = {};
+          for (uint32_t k = 0; k < 4; ++k) {
+            uint32_t sx = std::min(prev.width - 1, x * 2 + (k & 1));
+            uint32_t sy = std::min(prev.height - 1, y * 2 + (k >> 1));
+            uint32_t t = texels[size_t(sy) * prev.width + sx];
+            for (int ch = 0; ch < 3; ++ch) {
+              sum[ch] += (t >> (8 * ch)) & 0xff;
+            }
+          }
+          smaller[size_t(y) * level.width + x] = ((sum[0] + 2) / 4) | (((sum[1] + 2) / 4) << 8) | (((sum[2] + 2) / 4) << 16);
+        }
+      }
+      texels.swap(smaller);
+    }
+
+    // Tiles past the right and bottom edges repeat the edge texels
+    for (uint32_t ty = 0; ok && ty < level.tiles_y; ++ty) {
+      for (uint32_t tx = 0; ok && tx < level.tiles_x; ++tx) {
+        for (uint32_t y = 0; y < texture_tile_size; ++y) {
+          for (uint32_t x = 0; x < texture_tile_size; ++x) {
+            uint32_t sx = std::min(level.width - 1, tx * texture_tile_size + x);
+            uint32_t sy = std::min(level.height - 1, ty * texture_tile_size + y);
+            tile[y * texture_tile_size + x] = texels[size_t(sy) * level.width + sx];
+          }
+        }
+        ok = std::fwrite(tile.data(), 4, tile.size(), out) == tile.size();
+      }
+    }
+  }
+  return std::fclose(out) == 0 && ok;
+}
+
+// Texel lookups made by each thread. Counted per thread so the lookup path
+// writes no cache line that other threads write too; total() sums them.
+class LookupCount {
+  public:
+    LookupCount() {
+      std::lock_guard<std::mutex> lock(totals().mutex);
+      totals().live.push_back(this);
+    }
+
+    ~LookupCount() {
+      std::lock_guard<std::mutex> lock(totals().mutex);
+      totals().finished += count_;
+      std::vector<LookupCount *> &live = totals().live;
+      live.erase(std::find(live.begin(), live.end(), this));
+    }
+
+    LookupCount(const LookupCount &) = delete;
+    LookupCount &operator=(const LookupCount &) = delete;
+
+    void add() {
+      ++count_;
+    }
+
+    // Lookups of every thread so far, read while no other thread is sampling
+    static uint64_t total() {
+      std::lock_guard<std::mutex> lock(totals().mutex);
+      uint64_t sum = totals().finished;
+      for (const LookupCount *count : totals().live) {
+        sum += count->count_;
+      }
+      return sum;
+    }
+
+  private:
+    // Counts of finished threads, and the counters of running ones
+    struct Totals {
+      std::mutex mutex;
+      uint64_t finished = 0;
+      std::vector<LookupCount *> live;
+    };
+
+    // Never destroyed, pool workers' counts merge into it as the pool shuts down at exit
+    static Totals &totals() {
+      static Totals *t = new Totals;
+      return *t;
+    }
+
+    uint64_t count_ = 0;
+};
+
+// This thread's lookup count
+inline LookupCount &lookup_count() {
+  thread_local LookupCount count;
+  return count;
+}
+
+// Fixed-size, set-associative cache of texture tiles shared by all threads
+class TileCache {
+  public:
+    static const uint32_t ways = 4;
+
+    struct Stats {
+      uint64_t lookups;
+      uint64_t misses;
+    };
+
+    // bytes - memory budget for tile data, at least one set is always kept
+    explicit TileCache(size_t bytes) : lookups_base_(LookupCount::total()) {
+      sets_ = std::max<size_t>(1, bytes / (sizeof(Slot) * ways));
+      slots_.reset(new Slot[sets_ * ways]);
+      clocks_.reset(new std::atomic<uint32_t>[sets_]);
+      for (size_t i = 0; i < sets_; ++i) {
+        clocks_[i].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    size_t capacity_bytes() const {
+      return sets_ * ways * sizeof(Slot);
+    }
+
+    // Looks up one texel of a cached tile
+    // key - identifies the tile, never 0
+    // texel - index within the tile
+    // returns false on a miss, texel is then untouched
+    bool lookup(uint64_t key, uint32_t index, uint32_t *texel) {
+      lookup_count().add();
+      Slot *set = &slots_[set_of(key) * ways];
+      for (uint32_t w = 0; w < ways; ++w) {
+        Slot &slot = set[w];
+        // Retry while the slot holds our key but is being rewritten under us
+        for (;;) {
+          uint32_t version = slot.version.load(std::memory_order_acquire);
+          if (slot.key.load(std::memory_order_relaxed) != key) {
+            break;
+          }
+          if (version & 1) {
+            continue;
+          }
+          uint32_t value = slot.texels[index].load(std::memory_order_relaxed);
+          std::atomic_thread_fence(std::memory_order_acquire);
+          if (slot.version.load(std::memory_order_relaxed) == version) {
+            *texel = value;
+            return true;
+          }
+        }
+      }
+      misses_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    // Installs a tile, evicting the set's slots in round-robin order
+    // texels - texture_tile_texels packed texels
+    void insert(uint64_t key, const uint32_t *texels) {
+      size_t set = set_of(key);
+      Slot &slot = slots_[set * ways + clocks_[set].fetch_add(1, std::memory_order_relaxed) % ways];
+
+      while (slot.writing.test_and_set(std::memory_order_acquire)) {
+      }
+      uint32_t version = slot.version.load(std::memory_order_relaxed);
+      slot.version.store(version + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      slot.key.store(key, std::memory_order_relaxed);
+      for (uint32_t i = 0; i < texture_tile_texels; ++i) {
+        slot.texels[i].store(texels[i], std::memory_order_relaxed);
+      }
+      slot.version.store(version + 2, std::memory_order_release);
+      slot.writing.clear(std::memory_order_release);
+    }
+
+    Stats stats() const {
+      return {LookupCount::total() - lookups_base_, misses_.load()};
+    }
+
+  private:
+    struct Slot {
+      // Odd while the slot is being rewritten
+      std::atomic<uint32_t> version{0};
+      std::atomic<uint64_t> key{0};
+      std::atomic_flag writing = ATOMIC_FLAG_INIT;
+      std::atomic<uint32_t> texels[texture_tile_texels];
+    };
+
+    size_t set_of(uint64_t key) const {
+      key ^= key >> 33;
+      key *= 0xff51afd7ed558ccdULL;
+      key ^= key >> 33;
+      return key % sets_;
+    }
+
+    size_t sets_;
+    std::unique_ptr<Slot[]> slots_;
+    std::unique_ptr<std::atomic<uint32_t>[]> clocks_;
+    // Lookups counted before this cache existed
+    uint64_t lookups_base_;
+    // Misses go on to load a tile, so a shared counter costs little there
+    std::atomic<uint64_t> misses_{0};
+};
+
+// Registry of textures and the cache their tiles share
+class TextureSystem {
+  public:
+    // Default tile cache budget
+    static const size_t default_cache_bytes = 16 << 20;
+
+    TextureSystem() : cache_(new TileCache(default_cache_bytes)) {}
+
+    ~TextureSystem() {
+      for (const File &f : files_) {
+        close(f.fd);
+      }
+    }
+
+    // Replaces the tile cache, must not run while textures are being sampled
+    void set_cache_bytes(size_t bytes) {
+      cache_.reset(new TileCache(bytes));
+    }
+
+    // Opens a texture, converting a .ppm to a .tex next to it on first use
+    // returns the texture id used by Material, -1 on failure
+    int add(const std::string &path) {
+      std::string tex_path = path;
+      if (path.size() < 4 || path.compare(path.size() - 4, 4, ".tex") != 0) {
+        tex_path = path + ".tex";
+        if (access(tex_path.c_str(), R_OK) != 0 && !convert_ppm_to_tex(path, tex_path)) {
+          return -1;
+        }
+      }
+
+      File f;
+      f.fd = open(tex_path.c_str(), O_RDONLY);
+      TextureHeader header;
+      if (f.fd < 0 || pread(f.fd, &header, sizeof(header), 0) != sizeof(header) ||
+          std::memcmp(header.magic, "TEXM", 4) != 0) {
+        if (f.fd >= 0) {
+          close(f.fd);
+        }
+        return -1;
+      }
+      f.levels = texture_levels(header.width, header.height);
+      files_.push_back(f);
+      return static_cast<int>(files_.size()) - 1;
+    }
+
+    // Trilinearly filtered lookup with repeat wrapping
+    // texture - id from add()
+    // u/v - texture coordinates, 1 spans the texture once
+    // footprint - width of the ray footprint in the same units
+    color sample(int texture, double u, double v, double footprint) {
+      const File &f = files_[texture];
+      double texels = footprint * std::max(f.levels[0].width, f.levels[0].height);
+      double lod = std::log2(std::max(texels, 1.0));
+      lod = std::min(lod, static_cast<double>(f.levels.size() - 1));
+      uint32_t level = static_cast<uint32_t>(lod);
+      double blend = lod - level;
+
+      color result = bilinear(texture, level, u, v);
+      if (blend > 0 && level + 1 < f.levels.size()) {
+        result = (1 - blend) * result + blend * bilinear(texture, level + 1, u, v);
+      }
+      return result;
+    }
+
+    TileCache::Stats cache_stats() const {
+      return cache_->stats();
+    }
+
+    size_t cache_bytes() const {
+      return cache_->capacity_bytes();
+    }
+
+  private:
+    struct File {
+      int fd;
+      std::vector<TextureLevel> levels;
+    };
+
+    color bilinear(int texture, uint32_t level, double u, double v) {
+      const TextureLevel &l = files_[texture].levels[level];
+      double x = (u - std::floor(u)) * l.width - 0.5;
+      double y = (v - std::floor(v)) * l.height - 0.5;
+      double fx = std::floor(x), fy = std::floor(y);
+      double wx = x - fx, wy = y - fy;
+      long x0 = static_cast<long>(fx), y0 = static_cast<long>(fy);
+
+      color result = {};
+      for (int k = 0; k < 4; ++k) {
+        long tx = x0 + (k & 1), ty = y0 + (k >> 1);
+        // Repeat wrap
+        tx = ((tx % l.width) + l.width) % l.width;
+        ty = ((ty % l.height) + l.height) % l.height;
+        uint32_t t = texel(texture, level, static_cast<uint32_t>(tx), static_cast<uint32_t>(ty));
+        double w = ((k & 1) ? wx : 1 - wx) * ((k >> 1) ? wy : 1 - wy);
+        result += w * color(t & 0xff, (t >> 8) & 0xff, (t >> 16) & 0xff);
+      }
+      return result / 255;
+    }
+
+    // Fetches one texel through the cache, reading its tile from disk on a miss
+    uint32_t texel(int texture, uint32_t level, uint32_t x, uint32_t y) {
+      const File &f = files_[texture];
+      const TextureLevel &l = f.levels[level];
+      uint32_t tx = x / texture_tile_size, ty = y / texture_tile_size;
+      uint32_t index = (y % texture_tile_size) * texture_tile_size + x % texture_tile_size;
+      // 16 bits of texture, 8 of level, 20 of each tile coordinate, +1 so no key is 0
+      uint64_t key = ((uint64_t(texture) << 48) | (uint64_t(level) << 40) | (uint64_t(ty) << 20) | tx) + 1;
+
+      uint32_t value;
+      if (cache_->lookup(key, index, &value)) {
+        return value;
+      }
+
+      static thread_local std::vector<uint32_t> tile(texture_tile_texels);
+      uint64_t offset = l.offset + (uint64_t(ty) * l.tiles_x + tx) * texture_tile_texels * 4;
+      ssize_t bytes = texture_tile_texels * 4;
+      if (pread(f.fd, tile.data(), bytes, offset) != bytes) {
+        std::fill(tile.begin(), tile.end(), 0);
+      }
+      cache_->insert(key, tile.data());
+      return tile[index];
+    }
+
+    std::vector<File> files_;
+    std::unique_ptr<TileCache> cache_;
+};
+
+// Textures used by scene materials
+inline TextureSystem &texture_system() {
+  static TextureSystem system;
+  return system;
+}
+
+#endif
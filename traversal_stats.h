@@ -0,0 +1,75 @@
+#ifndef TRAVERSAL_STATS_H_
+#define TRAVERSAL_STATS_H_
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Counts of acceleration structure walks, for tuning splits and spotting
+// degenerate geometry. Traversals take the counter as a template parameter,
+// so the usual NoTraversalStats compiles to nothing.
+
+struct TraversalStats {
+  // BVH nodes or grid cells visited
+  uint64_t nodes = 0;
+  // Primitives intersected
+  uint64_t prims = 0;
+  // Deepest the BVH's traversal stack got, grids walk without one
+  uint32_t depth = 0;
+
+  void node() {
+    ++nodes;
+  }
+
+  void prim() {
+    ++prims;
+  }
+
+  void stack(int size) {
+    depth = std::max(depth, static_cast<uint32_t>(size));
+  }
+};
+
+struct NoTraversalStats {
+  void node() {}
+  void prim() {}
+  void stack(int) {}
+};
+
+// Closest hit and occlusion queries counted apart
+struct TraversalCounts {
+  TraversalStats closest, any;
+};
+
+// This thread's counts
+inline TraversalCounts &traversal_counts() {
+  thread_local TraversalCounts counts;
+  return counts;
+}
+
+// Prints a histogram of values with power of two buckets: 0, 1, 2-3, 4-7 and so on
+inline void print_histogram(const std::string &name, const std::vector<uint64_t> &values) {
+  std::vector<size_t> buckets;
+  uint64_t total = 0;
+  for (uint64_t v : values) {
+    size_t bucket = 0;
+    while (v >> bucket) {
+      ++bucket;
+    }
+    buckets.resize(std::max(buckets.size(), bucket + 1));
+    ++buckets[bucket];
+    total += v;
+  }
+  std::cout << name << ": mean " << (values.empty() ? 0.0 : static_cast<double>(total) / values.size()) << std::endl;
+  const size_t most = buckets.empty() ? 1 : *std::max_element(buckets.begin(), buckets.end());
+  for (size_t b = 0; b < buckets.size(); ++b) {
+    uint64_t lo = b == 0 ? 0 : uint64_t(1) << (b - 1), hi = b == 0 ? 0 : (uint64_t(1) << b) - 1;
+    std::string range = lo == hi ? std::to_string(lo) : std::to_string(lo) + "-" + std::to_string(hi);
+    std::cout << "  " << std::string(std::max<int>(0, 12 - static_cast<int>(range.size())), ' ') << range << " "
+              << std::string(buckets[b] * 50 / most, '#') << " " << buckets[b] << std::endl;
+  }
+}
+
+#endif
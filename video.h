@@ -0,0 +1,203 @@
+#ifndef VIDEO_H_
+#define VIDEO_H_
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vec3.h"
+#include "output.h"
+
+// Streams rendered frames as raw video to a file, a named pipe or stdout, for
+// an encoder such as ffmpeg to read. The renderer and the colour conversion
+// overlap: finished frames go into a bounded queue that a pipeline thread
+// drains, converting and writing them while the next frame renders. Frame
+// buffers are recycled, so the renderer only waits if the encoder falls a
+// whole queue behind.
+
+enum class VideoFormat {
+  // YUV4MPEG2, 4:2:0 BT.601 limited range, what ffmpeg and x264 read without options
+  Y4m,
+  // Packed 8 bit RGB with no header: ffmpeg -f rawvideo -pix_fmt rgb24 -s WxH -i -
+  Rgb
+};
+
+// Converts 8 bit RGB to the planes of a 4:2:0 Y4M frame, chroma from the
+// average of each 2x2 block
+// out - output, Y plane then Cb then Cr
+inline void rgb_to_yuv420(const uint8_t *rgb, size_t width, size_t height, std::vector<uint8_t> &out) {
+  const size_t chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+  out.resize(width * height + 2 * chroma_width * chroma_height);
+  uint8_t *y_plane = out.data();
+  uint8_t *cb_plane = y_plane + width * height;
+  uint8_t *cr_plane = cb_plane + chroma_width * chroma_height;
+
+  for (size_t i = 0; i < width * height; ++i) {
+    const uint8_t *p = rgb + i * 3;
+    y_plane[i] = static_cast<uint8_t>(((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16);
+  }
+  for (size_t cy = 0; cy < chroma_height; ++cy) {
+    for (size_t cx = 0; cx < chroma_width; ++cx) {
+      // Odd sizes repeat the last row or column
+      int sum[3] = {0, 0, 0};
+      for (size_t k = 0; k < 4; ++k) {
+        size_t y = std::min(cy * 2 + k / 2, height - 1), x = std::min(cx * 2 + k % 2, width - 1);
+        const uint8_t *p = rgb + (y * width + x) * 3;
+        sum[0] += p[0];
+        sum[1] += p[1];
+        sum[2] += p[2];
+      }
+      int r = (sum[0] + 2) / 4, g = (sum[1] + 2) / 4, b = (sum[2] + 2) / 4;
+      cb_plane[cy * chroma_width + cx] = static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+      cr_plane[cy * chroma_width + cx] = static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+  }
+}
+
+class VideoStream {
+  public:
+    // file - open for writing, the caller closes it after finish()
+    // fps - frames per second written to the Y4M header
+    // settings - output stage the frames go through, conversion is single threaded
+    // depth - frames the queue holds before the renderer has to wait
+    VideoStream(FILE *file, size_t width, size_t height, int fps, VideoFormat format, const OutputSettings &settings,
+                size_t depth = 4)
+        : file_(file), width_(width), height_(height), format_(format), settings_(settings),
+          buffers_(depth, std::vector<color>(width * height)) {
+      settings_.threads = 1;
+      for (size_t i = 0; i < depth; ++i) {
+        free_.push_back(i);
+      }
+      if (format_ == VideoFormat::Y4m) {
+        std::fprintf(file_, "YUV4MPEG2 W%zu H%zu F%d:1 Ip A1:1 C420jpeg\n", width_, height_, fps);
+      }
+      thread_ = std::thread([this] { convert(); });
+    }
+
+    ~VideoStream() {
+      finish();
+    }
+
+    VideoStream(const VideoStream &) = delete;
+    VideoStream &operator=(const VideoStream &) = delete;
+
+    // Frame buffer to render the next frame into, waiting only while every buffer is queued
+    std::vector<color> &acquire() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      free_ready_.wait(lock, [this] { return !free_.empty(); });
+      current_ = free_.front();
+      free_.pop_front();
+      return buffers_[current_];
+    }
+
+    // Queues the buffer from the last acquire() for conversion and writing
+    void submit() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_.push_back(current_);
+      }
+      queued_ready_.notify_one();
+    }
+
+    // Writes every queued frame and stops the pipeline thread
+    // returns false if any write failed
+    bool finish() {
+      if (thread_.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          done_ = true;
+        }
+        queued_ready_.notify_one();
+        thread_.join();
+        std::fflush(file_);
+      }
+      return ok_;
+    }
+
+    size_t frames() const {
+      return frames_;
+    }
+
+  private:
+    // Pipeline thread: converts and writes queued frames in order
+    void convert() {
+      std::vector<char> rgb;
+      std::vector<uint8_t> yuv;
+      for (;;) {
+        size_t index;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          queued_ready_.wait(lock, [this] { return done_ || !queued_.empty(); });
+          if (queued_.empty()) {
+            return;
+          }
+          index = queued_.front();
+          queued_.pop_front();
+        }
+
+        encode_8bit(buffers_[index], width_, settings_, rgb);
+        {
+          // The buffer is free again once encoded, before the slower write
+          std::lock_guard<std::mutex> lock(mutex_);
+          free_.push_back(index);
+        }
+        free_ready_.notify_one();
+
+        if (format_ == VideoFormat::Y4m) {
+          rgb_to_yuv420(reinterpret_cast<const uint8_t *>(rgb.data()), width_, height_, yuv);
+          ok_ = std::fputs("FRAME\n", file_) >= 0 && std::fwrite(yuv.data(), 1, yuv.size(), file_) == yuv.size() && ok_;
+        } else {
+          ok_ = std::fwrite(rgb.data(), 1, rgb.size(), file_) == rgb.size() && ok_;
+        }
+        ++frames_;
+      }
+    }
+
+    FILE *file_;
+    size_t width_, height_;
+    VideoFormat format_;
+    OutputSettings settings_;
+    std::vector<std::vector<color>> buffers_;
+    // Buffer indices free for rendering and waiting for conversion
+    std::deque<size_t> free_, queued_;
+    size_t current_ = 0;
+    bool done_ = false;
+    bool ok_ = true;
+    size_t frames_ = 0;
+    std::mutex mutex_;
+    std::condition_variable free_ready_, queued_ready_;
+    std::thread thread_;
+};
+
+// Counts the frames of a Y4M file as VideoStream writes them: the header line
+// for width x height, then FRAME lines each followed by exactly one 4:2:0 frame
+// returns the frame count, -1 if anything else is in the file
+inline int count_y4m_frames(const char *path, size_t width, size_t height) {
+  FILE *file = std::fopen(path, "rb");
+  if (file == nullptr) {
+    return -1;
+  }
+  char line[128];
+  size_t w = 0, h = 0;
+  int frames = std::fgets(line, sizeof(line), file) != nullptr &&
+               std::sscanf(line, "YUV4MPEG2 W%zu H%zu ", &w, &h) == 2 && w == width && h == height ? 0 : -1;
+  const size_t frame_size = width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+  std::vector<uint8_t> frame(frame_size);
+  while (frames >= 0 && std::fgets(line, sizeof(line), file) != nullptr) {
+    if (std::string(line) != "FRAME\n" || std::fread(frame.data(), 1, frame_size, file) != frame_size) {
+      frames = -1;
+    } else {
+      ++frames;
+    }
+  }
+  std::fclose(file);
+  return frames;
+}
+
+#endif
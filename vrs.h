@@ -0,0 +1,162 @@
+#ifndef VRS_H_
+#define VRS_H_
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#include "vec3.h"
+#include "camera.h"
+#include "kernel.h"
+#include "sampler.h"
+#include "parallel.h"
+#include "arena.h"
+
+// Variable-rate shading for the realtime viewer. The image is split into
+// 4x4 blocks and one ray is first shaded at every block corner. Each block
+// then picks its rate from those corners and its distance to a focus point:
+// flat blocks far from the focus keep the corners and interpolate the rest,
+// blocks with some contrast shade one ray per 2x2, and blocks across an edge
+// or near the focus shade every pixel, supersampled around the focus. Detail
+// smaller than a block that touches none of its corners can be missed in
+// the periphery, which is the trade for the rays saved there.
+
+// Side of a shading-rate block in pixels, a power of two
+const size_t vrs_block_size = 4;
+
+struct VrsSettings {
+  // Focus point in pixels, e.g. the mouse position
+  double focus_x = 0;
+  double focus_y = 0;
+  // Blocks within this many pixels of the focus shade every pixel, within twice it at least every 2x2
+  double full_radius = 64;
+  // Luminance range across a block's corners above which it shades every 2x2, and every pixel
+  double half_contrast = 0.02;
+  double full_contrast = 0.1;
+  // Multi jitter samples per side for pixels within full_radius
+  size_t focus_samples = 2;
+  // Worker count, 0 for default_threads()
+  unsigned threads = 0;
+};
+
+struct VrsStats {
+  // Primary rays shaded
+  size_t rays = 0;
+  // Blocks at full, 2x2 and 4x4 rate
+  size_t blocks[3] = {0, 0, 0};
+};
+
+inline double luminance(const color &c) {
+  return 0.2126 * std::min(c.x(), 1.0) + 0.7152 * std::min(c.y(), 1.0) + 0.0722 * std::min(c.z(), 1.0);
+}
+
+// Renders the image at variable rate
+// image - output, height * width linear colors
+// det - seeds the focus area's jitter, det.enabled is ignored
+template <typename Proj, typename Scene>
+VrsStats render_vrs(color *image, const Scene &scene, const Camera &cam, size_t width, size_t height,
+                    const VrsSettings &settings, const Determinism &det) {
+  const size_t block = vrs_block_size;
+  const size_t blocks_x = (width + block - 1) / block, blocks_y = (height + block - 1) / block;
+  auto shade_at = [&](size_t x, size_t y) {
+    return shade(scene, Proj::generate(cam, (y + 0.5) / height, (x + 0.5) / width));
+  };
+
+  // Block corners, the far ones clamped to the last row and column
+  ArenaScope scope;
+  color *corners = thread_arena().allocate<color>((blocks_x + 1) * (blocks_y + 1));
+  parallel_for(blocks_y + 1, settings.threads, [&](size_t by) {
+    for (size_t bx = 0; bx <= blocks_x; ++bx) {
+      corners[by * (blocks_x + 1) + bx] = shade_at(std::min(bx * block, width - 1), std::min(by * block, height - 1));
+    }
+  });
+
+  VrsStats *row_stats = thread_arena().make<VrsStats>(blocks_y);
+  parallel_for(blocks_y, settings.threads, [&](size_t by) {
+    ArenaScope row_scope;
+    const size_t n = settings.focus_samples;
+    Sample *samples = thread_arena().allocate<Sample>(n * n);
+    // Shaded points of a block at 2x2 or 4x4 rate, including its far edges
+    color lattice[vrs_block_size / 2 + 1][vrs_block_size / 2 + 1];
+    size_t lx[vrs_block_size / 2 + 1], ly[vrs_block_size / 2 + 1];
+    VrsStats &stats = row_stats[by];
+
+    for (size_t bx = 0; bx < blocks_x; ++bx) {
+      const size_t x0 = bx * block, y0 = by * block;
+      const size_t x_end = std::min(x0 + block, width), y_end = std::min(y0 + block, height);
+      const color *c[4] = {&corners[by * (blocks_x + 1) + bx], &corners[by * (blocks_x + 1) + bx + 1],
+                           &corners[(by + 1) * (blocks_x + 1) + bx], &corners[(by + 1) * (blocks_x + 1) + bx + 1]};
+      double lo = luminance(*c[0]), hi = lo;
+      for (int k = 1; k < 4; ++k) {
+        lo = std::min(lo, luminance(*c[k]));
+        hi = std::max(hi, luminance(*c[k]));
+      }
+      double dx = x0 + block * 0.5 - settings.focus_x, dy = y0 + block * 0.5 - settings.focus_y;
+      double distance = std::sqrt(dx * dx + dy * dy);
+
+      bool focus = distance < settings.full_radius;
+      if (focus || hi - lo > settings.full_contrast) {
+        ++stats.blocks[0];
+        for (size_t y = y0; y < y_end; ++y) {
+          for (size_t x = x0; x < x_end; ++x) {
+            if (!focus || n <= 1) {
+              image[y * width + x] = shade_at(x, y);
+              ++stats.rays;
+              continue;
+            }
+            multi_jitter(samples, n, det, y * width + x);
+            image[y * width + x] = render_pixel<Proj>(scene, cam, samples, n, y, x, width, height);
+            stats.rays += n * n;
+          }
+        }
+        continue;
+      }
+
+      const bool half = distance < 2 * settings.full_radius || hi - lo > settings.half_contrast;
+      const size_t step = half ? 2 : block;
+      const size_t points = block / step + 1;
+      ++stats.blocks[half ? 1 : 2];
+      for (size_t k = 0; k < points; ++k) {
+        lx[k] = std::min(x0 + k * step, width - 1);
+        ly[k] = std::min(y0 + k * step, height - 1);
+      }
+      for (size_t j = 0; j < points; ++j) {
+        for (size_t i = 0; i < points; ++i) {
+          bool corner = (i == 0 || i == points - 1) && (j == 0 || j == points - 1);
+          if (corner) {
+            lattice[j][i] = *c[(j == 0 ? 0 : 2) + (i == 0 ? 0 : 1)];
+          } else {
+            lattice[j][i] = shade_at(lx[i], ly[j]);
+            ++stats.rays;
+          }
+        }
+      }
+
+      // Bilinear between the shaded points around each pixel
+      for (size_t y = y0; y < y_end; ++y) {
+        size_t j = std::min((y - y0) / step, points - 2);
+        double fy = ly[j + 1] > ly[j] ? static_cast<double>(y - ly[j]) / (ly[j + 1] - ly[j]) : 0;
+        for (size_t x = x0; x < x_end; ++x) {
+          size_t i = std::min((x - x0) / step, points - 2);
+          double fx = lx[i + 1] > lx[i] ? static_cast<double>(x - lx[i]) / (lx[i + 1] - lx[i]) : 0;
+          color top = (1 - fx) * lattice[j][i] + fx * lattice[j][i + 1];
+          color bottom = (1 - fx) * lattice[j + 1][i] + fx * lattice[j + 1][i + 1];
+          image[y * width + x] = (1 - fy) * top + fy * bottom;
+        }
+      }
+    }
+  });
+
+  VrsStats total;
+  total.rays = (blocks_x + 1) * (blocks_y + 1);
+  for (size_t by = 0; by < blocks_y; ++by) {
+    const VrsStats &row = row_stats[by];
+    total.rays += row.rays;
+    for (int k = 0; k < 3; ++k) {
+      total.blocks[k] += row.blocks[k];
+    }
+  }
+  return total;
+}
+
+#endif
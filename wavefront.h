@@ -0,0 +1,338 @@
+#ifndef WAVEFRONT_H_
+#define WAVEFRONT_H_
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "vec3.h"
+#include "ray.h"
+#include "scene.h"
+#include "camera.h"
+#include "sampler.h"
+#include "arena.h"
+#include "light.h"
+
+// Wavefront (stream) renderer. Instead of following one sample at a time
+// through shoot_ray, every camera ray of a tile is generated into SoA
+// queues and each stage (intersect, shade, shadow, accumulate) runs as its
+// own loop over the whole queue. Primitive tests are streamed one primitive
+// at a time over all rays, so the inner loops are branch-light and vectorisable.
+
+// Rows per tile. Tiles are full-width bands so jitter is still drawn in
+// row-major pixel order, keeping the image identical to the recursive path.
+const size_t wavefront_tile_rows = 4;
+
+// Struct-of-arrays batch of rays
+struct RayQueue {
+  std::vector<double> ox, oy, oz;
+  std::vector<double> dx, dy, dz;
+  // Unit direction, copied from the ray's precomputed one
+  std::vector<double> ux, uy, uz;
+  // Ray cone, see Ray
+  std::vector<double> cone_width, cone_spread;
+  // Range of t where hits count, see Ray
+  std::vector<double> t_min, t_max;
+  size_t size = 0;
+
+  void reserve(size_t n) {
+    for (std::vector<double> *v :
+         {&ox, &oy, &oz, &dx, &dy, &dz, &ux, &uy, &uz, &cone_width, &cone_spread, &t_min, &t_max}) {
+      v->resize(n);
+    }
+  }
+
+  void push(const Ray &r) {
+    ox[size] = r.origin.e[0];
+    oy[size] = r.origin.e[1];
+    oz[size] = r.origin.e[2];
+    dx[size] = r.direction.e[0];
+    dy[size] = r.direction.e[1];
+    dz[size] = r.direction.e[2];
+    ux[size] = r.unit_direction.e[0];
+    uy[size] = r.unit_direction.e[1];
+    uz[size] = r.unit_direction.e[2];
+    cone_width[size] = r.cone_width;
+    cone_spread[size] = r.cone_spread;
+    t_min[size] = r.t_min;
+    t_max[size] = r.t_max;
+    ++size;
+  }
+
+  Ray get(size_t i) const {
+    Ray r({ox[i], oy[i], oz[i]}, {dx[i], dy[i], dz[i]}, cone_width[i], cone_spread[i]);
+    r.t_min = t_min[i];
+    r.t_max = t_max[i];
+    return r;
+  }
+};
+
+// Writes t of each ray's hit with one primitive to t_out, -1 if missed
+// Generic version, used for primitives without a dedicated stream kernel
+template <typename P>
+void intersect_stream(const P &prim, const RayQueue &q, double *t_out) {
+  for (size_t i = 0; i < q.size; ++i) {
+    t_out[i] = prim.intersect(q.get(i));
+  }
+}
+
+// Sphere stream kernel, the same arithmetic as hit_sphere with its early
+// outs and swaps turned into selects so the loop has no branches
+inline void intersect_stream(const Sphere &s, const RayQueue &q, double *t_out) {
+  const double r2 = s.radius * s.radius;
+  const double *ox = q.ox.data(), *oy = q.oy.data(), *oz = q.oz.data();
+  const double *dx = q.dx.data(), *dy = q.dy.data(), *dz = q.dz.data();
+  const double *ux = q.ux.data(), *uy = q.uy.data(), *uz = q.uz.data();
+
+  for (size_t i = 0; i < q.size; ++i) {
+    double a = dx[i] * dx[i] + dy[i] * dy[i] + dz[i] * dz[i];
+    double fx = ox[i] - s.center.e[0], fy = oy[i] - s.center.e[1], fz = oz[i] - s.center.e[2];
+    double b = 2 * (fx * dx[i] + fy * dy[i] + fz * dz[i]);
+    double c = (fx * fx + fy * fy + fz * fz) - r2;
+
+    double fu = fx * ux[i] + fy * uy[i] + fz * uz[i];
+    double px = fx - fu * ux[i], py = fy - fu * uy[i], pz = fz - fu * uz[i];
+    double disc = 4 * a * (r2 - (px * px + py * py + pz * pz));
+
+    double qq = -0.5 * (b + (b >= 0 ? 1 : -1) * std::sqrt(disc));
+    double t0 = c / qq;
+    double t1 = qq / a;
+
+    // Order them, then prefer the far one if the near one is behind
+    double lo = t1 < t0 ? t1 : t0;
+    double hi = t1 < t0 ? t0 : t1;
+    double first = lo < 0 ? hi : lo;
+    bool miss = disc < 0 || first < 0;
+    t_out[i] = miss ? -1 : first;
+  }
+}
+
+inline void intersect_stream(const Plane &p, const RayQueue &q, double *t_out) {
+  const double *ox = q.ox.data(), *oy = q.oy.data(), *oz = q.oz.data();
+  const double *dx = q.dx.data(), *dy = q.dy.data(), *dz = q.dz.data();
+  const vec3 &n = p.normal;
+
+  for (size_t i = 0; i < q.size; ++i) {
+    double denominator = dx[i] * n.e[0] + dy[i] * n.e[1] + dz[i] * n.e[2];
+    denominator = denominator == 0.0 ? 0.0000001 : denominator;
+    double ax = p.anchor.e[0] - ox[i], ay = p.anchor.e[1] - oy[i], az = p.anchor.e[2] - oz[i];
+    t_out[i] = (ax * n.e[0] + ay * n.e[1] + az * n.e[2]) / denominator;
+  }
+}
+
+// Closest-hit stage, run once per primitive of the scene
+struct ClosestStage {
+  const RayQueue &q;
+  double *t_scratch;
+  double *best_t;
+  int *best_prim;
+
+  template <typename P>
+  void operator()(const P &prim, int id) {
+    intersect_stream(prim, q, t_scratch);
+    const double *t_min = q.t_min.data(), *t_max = q.t_max.data();
+    const size_t count = q.size;
+    for (size_t i = 0; i < count; ++i) {
+      bool closer = (t_scratch[i] > t_min[i]) & (t_scratch[i] < t_max[i]) & (t_scratch[i] < best_t[i]);
+      best_t[i] = closer ? t_scratch[i] : best_t[i];
+      best_prim[i] = closer ? id : best_prim[i];
+    }
+  }
+};
+
+// Occlusion stage, run once per primitive of the scene
+struct OcclusionStage {
+  const RayQueue &q;
+  double *t_scratch;
+  char *occluded;
+  // Light each ray is cast towards
+  const uint32_t *light;
+
+  template <typename P>
+  void operator()(const P &prim, int) {
+    intersect_stream(prim, q, t_scratch);
+    const double *t_min = q.t_min.data(), *t_max = q.t_max.data();
+    const size_t count = q.size;
+    for (size_t i = 0; i < count; ++i) {
+      occluded[i] |= (t_scratch[i] > t_min[i]) & (t_scratch[i] < t_max[i]);
+    }
+  }
+};
+
+// Runs the closest-hit stage over a compile-time scene, one primitive at a time
+template <typename... Prims>
+void find_closest(const StaticScene<Prims...> &scene, ClosestStage &stage) {
+  scene.visit(stage);
+}
+
+// Scenes behind an acceleration structure are queried one ray at a time
+template <typename Scene>
+void find_closest(const Scene &scene, ClosestStage &stage) {
+  for (size_t i = 0; i < stage.q.size; ++i) {
+    Hit hit;
+    hit.t = stage.best_t[i];
+    if (scene.closest(stage.q.get(i), hit)) {
+      stage.best_t[i] = hit.t;
+      stage.best_prim[i] = hit.prim;
+    }
+  }
+}
+
+template <typename... Prims>
+void find_occluded(const StaticScene<Prims...> &scene, OcclusionStage &stage) {
+  scene.visit(stage);
+}
+
+template <typename Scene>
+void find_occluded(const Scene &scene, OcclusionStage &stage) {
+  for (size_t i = 0; i < stage.q.size; ++i) {
+    stage.occluded[i] |= scene.any(stage.q.get(i), stage.light[i]);
+  }
+}
+
+// Queues and per-ray state reused across tiles
+struct Wavefront {
+  RayQueue camera;
+  RayQueue shadow;
+  std::vector<double> t_scratch;
+  std::vector<double> hit_t;
+  std::vector<int> hit_prim;
+  std::vector<vec3> radiance;
+  // Camera ray each shadow ray belongs to
+  std::vector<size_t> shadow_owner;
+  // Light each shadow ray adds to its owner if unoccluded
+  std::vector<vec3> shadow_radiance;
+  std::vector<uint32_t> shadow_light;
+  std::vector<char> occluded;
+  std::vector<Sample> samples;
+
+  // Sizes every queue and buffer, keeping the memory of larger ones, so a pooled
+  // Wavefront allocates only for the largest tile it has seen
+  // rays - camera rays per tile
+  // light_samples - shadow rays per camera ray at most
+  void resize(size_t rays, size_t light_samples = 1) {
+    const size_t shadow_rays = rays * light_samples;
+    camera.reserve(rays);
+    shadow.reserve(shadow_rays);
+    t_scratch.resize(std::max(rays, shadow_rays));
+    hit_t.resize(rays);
+    hit_prim.resize(rays);
+    radiance.resize(rays);
+    shadow_owner.resize(shadow_rays);
+    shadow_radiance.resize(shadow_rays);
+    shadow_light.resize(shadow_rays);
+    occluded.resize(shadow_rays);
+    samples.resize(rays);
+  }
+};
+
+// Renders the image in tiles, running each stage over all rays of a tile
+// Proj - Perspective or Orthographic
+// det - with det.enabled each pixel draws its own jitter, tiles still run in order on one thread
+// store - called as store(r, c, color) with each pixel's averaged color
+template <typename Proj, typename Scene, typename Store>
+void render_wavefront(const Scene &scene, const Camera &cam, size_t width, size_t height, size_t n,
+                      const Determinism &det, Store &&store) {
+  const size_t spp = n * n;
+  const int light_samples = scene.light_samples();
+  Pool<Wavefront>::Lease batch = pool<Wavefront>().acquire();
+  Wavefront &wf = *batch;
+  wf.resize(wavefront_tile_rows * width * spp, light_samples);
+
+  for (size_t row0 = 0; row0 < height; row0 += wavefront_tile_rows) {
+    const size_t rows = std::min(wavefront_tile_rows, height - row0);
+    const size_t pixels = rows * width;
+
+    // Generate: every camera ray of the tile, samples of a pixel contiguous
+    wf.camera.size = 0;
+    for (size_t p = 0; p < pixels; ++p) {
+      if (det.enabled) {
+        multi_jitter(&wf.samples[p * spp], n, det, row0 * width + p);
+      } else {
+        multi_jitter(&wf.samples[p * spp], n);
+      }
+    }
+    for (size_t p = 0; p < pixels; ++p) {
+      size_t r = row0 + p / width;
+      size_t c = p % width;
+      for (size_t i = 0; i < spp; ++i) {
+        const Sample &s = wf.samples[p * spp + i];
+        double row_ratio = (static_cast<double>(r) + s.r) / height;
+        double col_ratio = (static_cast<double>(c) + s.c) / width;
+        wf.camera.push(Proj::generate(cam, row_ratio, col_ratio));
+      }
+    }
+    const size_t count = wf.camera.size;
+
+    // Intersect: closest hit of every camera ray
+    std::fill(wf.hit_t.begin(), wf.hit_t.begin() + count, std::numeric_limits<double>::infinity());
+    std::fill(wf.hit_prim.begin(), wf.hit_prim.begin() + count, -1);
+    ClosestStage closest = {wf.camera, wf.t_scratch.data(), wf.hit_t.data(), wf.hit_prim.data()};
+    find_closest(scene, closest);
+
+    // Shade: diffuse term per picked light, queueing a shadow ray where the material
+    // needs one. Light sums match direct_light() so both paths give the same image.
+    wf.shadow.size = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (wf.hit_prim[i] < 0) {
+        wf.radiance[i] = {0, 0, 0};
+        continue;
+      }
+      Ray ray = wf.camera.get(i);
+      Hit hit;
+      hit.t = wf.hit_t[i];
+      hit.prim = wf.hit_prim[i];
+      scene.describe(ray, hit);
+
+      wf.radiance[i] = {0, 0, 0};
+      double u = hash_point(hit.p);
+      for (int j = 0; j < light_samples; ++j) {
+        LightSample light = scene.sample_light((j + u) / light_samples);
+        vec3 to_light = unit_vector(light.position - hit.p);
+        double diffuse = std::max(dot(to_light, hit.normal), 0.0);
+        if (diffuse <= 0) {
+          continue;
+        }
+        vec3 contribution = diffuse * hit.albedo * light.weight;
+        if (hit.shadowed) {
+          wf.shadow_owner[wf.shadow.size] = i;
+          wf.shadow_radiance[wf.shadow.size] = contribution;
+          wf.shadow_light[wf.shadow.size] = light.light;
+          wf.shadow.push(segment_ray(hit.p, light.position));
+        } else {
+          wf.radiance[i] += contribution;
+        }
+      }
+    }
+
+    // Shadow: any hit of every shadow ray, unoccluded ones add their light in queue
+    // order, which is each owner's light order since a hit's shadow rays are all
+    // shadowed or all not
+    std::fill(wf.occluded.begin(), wf.occluded.begin() + wf.shadow.size, 0);
+    OcclusionStage occlusion = {wf.shadow, wf.t_scratch.data(), wf.occluded.data(), wf.shadow_light.data()};
+    find_occluded(scene, occlusion);
+    for (size_t j = 0; j < wf.shadow.size; ++j) {
+      if (!wf.occluded[j]) {
+        wf.radiance[wf.shadow_owner[j]] += wf.shadow_radiance[j];
+      }
+    }
+    if (light_samples > 1) {
+      for (size_t i = 0; i < count; ++i) {
+        wf.radiance[i] /= light_samples;
+      }
+    }
+
+    // Accumulate: samples summed in the same order as the recursive path
+    for (size_t p = 0; p < pixels; ++p) {
+      vec3 color_sum = {};
+      for (size_t i = 0; i < spp; ++i) {
+        color_sum += wf.radiance[p * spp + i];
+      }
+      store(row0 + p / width, p % width, color_sum / spp);
+    }
+  }
+}
+
+#endif